@@ -587,5 +587,6 @@ void hardware_run(void)
 	run_sb(); /* Beat Karcher to this one .. 8-) - AM */
 	keyb_server_run();
 	rtc_run();
+	pkt_txq_flush();
 }
 
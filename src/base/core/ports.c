@@ -55,6 +55,10 @@ _port_handler port_handler[EMU_MAX_IO_DEVICES];
 unsigned char port_handle_table[0x10000];
 unsigned char port_andmask[0x10000];
 unsigned char port_ormask[0x10000];
+/* per-port word/dword capabilities, rebuilt whenever port_handle_table
+   changes, so that the wide accessors don't have to compare the
+   handlers of up to 4 adjacent ports on every access */
+static unsigned char port_width[0x10000];
 static unsigned char portfast_map[0x10000/8];
 unsigned char emu_io_bitmap[0x10000/8];
 static pid_t portserver_pid = 0;
@@ -66,6 +70,13 @@ static const char *crit_sect_caller;
 
 #define SET_HANDLE(p,h)		port_handle_table[(Bit16u)(p)]=(h)
 #define EMU_HANDLER(port)	port_handler[port_handle_table[(Bit16u)(port)]]
+#define PORT_WIDTH(port)	port_width[(Bit16u)(port)]
+#define PW_RD_W		1
+#define PW_WR_W		2
+#define PW_RD_D		4
+#define PW_WR_D		8
+#define PW_RD_WREP	0x10
+#define PW_WR_WREP	0x20
 enum{TYPE_INB, TYPE_OUTB, TYPE_INW, TYPE_OUTW, TYPE_IND, TYPE_OUTD, TYPE_PCI, TYPE_EXIT};
 
 /* ---------------------------------------------------------------------- */
@@ -219,10 +230,9 @@ Bit16u port_inw(ioport_t port)
 {
 	Bit16u res;
 
-	if (EMU_HANDLER(port).read_portw != NULL &&
-			EMU_HANDLER(port).read_portb == EMU_HANDLER(port + 1).read_portb
-	) {
-		res = EMU_HANDLER(port).read_portw(port, EMU_HANDLER(port).arg);
+	if (PORT_WIDTH(port) & PW_RD_W) {
+		_port_handler *ph = &EMU_HANDLER(port);
+		res = ph->read_portw(port, ph->arg);
 		return LOG_PORT_READ_W(port, res);
 	}
 	else {
@@ -240,11 +250,10 @@ Bit16u port_inw(ioport_t port)
  */
 void port_outw(ioport_t port, Bit16u word)
 {
-	if (EMU_HANDLER(port).write_portw != NULL &&
-			EMU_HANDLER(port).write_portb == EMU_HANDLER(port + 1).write_portb
-	) {
+	if (PORT_WIDTH(port) & PW_WR_W) {
+		_port_handler *ph = &EMU_HANDLER(port);
 		LOG_PORT_WRITE_W(port, word);
-		EMU_HANDLER(port).write_portw(port, word, EMU_HANDLER(port).arg);
+		ph->write_portw(port, word, ph->arg);
 	}
 	else {
 		port_outb(port, word & 0xff);
@@ -264,12 +273,9 @@ Bit32u port_ind(ioport_t port)
 {
 	Bit32u res;
 
-	if (EMU_HANDLER(port).read_portd != NULL &&
-			EMU_HANDLER(port).read_portb == EMU_HANDLER(port + 1).read_portb &&
-			EMU_HANDLER(port).read_portb == EMU_HANDLER(port + 2).read_portb &&
-			EMU_HANDLER(port).read_portb == EMU_HANDLER(port + 3).read_portb
-	) {
-		res = EMU_HANDLER(port).read_portd(port, EMU_HANDLER(port).arg);
+	if (PORT_WIDTH(port) & PW_RD_D) {
+		_port_handler *ph = &EMU_HANDLER(port);
+		res = ph->read_portd(port, ph->arg);
 	}
 	else {
 		res = (Bit32u) port_inw(port) | (((Bit32u) port_inw(port + 2)) << 16);
@@ -280,12 +286,9 @@ Bit32u port_ind(ioport_t port)
 void port_outd(ioport_t port, Bit32u dword)
 {
 	LOG_PORT_WRITE_D(port, dword);
-	if (EMU_HANDLER(port).write_portd != NULL &&
-			EMU_HANDLER(port).write_portb == EMU_HANDLER(port + 1).write_portb &&
-			EMU_HANDLER(port).write_portb == EMU_HANDLER(port + 2).write_portb &&
-			EMU_HANDLER(port).write_portb == EMU_HANDLER(port + 3).write_portb
-	) {
-		EMU_HANDLER(port).write_portd(port, dword, EMU_HANDLER(port).arg);
+	if (PORT_WIDTH(port) & PW_WR_D) {
+		_port_handler *ph = &EMU_HANDLER(port);
+		ph->write_portd(port, dword, ph->arg);
 	}
 	else {
 		port_outw(port, dword & 0xffff);
@@ -293,6 +296,48 @@ void port_outd(ioport_t port, Bit32u dword)
 	}
 }
 
+/*
+ * SIDOC_BEGIN_FUNCTION port_width_update(int start, int end)
+ *
+ * Recomputes port_width[] for ports start..end. A wide access at a
+ * port depends on the handlers of the following ports too, so callers
+ * pass the start of the changed range minus 3.
+ *
+ * SIDOC_END_FUNCTION
+ */
+static void port_width_update(int start, int end)
+{
+	int i;
+
+	for (i = start; i <= end; i++) {
+		ioport_t port = (Bit16u)i;
+		_port_handler *ph = &EMU_HANDLER(port);
+		_port_handler *ph1 = &EMU_HANDLER(port + 1);
+		_port_handler *ph2 = &EMU_HANDLER(port + 2);
+		_port_handler *ph3 = &EMU_HANDLER(port + 3);
+		unsigned char w = 0;
+
+		if (ph->read_portw && ph->read_portb == ph1->read_portb) {
+			w |= PW_RD_W;
+			if (ph->read_portw_rep)
+				w |= PW_RD_WREP;
+		}
+		if (ph->write_portw && ph->write_portb == ph1->write_portb) {
+			w |= PW_WR_W;
+			if (ph->write_portw_rep)
+				w |= PW_WR_WREP;
+		}
+		if (ph->read_portd && ph->read_portb == ph1->read_portb &&
+				ph->read_portb == ph2->read_portb &&
+				ph->read_portb == ph3->read_portb)
+			w |= PW_RD_D;
+		if (ph->write_portd && ph->write_portb == ph1->write_portb &&
+				ph->write_portb == ph2->write_portb &&
+				ph->write_portb == ph3->write_portb)
+			w |= PW_WR_D;
+		port_width[port] = w;
+	}
+}
 
 /* ---------------------------------------------------------------------- */
 /* the following functions are all static!				  */
@@ -614,17 +659,23 @@ int port_rep_inw(ioport_t port, Bit16u *base, int df, Bit32u count)
 	if (count==0) return 0;
 	i_printf("Doing REP insw(%#x) %d words at %p, DF %d\n", port,
 		count, base, df);
-	if (EMU_HANDLER(port).read_portw == NULL) {
-	  Bit16u res;
+	if (PORT_WIDTH(port) & PW_RD_WREP) {
+	  _port_handler *ph = &EMU_HANDLER(port);
+	  ph->read_portw_rep(port, dest, df, count, ph->arg);
+	  dest += incr * count;
+	}
+	else if (PORT_WIDTH(port) & PW_RD_W) {
+	  _port_handler *ph = &EMU_HANDLER(port);
 	  while (count--) {
-	    res = port_inb(port);
-	    *dest = ((Bit16u)port_inb(port+1) <<8) | res;
+	    *dest = ph->read_portw(port, ph->arg);
 	    dest += incr;
 	  }
 	}
 	else {
+	  Bit16u res;
 	  while (count--) {
-	    *dest = port_inw(port);
+	    res = port_inb(port);
+	    *dest = ((Bit16u)port_inb(port+1) <<8) | res;
 	    dest += incr;
 	  }
 	}
@@ -647,26 +698,33 @@ int port_rep_outw(ioport_t port, Bit16u *base, int df, Bit32u count)
 	if (count==0) return 0;
 	i_printf("Doing REP outsw(%#x) %d words at %p, DF %d\n", port,
 		count, base, df);
-	if (EMU_HANDLER(port).write_portw == NULL) {
-	  Bit16u res;
-	  while (count--) {
-	    res = *dest, dest += incr;
-	    port_outb(port, res);
-	    port_outb(port+1, res>>8);
-	  }
-	}
-	else {
-	  while (count--) {
-	    port_outw(port, *dest);
-	    dest += incr;
-	  }
-	}
 	if (debug_level('T')) {
 		dest = base;
 		while (count_--) {
 			LOG_PORT_WRITE_W(port, *dest);
 			dest += incr;
 		}
+		dest = base;
+	}
+	if (PORT_WIDTH(port) & PW_WR_WREP) {
+	  _port_handler *ph = &EMU_HANDLER(port);
+	  ph->write_portw_rep(port, dest, df, count, ph->arg);
+	  dest += incr * count;
+	}
+	else if (PORT_WIDTH(port) & PW_WR_W) {
+	  _port_handler *ph = &EMU_HANDLER(port);
+	  while (count--) {
+	    ph->write_portw(port, *dest, ph->arg);
+	    dest += incr;
+	  }
+	}
+	else {
+	  Bit16u res;
+	  while (count--) {
+	    res = *dest, dest += incr;
+	    port_outb(port, res);
+	    port_outb(port+1, res>>8);
+	  }
 	}
 	return (Bit8u *)dest-(Bit8u *)base;
 }
@@ -814,6 +872,8 @@ int port_init(void)
 	  port_handler[i].write_portw  = NULL;
 	  port_handler[i].read_portd   = NULL;
 	  port_handler[i].write_portd  = NULL;
+	  port_handler[i].read_portw_rep  = NULL;
+	  port_handler[i].write_portw_rep = NULL;
 	}
 
   /* handle 0 maps to the unmapped IO device handler.  Basically any
@@ -885,6 +945,7 @@ int port_init(void)
 	memset (port_handle_table, NO_HANDLE, sizeof(port_handle_table));
 	memset (port_andmask, 0xff, sizeof(port_andmask));
 	memset (port_ormask, 0, sizeof(port_ormask));
+	port_width_update(0, 0xffff);
 
 	return port_handles;	/* unused but useful */
 }
@@ -1077,7 +1138,7 @@ void release_ports (void)
 	memset (port_handle_table, NO_HANDLE, sizeof(port_handle_table));
 	memset (port_andmask, 0xff, sizeof(port_andmask));
 	memset (port_ormask, 0, sizeof(port_ormask));
-
+	port_width_update(0, 0xffff);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -1132,6 +1193,7 @@ int port_register_handler(emu_iodev_t device, int flags)
 	if (flags & PORT_FORCE_FAST) /* force fast, no tracing allowed */
 		set_bit(i, portfast_map);
     }
+    port_width_update(device.start_addr - 3, device.end_addr);
 
     i_printf("PORT: registered \"%s\" handle 0x%02x [0x%04x-0x%04x]\n",
 	port_handler[handle].handler_name, handle, device.start_addr,
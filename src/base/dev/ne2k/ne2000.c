@@ -29,6 +29,7 @@
 #include "emu.h"
 #include "dosemu_debug.h"
 #include "ioselect.h"
+#include "sig.h"
 #include "pic.h"
 #include "port.h"
 #include "libpacket.h"
@@ -172,16 +173,21 @@ static NE2000State ne2000state;
 // For io_device
 Bit16u ne2000_io_read16(ioport_t port, void *arg);
 void ne2000_io_write16(ioport_t port, Bit16u value, void *arg);
+static void ne2000_io_read16_rep(ioport_t port, Bit16u *dest, int df,
+                                 Bit32u count, void *arg);
+static void ne2000_io_write16_rep(ioport_t port, Bit16u *src, int df,
+                                  Bit32u count, void *arg);
 Bit8u ne2000_io_read8(ioport_t port, void *arg);
 void ne2000_io_write8(ioport_t port, Bit8u value, void *arg);
 static void ne2000_irq_activate(int);
 
 static void ne2000_receive_req_async(int fd, void *arg);
+static void ne2000_rx_drain(NE2000State *s);
 static size_t ne2000_receive(NE2000State *s, const uint8_t *buf, size_t size_);
 static int ne2000_buffer_full(NE2000State *s);
 
 #ifdef DEBUG_NE2000
-static void N_printhdr(uint8_t *buf);
+static void N_printhdr(const uint8_t *buf);
 #endif
 
 static void init_cbk(int fd, int mode)
@@ -213,6 +219,8 @@ void ne2000_init(void)
     io_device.write_portb = ne2000_io_write8;
     io_device.read_portw = ne2000_io_read16;
     io_device.write_portw = ne2000_io_write16;
+    io_device.read_portw_rep = ne2000_io_read16_rep;
+    io_device.write_portw_rep = ne2000_io_write16_rep;
     io_device.read_portd = NULL;
     io_device.write_portd = NULL;
     io_device.handler_name = "NE2000 Emulation";
@@ -295,47 +303,45 @@ static void ne2000_ether_send(NE2000State *s, uint8_t *buf, int len)
     N_printf("NE2000: ne2000_ether_send(%p, %d)\n", buf, len);
     N_printhdr(buf);
 #endif
-    slen = write(s->fdnet, buf, len);
+    slen = pkt_txq_put(s->fdnet, buf, len);
     if (slen < 0)
-        N_printf("NE2000: write() call failed: %s\n", strerror(errno));
+        N_printf("NE2000: send failed: %s\n", strerror(errno));
     else if (slen < len)
-        N_printf("NE2000: write() call underrun: %d/%d\n", slen, len);
+        N_printf("NE2000: send underrun: %d/%d\n", slen, len);
 }
 
-static int ne2000_ether_recv(NE2000State *s, uint8_t *buf, int bufsiz)
+/* Moves queued frames to the card memory while it has room. The fd
+   is unmasked only once the queue is empty, frames left over wait for
+   the driver to free some pages. */
+static void ne2000_rx_drain(NE2000State *s)
 {
-    int ret;
+    const void *buf;
+    ssize_t len;
 
-    ret = read(s->fdnet, buf, bufsiz);
-    if (ret < 0) {
-        error("NE2000: ne2000_ether_recv() read failed\n");
-        return -1;
+    while ((len = pkt_rxq_peek(&buf)) > 0) {
+        if (ne2000_buffer_full(s)) {
+            N_printf("NE2000: ne2000_rx_drain() buffer full\n");
+            return;
+        }
+        N_printf("NE2000: ne2000_rx_drain() got %zd bytes\n", len);
+        N_printhdr(buf);
+        ne2000_receive(s, buf, len);
+        pkt_rxq_pop();
     }
     ioselect_complete(s->fdnet);
+}
 
-    N_printf("NE2000: ne2000_ether_recv() read %d bytes\n", ret);
-    N_printhdr(buf);
-    return ret;
+static void ne2000_rx_bh(void *arg)
+{
+    ne2000_rx_drain(&ne2000state);
 }
 
+/* runs in the io thread */
 static void ne2000_receive_req_async(int fd, void *arg)
 {
-    NE2000State *s = &ne2000state;
-    uint8_t mybuf[MAX_ETH_FRAME_SIZE];
-    int ret;
-
-    if (ne2000_buffer_full(s)) {
-        N_printf("NE2000: ne2000_receive_req_async() called but buffer full\n");
-        return;
-    }
-
     N_printf("NE2000: ne2000_receive_req_async() called\n");
-
-    ret = ne2000_ether_recv(s, mybuf, sizeof mybuf);
-    if (ret < 0)
-        return;
-
-    ne2000_receive(s, mybuf, ret);
+    pkt_rxq_fill(fd, NULL);
+    add_thread_callback(ne2000_rx_bh, NULL, "ne2000 rx");
 }
 
 static void ne2000_update_irq(NE2000State *s)
@@ -487,7 +493,10 @@ static void ne2000_ioport_write(NE2000State *s, uint32_t addr, uint32_t val)
         if (!(val & E8390_STOP)) { /* START bit makes no sense on RTL8029... */
             if (old_cmd & E8390_STOP) {
                 N_printf("NE2000: enable receiver\n");
-                add_to_io_select(s->fdnet, ne2000_receive_req_async, NULL);
+                add_to_io_select_masked(s->fdnet, ne2000_receive_req_async,
+                        NULL);
+                /* pick up what was queued while stopped */
+                ne2000_rx_drain(s);
             }
             s->isr &= ~ENISR_RESET;
             /* test specific case: zero length transfer */
@@ -579,7 +588,7 @@ static void ne2000_ioport_write(NE2000State *s, uint32_t addr, uint32_t val)
 
     /* flush if buffer was full */
     if (old_full && !ne2000_buffer_full(s))
-        ioselect_complete(s->fdnet);
+        ne2000_rx_drain(s);
 }
 
 static uint32_t ne2000_ioport_read(NE2000State *s, uint32_t addr)
@@ -897,6 +906,75 @@ void ne2000_io_write16(ioport_t port, Bit16u value, void *arg)
         ne2000_write(s, addr, (uint8_t)value, 1); /* default to 8 bit */
 }
 
+/* REP INSW/OUTSW: remote DMA through the data port in one go */
+static int ne2000_dma_block(NE2000State *s, int df, Bit32u count)
+{
+    uint32_t len = count * 2;
+
+    /* only the simple case: 16bit, ascending, no wrap, within rcnt */
+    if (df || !(s->dcfg & 0x01) || (s->rsar & 1) || len > s->rcnt)
+        return 0;
+    if (s->rsar < NE2000_PMEM_START || s->rsar + len > NE2000_MEM_SIZE)
+        return 0;
+    if (s->rsar < s->stop && s->rsar + len > s->stop)
+        return 0;
+    return 1;
+}
+
+static void ne2000_io_read16_rep(ioport_t port, Bit16u *dest, int df,
+                                 Bit32u count, void *arg)
+{
+    NE2000State *s = &ne2000state;
+    ioport_t addr = port - NE2000_IOBASE;
+    int incr = df ? -1 : 1;
+
+    N_printf("\nNE2000: ne2000_io_read16_rep(%u)\n", count);
+
+    if (addr == 0x10 && ne2000_dma_block(s, df, count)) {
+        memcpy(dest, s->mem + s->rsar, count * 2);
+        ne2000_dma_update(s, count * 2);
+        return;
+    }
+    if (addr != 0x10) {
+        while (count--) {
+            *dest = ne2000_read(s, addr, 1);
+            dest += incr;
+        }
+        return;
+    }
+    while (count--) {
+        *dest = ne2000_asic_ioport_read(s, addr);
+        dest += incr;
+    }
+}
+
+static void ne2000_io_write16_rep(ioport_t port, Bit16u *src, int df,
+                                  Bit32u count, void *arg)
+{
+    NE2000State *s = &ne2000state;
+    ioport_t addr = port - NE2000_IOBASE;
+    int incr = df ? -1 : 1;
+
+    N_printf("\nNE2000: ne2000_io_write16_rep(%u)\n", count);
+
+    if (addr == 0x10 && ne2000_dma_block(s, df, count)) {
+        memcpy(s->mem + s->rsar, src, count * 2);
+        ne2000_dma_update(s, count * 2);
+        return;
+    }
+    if (addr != 0x10) {
+        while (count--) {
+            ne2000_write(s, addr, (uint8_t)*src, 1);
+            src += incr;
+        }
+        return;
+    }
+    while (count--) {
+        ne2000_asic_ioport_write(s, addr, *src);
+        src += incr;
+    }
+}
+
 /* --------------------------------- */
 
 /* handle io reads from ne2000 */
@@ -938,7 +1016,7 @@ static void ne2000_irq_activate(int level)
 
 /* debug print an ethernet header */
 #ifdef DEBUG_NE2000
-static void N_printhdr(uint8_t *buf)
+static void N_printhdr(const uint8_t *buf)
 {
     N_printf("NE2000: dest[%02x,%02x,%02x,%02x,%02x,%02x]\n"
              "         src[%02x,%02x,%02x,%02x,%02x,%02x]\n"
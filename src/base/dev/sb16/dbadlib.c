@@ -188,7 +188,11 @@ static void dbadlib_PortWrite(void *impl, uint16_t port, uint8_t val ) {
 		reg.normal = val & 0x1ff;
 	}
 	if (add_ev) {
-		struct seq_item_s *i = sequencer_add(seq, GETusTIME(0));
+		long long time = GETusTIME(0);
+		struct seq_item_s *i = sequencer_add(seq, time);
+		/* replayable with src/base/dev/sb16/oplbench.c */
+		if (debug_level('S') >= 9)
+			S_printf("Adlib: event %lld %x %x\n", time, port, val);
 		sequencer_add_tag(i, STAG_PORT, port);
 		sequencer_add_tag(i, STAG_VAL, val);
 	}
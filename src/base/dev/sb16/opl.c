@@ -316,6 +316,130 @@ optype_fptr opfuncs[6] = {
 	operator_off
 };
 
+// Envelope stages that cannot change within a block: sustain, off and a
+// sustain_nokeep that already decayed to zero (quiet operators).
+static bool operator_static(op_type* op_pt) {
+	switch (op_pt->op_state) {
+	case OF_TYPE_SUS:
+	case OF_TYPE_OFF:
+		return true;
+	case OF_TYPE_SUS_NOKEEP:
+		return (op_pt->amp == 0.0) && (op_pt->step_amp == 0.0);
+	}
+	return false;
+}
+
+// Render a block of an operator, giving the same result as calling
+// operator_advance(), the envelope function and operator_output() for
+// every sample. Phase, envelope and output are computed in separate
+// loops; the phase and output ones are call-free so that the compiler
+// can vectorize them, and the envelope loop is skipped entirely for
+// operators in a static stage. Only self-feedback stays sequential.
+// modulator holds the (already scaled) modulator input or is NULL.
+// Returns false, leaving out untouched, if the block is all silence.
+static bool operator_render(op_type* op_pt, Bit32s* vib, Bit32s* trem,
+		Bit32s* modulator, bool feedback, Bit32s* out, Bits n) {
+	Bit32u pos[BLOCKBUF_SIZE];
+	fltype ampvol[BLOCKBUF_SIZE];
+	Bit32u tcount = op_pt->tcount;
+	Bit32u tinc = op_pt->tinc;
+	bool is_static = operator_static(op_pt);
+	Bit16s* wform = op_pt->cur_wform;
+	Bit32u wmask = op_pt->cur_wmask;
+	Bits i, n_on = n;
+
+	if (n <= 0) return false;
+	if (op_pt->op_state == OF_TYPE_OFF) {
+		// inactive operator: only the phase and generator move on
+		if (vib == vibval_const) {
+			op_pt->wfpos = tcount + (Bit32u)(n-1)*tinc;
+			op_pt->tcount = tcount + (Bit32u)n*tinc;
+		} else {
+			for (i=0;i<n;i++) {
+				op_pt->wfpos = tcount;
+				tcount += tinc;
+				tcount += (int64_t)tinc*vib[i]/FIXEDPT;
+			}
+			op_pt->tcount = tcount;
+		}
+		op_pt->generator_pos += (Bit32u)n*generator_add;
+		if (op_pt->cval == 0) return false;
+		for (i=0;i<n;i++)
+			out[i] = op_pt->cval;
+		return true;
+	}
+	if (vib == vibval_const) {
+		for (i=0;i<n;i++)
+			pos[i] = tcount + (Bit32u)i*tinc;
+		tcount += (Bit32u)n*tinc;
+	} else {
+		for (i=0;i<n;i++) {
+			pos[i] = tcount;
+			tcount += tinc;
+			tcount += (int64_t)tinc*vib[i]/FIXEDPT;
+		}
+	}
+	op_pt->wfpos = pos[n-1];
+	op_pt->tcount = tcount;
+
+	if (is_static) {
+		op_pt->generator_pos += (Bit32u)n*generator_add;
+		if (op_pt->step_amp*op_pt->vol == 0.0) {
+			// quiet operator, nothing to look up
+			op_pt->lastcval = (n > 1) ? 0 : op_pt->cval;
+			op_pt->cval = 0;
+			opfuncs[op_pt->op_state](op_pt);
+			return false;
+		}
+		for (i=0;i<n;i++)
+			ampvol[i] = op_pt->step_amp*op_pt->vol;
+	} else {
+		for (i=0;i<n;i++) {
+			op_pt->generator_pos += generator_add;
+			opfuncs[op_pt->op_state](op_pt);
+			if (op_pt->op_state == OF_TYPE_OFF) {
+				// release finished, the rest of the block only advances
+				n_on = i;
+				op_pt->generator_pos += (Bit32u)(n-i-1)*generator_add;
+				break;
+			}
+			ampvol[i] = op_pt->step_amp*op_pt->vol;
+		}
+	}
+
+	if (n_on > 0) {
+		if (feedback && op_pt->mfbi) {
+			Bit32s cval = op_pt->cval, lastcval = op_pt->lastcval;
+			for (i=0;i<n_on;i++) {
+				Bit32u idx = (pos[i]+(lastcval+cval)*op_pt->mfbi/2)/FIXEDPT;
+				lastcval = cval;
+				cval = (Bit32s)(ampvol[i]*wform[idx&wmask]*trem[i]/16.0);
+				out[i] = cval;
+			}
+		} else if (modulator) {
+			for (i=0;i<n_on;i++) {
+				Bit32u idx = (pos[i]+modulator[i])/FIXEDPT;
+				out[i] = (Bit32s)(ampvol[i]*wform[idx&wmask]*trem[i]/16.0);
+			}
+		} else {
+			for (i=0;i<n_on;i++) {
+				Bit32u idx = pos[i]/FIXEDPT;
+				out[i] = (Bit32s)(ampvol[i]*wform[idx&wmask]*trem[i]/16.0);
+			}
+		}
+		op_pt->lastcval = (n_on > 1) ? out[n_on-2] : op_pt->cval;
+		op_pt->cval = out[n_on-1];
+	}
+	// output is not updated for an operator that is off
+	for (i=n_on;i<n;i++)
+		out[i] = op_pt->cval;
+
+	// static stages catch up with the envelope generator once per block
+	if (is_static)
+		opfuncs[op_pt->op_state](op_pt);
+	return true;
+}
+
 static void change_attackrate(Bitu regbase, op_type* op_pt) {
 	Bits attackrate = adlibreg[ARC_ATTR_DECR+regbase]>>4;
 	if (attackrate) {
@@ -1290,19 +1414,22 @@ void opl_getsample(Bit16s* sndptr, Bits numsamples) {
 				else tremval2 = tremval_const;
 
 				// calculate channel output
-				for (i=0;i<endsamples;i++) {
-					// carrier1
-					operator_advance(&cptr[0],vibval1[i]);
-					opfuncs[cptr[0].op_state](&cptr[0]);
-					operator_output(&cptr[0],(cptr[0].lastcval+cptr[0].cval)*cptr[0].mfbi/2,tremval1[i]);
-
-					// carrier2
-					operator_advance(&cptr[9],vibval2[i]);
-					opfuncs[cptr[9].op_state](&cptr[9]);
-					operator_output(&cptr[9],0,tremval2[i]);
-
-					Bit32s chanval = cptr[9].cval + cptr[0].cval;
-					CHANVAL_OUT
+				{
+					Bit32s out1[BLOCKBUF_SIZE], out2[BLOCKBUF_SIZE];
+					bool on1 = operator_render(&cptr[0],vibval1,tremval1,NULL,true,out1,endsamples);	// carrier1
+					bool on2 = operator_render(&cptr[9],vibval2,tremval2,NULL,false,out2,endsamples);	// carrier2
+					if (on1 && on2) {
+						for (i=0;i<endsamples;i++) {
+							Bit32s chanval = out2[i] + out1[i];
+							CHANVAL_OUT
+						}
+					} else if (on1 || on2) {
+						Bit32s* out = on1 ? out1 : out2;
+						for (i=0;i<endsamples;i++) {
+							Bit32s chanval = out[i];
+							CHANVAL_OUT
+						}
+					}
 				}
 			} else {
 #if defined(OPLTYPE_IS_OPL3)
@@ -1428,19 +1555,19 @@ void opl_getsample(Bit16s* sndptr, Bits numsamples) {
 				else tremval2 = tremval_const;
 
 				// calculate channel output
-				for (i=0;i<endsamples;i++) {
-					// modulator
-					operator_advance(&cptr[0],vibval1[i]);
-					opfuncs[cptr[0].op_state](&cptr[0]);
-					operator_output(&cptr[0],(cptr[0].lastcval+cptr[0].cval)*cptr[0].mfbi/2,tremval1[i]);
-
-					// carrier
-					operator_advance(&cptr[9],vibval2[i]);
-					opfuncs[cptr[9].op_state](&cptr[9]);
-					operator_output(&cptr[9],cptr[0].cval*FIXEDPT,tremval2[i]);
-
-					Bit32s chanval = cptr[9].cval;
-					CHANVAL_OUT
+				{
+					Bit32s out1[BLOCKBUF_SIZE], out2[BLOCKBUF_SIZE];
+					bool on1 = operator_render(&cptr[0],vibval1,tremval1,NULL,true,out1,endsamples);	// modulator
+					if (on1) {
+						for (i=0;i<endsamples;i++)
+							out1[i] *= FIXEDPT;
+					}
+					if (operator_render(&cptr[9],vibval2,tremval2,on1?out1:NULL,false,out2,endsamples)) {	// carrier
+						for (i=0;i<endsamples;i++) {
+							Bit32s chanval = out2[i];
+							CHANVAL_OUT
+						}
+					}
 				}
 			}
 		}
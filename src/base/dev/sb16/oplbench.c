@@ -0,0 +1,241 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Standalone OPL3 render benchmark, not part of the dosemu build.
+ *
+ * It replays the "Adlib: event" lines dbadlib.c writes to the debug log
+ * with sound debug at level 9 (-D9S), or a built-in tune, through opl.c,
+ * the same way dbadlib_generate() does, and reports the render speed
+ * and a checksum of the output, so that changes to opl.c can be checked
+ * for both speed and bit-exactness.
+ *
+ * Build: cc -O2 -DOPLTYPE_IS_OPL3 -I../../../include oplbench.c opl.c -lm
+ * Usage: oplbench [-r repeat] [debug.log]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+#include "types.h"
+#include "opl.h"
+
+#define BENCH_RATE 44100
+#define BENCH_BUF 512
+
+struct opl_event {
+	long long time;
+	int port;
+	int val;
+};
+
+static struct opl_event *events;
+static int num_events, max_events;
+
+static void add_event(long long time, int port, int val)
+{
+	if (num_events == max_events) {
+		max_events = max_events ? max_events * 2 : 1024;
+		events = realloc(events, max_events * sizeof(*events));
+		if (!events) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	events[num_events].time = time;
+	events[num_events].port = port;
+	events[num_events].val = val;
+	num_events++;
+}
+
+static void add_reg(long long time, int reg, int val)
+{
+	add_event(time, (reg & 0x100) ? 2 : 0, reg & 0xff);
+	add_event(time, (reg & 0x100) ? 3 : 1, val);
+}
+
+static int load_log(const char *name)
+{
+	char line[256];
+	FILE *f = fopen(name, "r");
+
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		long long time;
+		int port, val;
+		char *p = strstr(line, "Adlib: event ");
+		if (!p)
+			continue;
+		if (sscanf(p, "Adlib: event %lld %x %x", &time, &port, &val) == 3)
+			add_event(time, port, val);
+	}
+	fclose(f);
+	return 0;
+}
+
+/* some sustained melodic voices, a few decaying ones and drums */
+static void make_tune(void)
+{
+	static const Bit8u chan_op[9] = { 0, 1, 2, 8, 9, 10, 16, 17, 18 };
+	static const int fnum[9] = { 0x157, 0x181, 0x1b0, 0x1ca, 0x202,
+				     0x241, 0x287, 0x2ae, 0x157 };
+	long long t = 0;
+	int i, n;
+
+	add_reg(t, 0x01, 0x20);
+	for (i = 0; i < 9; i++) {
+		int m = chan_op[i], c = m + 3;
+		/* sustained for even channels, decaying for odd ones */
+		int sus = (i & 1) ? 0x00 : 0x20;
+		add_reg(t, 0x20 + m, 0x01 | sus | ((i % 3 == 0) ? 0xc0 : 0));
+		add_reg(t, 0x20 + c, 0x01 | sus);
+		add_reg(t, 0x40 + m, 0x10 + i);
+		add_reg(t, 0x40 + c, 0x00);
+		add_reg(t, 0x60 + m, 0xf4);
+		add_reg(t, 0x60 + c, 0xf2);
+		add_reg(t, 0x80 + m, 0x57);
+		add_reg(t, 0x80 + c, 0x46);
+		add_reg(t, 0xe0 + m, i & 3);
+		add_reg(t, 0xc0 + i, 0x30 | ((i % 3) << 1) | (i == 4));
+	}
+	for (n = 0; n < 8; n++) {
+		for (i = 0; i < 9; i++) {
+			int f = fnum[(i + n) % 9];
+			add_reg(t, 0xa0 + i, f & 0xff);
+			add_reg(t, 0xb0 + i, 0x20 | (((4 + (i & 1)) << 2)) |
+				((f >> 8) & 3));
+		}
+		t += 1500000;
+		for (i = 0; i < 9; i++)
+			add_reg(t, 0xb0 + i, 0x00 | (4 << 2));
+		t += 500000;
+	}
+	/* plucked notes that are never keyed off, as many games do */
+	for (n = 0; n < 4; n++) {
+		for (i = 0; i < 9; i++) {
+			int m = chan_op[i], c = m + 3;
+			int f = fnum[(i * 2 + n) % 9];
+			add_reg(t, 0x20 + m, 0x01);
+			add_reg(t, 0x20 + c, 0x01);
+			add_reg(t, 0x80 + m, 0x3c);
+			add_reg(t, 0x80 + c, 0x3a);
+			add_reg(t, 0xb0 + i, 0x00 | (4 << 2));
+			add_reg(t, 0xa0 + i, f & 0xff);
+			add_reg(t, 0xb0 + i, 0x20 | (5 << 2) | ((f >> 8) & 3));
+			t += 250000;
+		}
+		t += 2000000;
+	}
+	/* a bar of drums */
+	for (n = 0; n < 16; n++) {
+		add_reg(t, 0xbd, 0x20 | (1 << (n % 5)));
+		t += 125000;
+		add_reg(t, 0xbd, 0x20);
+	}
+	add_reg(t, 0xbd, 0x00);
+	t += 1000000;
+	add_event(t, 0, 0);
+}
+
+static unsigned int checksum(unsigned int h, const Bit16s *buf, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		h ^= (Bit16u)buf[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+/* mirrors dbadlib_generate(): render up to each event, then apply it */
+static long long replay(unsigned int *sum)
+{
+	Bit16s buf[BENCH_BUF * 2];
+	long long total = 0;
+	double period = 1000000.0 / BENCH_RATE;
+	double cur = events[0].time;
+	int opl_idx = 0;
+	int i = 0;
+
+	opl_init(BENCH_RATE);
+	while (i < num_events) {
+		int todo = (events[i].time - cur) / period;
+		while (todo > 0) {
+			int n = todo > BENCH_BUF ? BENCH_BUF : todo;
+			opl_getsample(buf, n);
+			*sum = checksum(*sum, buf, n * 2);
+			cur += n * period;
+			total += n;
+			todo -= n;
+		}
+		if (events[i].port & 1) {
+			opl_write(opl_idx, events[i].val);
+		} else {
+			opl_write_index(events[i].port, events[i].val);
+			opl_idx = events[i].val & 0x1ff;
+		}
+		i++;
+	}
+	return total;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec t0, t1;
+	unsigned int sum = 2166136261u;
+	long long samples = 0;
+	double secs;
+	int repeat = 1;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "r:")) != -1) {
+		switch (c) {
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r repeat] [debug.log]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc) {
+		if (load_log(argv[optind]) < 0)
+			return 1;
+	} else {
+		make_tune();
+	}
+	if (!num_events) {
+		fprintf(stderr, "no Adlib events found\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < repeat; i++)
+		samples += replay(&sum);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	printf("%lld frames in %.3fs, %.1fx realtime, checksum %08x\n",
+	       samples, secs, samples / (double)BENCH_RATE / secs, sum);
+	return 0;
+}
@@ -192,6 +192,18 @@
 #define NONE	VGA_PROT_NONE
 #define DEF_PROT (vga.inst_emu==EMU_ALL_INST ? NONE : RO)
 
+/*
+ * Below the page granularity of dirty_map[], dirty_blocks[] has a bit
+ * for each 256 byte block of a page. Writes whose extent is known set
+ * just their blocks, protection faults and KVM's dirty log set all of
+ * them. The bits only narrow down the range of a dirty page: a dirty
+ * page without any bit set is dirty as a whole, and bits left over
+ * from earlier just widen the range.
+ */
+#define VGA_BLOCK_SHIFT		8
+#define VGA_PAGE_BLOCKS		(PAGE_SIZE >> VGA_BLOCK_SHIFT)
+#define VGA_BLOCKS_ALL		((1 << VGA_PAGE_BLOCKS) - 1)
+
 /*
  * We add PROT_EXEC just because pages should be executable. Of course
  * Intel's x86 processors do not all support non-executable pages, but anyway...
@@ -293,6 +305,7 @@ static int vga_emu_map(unsigned, unsigned);
 static int _vga_emu_adjust_protection(unsigned page, unsigned mapped_page,
 	int prot, int dirty);
 static void _vgaemu_dirty_page(int page, int dirty);
+static void vgaemu_dirty_blocks(int page, int dirty, unsigned blocks);
 #if 0
 static int vgaemu_unmap(unsigned);
 #endif
@@ -725,6 +738,43 @@ static Bit32u Logical_VGA_CalcNewVal (unsigned char value)
   return new_val;
 }
 
+/* the blocks of `page' covered by [offset, offset + len) */
+static unsigned vga_page_blocks(unsigned page, unsigned offset, unsigned len)
+{
+  unsigned start = offset, end = offset + len;
+  unsigned first = 0, last = VGA_PAGE_BLOCKS - 1;
+
+  if (start > page << PAGE_SHIFT)
+    first = (start & (PAGE_SIZE - 1)) >> VGA_BLOCK_SHIFT;
+  if (end < (page + 1) << PAGE_SHIFT)
+    last = ((end - 1) & (PAGE_SIZE - 1)) >> VGA_BLOCK_SHIFT;
+  return ((2 << last) - 1) & ~((1 << first) - 1);
+}
+
+static void vga_set_dirty_blocks(unsigned page, unsigned blocks)
+{
+  __atomic_fetch_or(&vga.mem.dirty_blocks[page], blocks, __ATOMIC_RELAXED);
+  __atomic_store_n(&vga.mem.dirty_map[page], 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Mark the blocks of all planes touched by a logical write dirty. The
+ * pages stay protected while instremu is active, so only the flags for
+ * the update code change, which needs no prot_mtx.
+ */
+static void Logical_VGA_dirty(unsigned offset, int len)
+{
+  unsigned page, blocks;
+
+  for (page = offset >> 12; page <= (offset + len - 1) >> 12; page++) {
+    blocks = vga_page_blocks(page, offset, len);
+    vga_set_dirty_blocks(page, blocks);
+    vga_set_dirty_blocks(page + 0x10, blocks);
+    vga_set_dirty_blocks(page + 0x20, blocks);
+    vga_set_dirty_blocks(page + 0x30, blocks);
+  }
+}
+
 static void Logical_VGA_write(unsigned offset, unsigned char value)
 {
   unsigned vga_page;
@@ -755,14 +805,171 @@ static void Logical_VGA_write(unsigned offset, unsigned char value)
     // not optimal, but works better with update function -- sw
     if (debug_level('v') >= 9)
         vga_deb_map("LogicalWrite dirty page %i\n", vga_page);
-    pthread_mutex_lock(&prot_mtx);
-    vga.mem.dirty_map[vga_page] = 1;
-    vga.mem.dirty_map[vga_page + 0x10] = 1;
-    vga.mem.dirty_map[vga_page + 0x20] = 1;
-    vga.mem.dirty_map[vga_page + 0x30] = 1;
-    pthread_mutex_unlock(&prot_mtx);
+    Logical_VGA_dirty(offset, 1);
+  }
+
+}
+
+/*
+ * Span versions of Logical_VGA_write() for REP STOS/MOVS and friends.
+ * Writes don't change the latches, so every plane of a span is handled
+ * in one go: either a memset()/memcpy() or a simple per-plane loop the
+ * compiler can vectorize, which saves a per-CPU dispatch like remap.c's.
+ */
+
+#define VGA_SPAN_CHUNK 256
+
+static inline unsigned char vga_ror(unsigned char v)
+{
+  return (v >> DataRotate) | (v << (8 - DataRotate));
+}
+
+/* rasterop of one plane: val and msk are per byte, latch is constant */
+static void plane_rop(unsigned char *dst, const unsigned char *val,
+    const unsigned char *msk, unsigned char latch, int n)
+{
+  int i;
+
+  switch (RasterOp) {
+    case 0: /* replace */
+      for (i = 0; i < n; i++)
+        dst[i] = (val[i] & msk[i]) | (latch & ~msk[i]);
+      break;
+    case 1: /* AND with latch data */
+      for (i = 0; i < n; i++)
+        dst[i] = (val[i] | ~msk[i]) & latch;
+      break;
+    case 2: /* OR with latch data */
+      for (i = 0; i < n; i++)
+        dst[i] = (val[i] & msk[i]) | latch;
+      break;
+    case 3: /* XOR with latch data */
+      for (i = 0; i < n; i++)
+        dst[i] = (val[i] & msk[i]) ^ latch;
+      break;
+  }
+}
+
+static void plane_write_span(int plane, unsigned offset,
+    const unsigned char *src, int len)
+{
+  unsigned char *dst = vga.mem.base + plane * 0x10000 + offset;
+  unsigned char val[VGA_SPAN_CHUNK], msk[VGA_SPAN_CHUNK];
+  unsigned char latch = VGALatch[plane];
+  unsigned char bm = BitMask;
+  unsigned char sr = (SetReset >> plane) & 1 ? 0xff : 0;
+  int esr = (EnableSetReset >> plane) & 1;
+  int i, n;
+
+  switch (WriteMode) {
+    case 0:
+      if (esr) {
+        /* the CPU data does not matter */
+        unsigned char v = sr;
+        plane_rop(&v, &v, &bm, latch, 1);
+        memset(dst, v, len);
+        return;
+      }
+      if (!DataRotate && bm == 0xff && RasterOp == 0) {
+        memcpy(dst, src, len);
+        return;
+      }
+      break;
+    case 1:
+      memset(dst, latch, len);
+      return;
+  }
+
+  for (; len; len -= n, src += n, dst += n) {
+    n = len < VGA_SPAN_CHUNK ? len : VGA_SPAN_CHUNK;
+    switch (WriteMode) {
+      case 0:
+        for (i = 0; i < n; i++)
+          val[i] = vga_ror(src[i]);
+        memset(msk, bm, n);
+        break;
+      case 2:
+        for (i = 0; i < n; i++)
+          val[i] = -((src[i] >> plane) & 1);
+        memset(msk, bm, n);
+        break;
+      case 3:
+        memset(val, sr, n);
+        for (i = 0; i < n; i++)
+          msk[i] = vga_ror(src[i]) & bm;
+        break;
+    }
+    plane_rop(dst, val, msk, latch, n);
+  }
+}
+
+static void Logical_VGA_write_span(unsigned offset, const unsigned char *src,
+    int len)
+{
+  int plane;
+
+  instr_emu_sim_reset_count(VGA_EMU_INST_EMU_COUNT);
+  for (plane = 0; plane < 4; plane++) {
+    if (MapMask & (1 << plane))
+      plane_write_span(plane, offset, src, len);
+  }
+  if (MapMask)
+    Logical_VGA_dirty(offset, len);
+}
+
+static void Logical_VGA_fill(unsigned offset, unsigned char value, int len)
+{
+  Bit32u new_val;
+  int plane;
+
+  instr_emu_sim_reset_count(VGA_EMU_INST_EMU_COUNT);
+  new_val = Logical_VGA_CalcNewVal(value);
+  for (plane = 0; plane < 4; plane++) {
+    if (MapMask & (1 << plane))
+      memset(vga.mem.base + plane * 0x10000 + offset,
+          new_val >> (plane * 8), len);
   }
+  if (MapMask)
+    Logical_VGA_dirty(offset, len);
+}
+
+/* fill with a 2 or 4 byte pattern, as REP STOSW/STOSD do */
+static void Logical_VGA_fill_pattern(unsigned offset, unsigned val, int size,
+    int len)
+{
+  unsigned char buf[VGA_SPAN_CHUNK];
+  int i, n;
 
+  for (i = 0; i < VGA_SPAN_CHUNK; i++)
+    buf[i] = val >> ((i % size) * 8);
+  for (; len; len -= n, offset += n) {
+    n = len < VGA_SPAN_CHUNK ? len : VGA_SPAN_CHUNK;
+    Logical_VGA_write_span(offset, buf, n);
+  }
+}
+
+/*
+ * VGA to VGA copy. Write mode 1 is how planar blits copy through the
+ * latches, whatever the read mode: that is a memmove() of each enabled plane,
+ * as long as a forward byte copy gives the same result. Returns 0 if
+ * the copy has to be done byte by byte.
+ */
+static int Logical_VGA_copy(unsigned dst, unsigned src, int len)
+{
+  int plane;
+
+  if (WriteMode != 1 || (dst > src && dst < src + len))
+    return 0;
+  instr_emu_sim_reset_count(VGA_EMU_INST_EMU_COUNT);
+  for (plane = 0; plane < 4; plane++) {
+    unsigned char *p = vga.mem.base + plane * 0x10000;
+    VGALatch[plane] = p[src + len - 1];
+    if (MapMask & (1 << plane))
+      memmove(p + dst, p + src, len);
+  }
+  if (MapMask)
+    Logical_VGA_dirty(dst, len);
+  return 1;
 }
 
 int vga_bank_access(dosaddr_t m)
@@ -840,12 +1047,20 @@ static dosaddr_t vga_get_mem_base_offset(dosaddr_t addr)
   return (dosaddr_t)-1;
 }
 
+/* whole span inside the bank, so that it can be written at once */
+static int vga_bank_span(dosaddr_t m, size_t len)
+{
+  return len && len <= vga.mem.bank_len && vga_bank_access(m) &&
+      vga_bank_access(m + len - 1);
+}
+
 void vga_mark_dirty(dosaddr_t vga_addr, int len)
 {
   unsigned vga_page;
   for (vga_page = vga_addr >> PAGE_SHIFT;
        vga_page <= (vga_addr + len - 1) >> PAGE_SHIFT; vga_page++)
-    vgaemu_dirty_page(vga_page, 1);
+    vgaemu_dirty_blocks(vga_page, 1,
+        vga_page_blocks(vga_page, vga_addr, len));
 }
 
 void vga_write(dosaddr_t addr, unsigned char val)
@@ -900,6 +1115,10 @@ void memcpy_to_vga(dosaddr_t dst, const void *src, size_t len)
     }
     return;
   }
+  if (vga_bank_span(dst, len)) {
+    Logical_VGA_write_span(dst - vga.mem.bank_base, src, len);
+    return;
+  }
   for (i = 0; i < len; i++)
     vga_write(dst + i, ((const unsigned char *)src)[i]);
 }
@@ -915,6 +1134,17 @@ void memcpy_dos_to_vga(dosaddr_t dst, dosaddr_t src, size_t len)
     }
     return;
   }
+  if (vga_bank_span(dst, len)) {
+    unsigned char buf[VGA_SPAN_CHUNK * 4];
+    unsigned offset = dst - vga.mem.bank_base;
+    size_t n;
+    for (; len; len -= n, src += n, offset += n) {
+      n = len < sizeof(buf) ? len : sizeof(buf);
+      MEMCPY_2UNIX(buf, src, n);
+      Logical_VGA_write_span(offset, buf, n);
+    }
+    return;
+  }
   for (i = 0; i < len; i++)
     vga_write(dst + i, READ_BYTE(src + i));
 }
@@ -956,6 +1186,9 @@ void vga_memcpy(dosaddr_t dst, dosaddr_t src, size_t len)
     }
     return;
   }
+  if (vga_bank_span(dst, len) && vga_bank_span(src, len) &&
+      Logical_VGA_copy(dst - vga.mem.bank_base, src - vga.mem.bank_base, len))
+    return;
   for (i = 0; i < len; i++)
     vga_write(dst + i, vga_read(src + i));
 }
@@ -971,6 +1204,10 @@ void vga_memset(dosaddr_t dst, unsigned char val, size_t len)
     }
     return;
   }
+  if (vga_bank_span(dst, len)) {
+    Logical_VGA_fill(dst - vga.mem.bank_base, val, len);
+    return;
+  }
   for (i = 0; i < len; i++)
     vga_write(dst + i, val);
 }
@@ -989,6 +1226,10 @@ void vga_memsetw(dosaddr_t dst, unsigned short val, size_t len)
     }
     return;
   }
+  if (vga_bank_span(dst, len * 2)) {
+    Logical_VGA_fill_pattern(dst - vga.mem.bank_base, val, 2, len * 2);
+    return;
+  }
   while (len--) {
     vga_write_word(dst, val);
     dst += 2;
@@ -1009,6 +1250,10 @@ void vga_memsetl(dosaddr_t dst, unsigned val, size_t len)
     }
     return;
   }
+  if (vga_bank_span(dst, len * 4)) {
+    Logical_VGA_fill_pattern(dst - vga.mem.bank_base, val, 4, len * 4);
+    return;
+  }
   while (len--) {
     vga_write_dword(dst, val);
     dst += 4;
@@ -1714,6 +1959,12 @@ int vga_emu_pre_init(void)
     config.exitearly = 1;
     return 1;
   }
+  /* pages is a multiple of 0x40, so the plane and bank siblings fit */
+  if((vga.mem.dirty_blocks = (unsigned short *) calloc(vga.mem.pages, sizeof(unsigned short))) == NULL) {
+    error("vga_emu_init: not enough memory for dirty block map\n");
+    config.exitearly = 1;
+    return 1;
+  }
   if((vga.mem.dirty_bitmap = (unsigned char *) malloc((vga.mem.pages+CHAR_BIT-1) / CHAR_BIT)) == NULL) {
     error("vga_emu_init: not enough memory for dirty bit map\n");
     config.exitearly = 1;
@@ -1916,8 +2167,9 @@ static void print_prot_map()
 static int __vga_emu_update(vga_emu_update_type *veut, unsigned display_start,
     unsigned display_end, int pos)
 {
-  int i, j;
-  unsigned end_page, max_len;
+  int i, j, fine;
+  unsigned end_page, blocks, first_blocks = 0, last_blocks = 0;
+  unsigned start, end;
 
   if (pos == -1)
     pos = display_start >> PAGE_SHIFT;
@@ -1956,7 +2208,17 @@ static int __vga_emu_update(vga_emu_update_type *veut, unsigned display_start,
     return -1;
   }
 
+  /* interleaved memory: the blocks don't map to lines in order */
+  fine = vga.mode_type != CGA && vga.mode_type != HERC &&
+      vga.mode_type != PL2;
+
   for(j = i; j <= end_page && vga.mem.dirty_map[j]; j++) {
+    blocks = __atomic_load_n(&vga.mem.dirty_blocks[j], __ATOMIC_ACQUIRE);
+    if (!fine || !blocks)
+      blocks = VGA_BLOCKS_ALL;
+    /* a gap at a page boundary ends the range */
+    if (j > i && (!(last_blocks >> (VGA_PAGE_BLOCKS - 1)) || !(blocks & 1)))
+      break;
     /* if display_start points to the middle of the page, dont clear
      * it immediately: it may still have dirty segments in the beginning,
      * which will be processed after mem wrap. */
@@ -1964,9 +2226,17 @@ static int __vga_emu_update(vga_emu_update_type *veut, unsigned display_start,
 	(display_start & (PAGE_SIZE - 1)) && vga.mem.dirty_map[j] == 1)
       vga.mem.dirty_map[j] = 2;
     else
-      vga.mem.dirty_map[j] = 0;
-    if (!vga.mem.dirty_map[j])
+      __atomic_store_n(&vga.mem.dirty_map[j], 0, __ATOMIC_SEQ_CST);
+    if (!vga.mem.dirty_map[j]) {
       _vga_emu_adjust_protection(j, 0, DEF_PROT, 0);
+      /* blocks set up to here are in the range, later ones keep
+       * the page dirty */
+      blocks |= __atomic_exchange_n(&vga.mem.dirty_blocks[j], 0,
+          __ATOMIC_SEQ_CST);
+    }
+    if (j == i)
+      first_blocks = blocks;
+    last_blocks = blocks;
   }
 
   vga_deb_update("vga_emu_update: update range: i = %d, j = %d\n", i, j);
@@ -1974,13 +2244,18 @@ static int __vga_emu_update(vga_emu_update_type *veut, unsigned display_start,
   if(i == j)
     return -1;
 
-  veut->update_start = i << 12;
-  veut->update_len = (j - i) << 12;
-  max_len = display_end - veut->update_start;
-  if (veut->update_len > max_len) {
-    assert(veut->update_len - max_len < PAGE_SIZE);
-    veut->update_len = max_len;
+  start = (i << PAGE_SHIFT) +
+      (__builtin_ctz(first_blocks) << VGA_BLOCK_SHIFT);
+  end = ((j - 1) << PAGE_SHIFT) +
+      ((32 - __builtin_clz(last_blocks)) << VGA_BLOCK_SHIFT);
+  if (end > display_end) {
+    assert(end - display_end < PAGE_SIZE);
+    end = display_end;
   }
+  if (start >= end)
+    start = i << PAGE_SHIFT;
+  veut->update_start = start;
+  veut->update_len = end - start;
 
   vga_deb_update("vga_emu_update: update_start = %d, update_len = %d, update_pos = %d\n",
     veut->update_start,
@@ -1994,7 +2269,15 @@ static int __vga_emu_update(vga_emu_update_type *veut, unsigned display_start,
 int vga_emu_update(vga_emu_update_type *veut, unsigned display_start,
     unsigned display_end, int pos)
 {
-  int ret;
+  int ret, i;
+  unsigned end_page = (display_end - 1) >> PAGE_SHIFT;
+
+  /* a static screen is the common case: look without prot_mtx first */
+  for (i = pos == -1 ? display_start >> PAGE_SHIFT : pos; i <= end_page &&
+      !__atomic_load_n(&vga.mem.dirty_map[i], __ATOMIC_ACQUIRE); i++);
+  if (i > end_page)
+    return -1;
+
   pthread_mutex_lock(&prot_mtx);
   ret = __vga_emu_update(veut, display_start, display_end, pos);
   pthread_mutex_unlock(&prot_mtx);
@@ -2676,12 +2959,26 @@ int vga_emu_set_textsize(int width, int height)
 void dirty_all_video_pages(void)
 {
   pthread_mutex_lock(&prot_mtx);
-  if (vga.mem.dirty_map)
+  if (vga.mem.dirty_map) {
+    memset(vga.mem.dirty_blocks, 0xff,
+        vga.mem.pages * sizeof(vga.mem.dirty_blocks[0]));
     memset(vga.mem.dirty_map, 1, vga.mem.pages);
+  }
   pthread_mutex_unlock(&prot_mtx);
 }
 
-static void _vgaemu_dirty_page(int page, int dirty)
+static void vgaemu_set_dirty(int page, int dirty, unsigned blocks)
+{
+  if (dirty)
+    __atomic_fetch_or(&vga.mem.dirty_blocks[page], blocks, __ATOMIC_RELAXED);
+  __atomic_store_n(&vga.mem.dirty_map[page], dirty, __ATOMIC_RELEASE);
+}
+
+/*
+ * Marking pages dirty needs no prot_mtx, cleaning them does: the caller
+ * has to change the protection along with it.
+ */
+static void vgaemu_dirty_blocks(int page, int dirty, unsigned blocks)
 {
   int k;
 
@@ -2691,44 +2988,49 @@ static void _vgaemu_dirty_page(int page, int dirty)
   }
   v_printf("vgaemu: set page %i %s (%i)\n", page, dirty ? "dirty" : "clean",
       vga.mem.dirty_map[page]);
-  /* prot_mtx should be locked by caller */
-  vga.mem.dirty_map[page] = dirty;
+  vgaemu_set_dirty(page, dirty, blocks);
 
   if(vga.mem.planes == 4) {	/* MODE_X or PL4 */
     page &= ~0x30;
     for(k = 0; k < vga.mem.planes; k++, page += 0x10)
-      vga.mem.dirty_map[page] = dirty;
+      vgaemu_set_dirty(page, dirty, blocks);
   }
 
   if(vga.mode_type == PL2) {
     /* it's actually 4 planes, but we let everyone believe it's a 1-plane mode */
     page &= ~0x30;
-    vga.mem.dirty_map[page] = dirty;
+    vgaemu_set_dirty(page, dirty, blocks);
     page += 0x20;
-    vga.mem.dirty_map[page] = dirty;
+    vgaemu_set_dirty(page, dirty, blocks);
   }
 
   if(vga.mode_type == CGA) {
     /* CGA uses two 8k banks  */
     page &= ~0x2;
-    vga.mem.dirty_map[page] = dirty;
+    vgaemu_set_dirty(page, dirty, blocks);
     page += 0x2;
-    vga.mem.dirty_map[page] = dirty;
+    vgaemu_set_dirty(page, dirty, blocks);
   }
 
   if(vga.mode_type == HERC) {
     /* Hercules uses four 8k banks  */
     page &= ~0x6;
-    vga.mem.dirty_map[page] = dirty;
+    vgaemu_set_dirty(page, dirty, blocks);
     page += 0x2;
-    vga.mem.dirty_map[page] = dirty;
+    vgaemu_set_dirty(page, dirty, blocks);
     page += 0x2;
-    vga.mem.dirty_map[page] = dirty;
+    vgaemu_set_dirty(page, dirty, blocks);
     page += 0x2;
-    vga.mem.dirty_map[page] = dirty;
+    vgaemu_set_dirty(page, dirty, blocks);
   }
 }
 
+static void _vgaemu_dirty_page(int page, int dirty)
+{
+  /* prot_mtx should be locked by caller */
+  vgaemu_dirty_blocks(page, dirty, VGA_BLOCKS_ALL);
+}
+
 void vgaemu_dirty_page(int page, int dirty)
 {
   pthread_mutex_lock(&prot_mtx);
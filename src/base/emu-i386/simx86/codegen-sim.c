@@ -80,9 +80,83 @@ int UseLinker = 0;
 
 static unsigned int P0 = (unsigned)-1;
 
+/////////////////////////////////////////////////////////////////////////////
+/*
+ * Predecoded instruction cache.
+ *
+ * For the plain ALU, move and stack instructions, decoding yields
+ * nothing but a fixed list of Gen/AddrGen calls whose arguments only
+ * depend on the instruction bytes, the CS base and the CPU mode. The
+ * first execution records these calls together with the arguments the
+ * ops actually consumed; later ones replay them from the entry without
+ * going through the decoder and varargs. The guest bytes are kept in
+ * the entry and compared on lookup, so code which changed is simply
+ * decoded again.
+ */
+typedef struct {
+	unsigned int pc, cs, next;
+	int mode, fmode;
+	unsigned char len, nw, valid, bad;
+	unsigned char v86;
+	char ovds, ovss;
+	unsigned char code[UOP_MAXLEN];
+	int w[UOP_MAXWORDS];	/* per op: header, mode, args */
+} SimUop;
+
+#define UOP_AGEN	0x8000
+#define UOP_OP(h)	((h) & 0x7fff)
+#define UOP_NARGS(h)	((h) >> 16)
+#define UOP_HASH(pc)	(((pc) ^ ((pc) >> 12)) & (UOP_CACHE-1))
+
+static SimUop *UopCache;
+static SimUop *UopRec;		/* entry being recorded */
+static int UopFlushed;		/* the recorded instruction closed the sequence */
+
+/* op arguments come from the caller, or from a recorded entry */
+struct simargs {
+	va_list *ap;
+	const int *p;
+	SimUop *rec;
+	int hdr;
+};
+
+static inline int SimArg(struct simargs *sa)
+{
+	int v;
+
+	if (sa->p)
+		return *sa->p++;
+	v = va_arg(*sa->ap, int);
+	if (sa->rec) {
+		SimUop *U = sa->rec;
+		if (U->nw < UOP_MAXWORDS) {
+			U->w[U->nw++] = v;
+			U->w[sa->hdr] += 1 << 16;
+		}
+		else
+			U->bad = 1;
+	}
+	return v;
+}
+
+static void uop_begin(struct simargs *sa, int agen, int op, int mode)
+{
+	SimUop *U = UopRec;
+
+	sa->rec = NULL;
+	if (U->nw + 2 > UOP_MAXWORDS) {
+		U->bad = 1;
+		return;
+	}
+	sa->rec = U;
+	sa->hdr = U->nw;
+	U->w[U->nw++] = op | agen;
+	U->w[U->nw++] = mode;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 
-#define	Offs_From_Arg()		(signed char)(va_arg(ap,int))
+#define	Offs_From_Arg()		(signed char)SimArg(sa)
 
 /* WARNING - these are signed char offsets, NOT pointers! */
 char OVERR_DS=Ofs_XDS, OVERR_SS=Ofs_XSS;
@@ -354,27 +428,25 @@ void InitGen_sim(void)
  * address generator unit
  * careful - do not use eax, and NEVER change any flag!
  */
-void AddrGen_sim(int op, int mode, ...)
+static void addrgen_sim(int op, int mode, struct simargs *sa)
 {
-	va_list	ap;
 #if PROFILE
 	hitimer_t t0 = 0;
 	if (debug_level('e')) t0 = GETTSC();
 #endif
 
-	va_start(ap, mode);
 	switch(op) {
 	case A_DI_0:			// base(32), imm
 	case A_DI_1: {			// base(32), {imm}, reg, {shift}
 			long idsp=0;
 			signed char ofs;
-			ofs = va_arg(ap,int);
+			ofs = SimArg(sa);
 			if (mode & MLEA) {		// discard base	reg
 				AR1.d = 0;	// ofs = Ofs_RZERO;
 			}
 			else AR1.d = CPULONG(ofs);
 
-			idsp = va_arg(ap,int);
+			idsp = SimArg(sa);
 			if (op==A_DI_0) {
 				GTRACE3("A_DI_0",0xff,0xff,idsp);
 				TR1.d = idsp;
@@ -396,13 +468,13 @@ void AddrGen_sim(int op, int mode, ...)
 	case A_DI_2: {			// base(32), {imm}, reg, reg, {shift}
 			long idsp=0;
 			signed char ofs;
-			ofs = va_arg(ap,int);
+			ofs = SimArg(sa);
 			if (mode & MLEA) {		// discard base	reg
 				AR1.d = 0;	// ofs = Ofs_RZERO;
 			}
 			else AR1.d = CPULONG(ofs);
 
-			idsp = va_arg(ap,int);
+			idsp = SimArg(sa);
 			if (mode & ADDR16) {
 				signed char o1 = Offs_From_Arg();
 				signed char o2 = Offs_From_Arg();
@@ -414,7 +486,7 @@ void AddrGen_sim(int op, int mode, ...)
 				signed char o1 = Offs_From_Arg();
 				signed char o2 = Offs_From_Arg();
 				unsigned char sh;
-				sh = (unsigned char)(va_arg(ap,int));
+				sh = (unsigned char)(SimArg(sa));
 				GTRACE5("A_DI_2",o1,ofs,o2,idsp,sh);
 				TR1.d = CPULONG(o1) +
 				  (CPULONG(o2) << (sh & 0x1f)) + idsp;
@@ -432,9 +504,9 @@ void AddrGen_sim(int op, int mode, ...)
 			else {
 				AR1.d = CPULONG(OVERR_DS);
 			}
-			idsp = va_arg(ap,int);
+			idsp = SimArg(sa);
 			o = Offs_From_Arg();
-			sh = (unsigned char)(va_arg(ap,int));
+			sh = (unsigned char)(SimArg(sa));
 			GTRACE4("A_DI_2D",o,0xff,idsp,sh);
 			TR1.d = (CPULONG(o) << (sh & 0x1f)) + idsp;
 			AR1.d += TR1.d;
@@ -449,15 +521,31 @@ void AddrGen_sim(int op, int mode, ...)
 		}
 		break;
 	}
-	va_end(ap);
 #if PROFILE
 	if (debug_level('e')) GenTime += (GETTSC() - t0);
 #endif
 }
 
-void Gen_sim(int op, int mode, ...)
+void AddrGen_sim(int op, int mode, ...)
+{
+	struct simargs sa = { NULL, NULL, NULL, 0 };
+	SimUop *U = UopRec;
+	va_list	ap;
+
+	va_start(ap, mode);
+	sa.ap = &ap;
+	if (U) {
+		/* ops called from inside the op are not recorded */
+		UopRec = NULL;
+		uop_begin(&sa, UOP_AGEN, op, mode);
+	}
+	addrgen_sim(op, mode, &sa);
+	UopRec = U;
+	va_end(ap);
+}
+
+static void gen_sim(int op, int mode, struct simargs *sa)
 {
-	va_list ap;
 	uint32_t S1, S2;
 #if PROFILE
 	hitimer_t t0 = 0;
@@ -465,7 +553,6 @@ void Gen_sim(int op, int mode, ...)
 #endif
 
 	P0 = (unsigned)-1;
-	va_start(ap, mode);
 	switch(op) {
 	case L_NOP:
 		GTRACE0("L_NOP");
@@ -477,8 +564,8 @@ void Gen_sim(int op, int mode, ...)
 		break;
 
 	case O_FOP: {
-		unsigned char exop = (unsigned char)va_arg(ap,int);
-		int reg = va_arg(ap,int);
+		unsigned char exop = (unsigned char)SimArg(sa);
+		int reg = SimArg(sa);
 		GTRACE2("O_FPOP",exop,reg);
 		if (Fp87_op(exop, reg))
 		    TheCPU.err = -96;
@@ -531,7 +618,7 @@ void Gen_sim(int op, int mode, ...)
 		}
 		break;
 	case S_DI_IMM: {
-		int v = va_arg(ap,int);
+		int v = SimArg(sa);
 		dosaddr_t addr = AR1.d;
 		if (mode&MBYTE) {
 			GTRACE3("S_DI_IMM_B",0xff,0xff,v);
@@ -545,7 +632,7 @@ void Gen_sim(int op, int mode, ...)
 
 	case L_IMM: {
 		signed char o = Offs_From_Arg();
-		int v = va_arg(ap, int);
+		int v = SimArg(sa);
 		GTRACE3("L_IMM",o,0xff,v);
 		if (mode & MBYTE) {
 			CPUBYTE(o) = (signed char)v;
@@ -558,7 +645,7 @@ void Gen_sim(int op, int mode, ...)
 		} }
 		break;
 	case L_IMM_R1: {
-		int v = va_arg(ap, int);
+		int v = SimArg(sa);
 		GTRACE3("L_IMM_R1",0xff,0xff,v);
 		if (mode & MBYTE) {
 			DR1.b.bl = (signed char)v;
@@ -572,7 +659,7 @@ void Gen_sim(int op, int mode, ...)
 		break;
 	case L_MOVZS: {
 		signed char o;
-		int rcod = va_arg(ap,int)&1;	// 0=z 1=s
+		int rcod = SimArg(sa)&1;	// 0=z 1=s
 		o = Offs_From_Arg();
 		GTRACE3("L_MOVZS",o,0xff,rcod);
 		if (mode & MBYTX) {
@@ -654,7 +741,7 @@ void Gen_sim(int op, int mode, ...)
 
 	case O_ADD_R: {		// OSZAPC
 		register wkreg v;
-		v.d = va_arg(ap, int);
+		v.d = SimArg(sa);
 		RFL.mode = mode;
 		RFL.valid = V_ADD;
 		if (mode & IMMED) {GTRACE3("O_ADD_R",0xff,0xff,v.d);}
@@ -684,7 +771,7 @@ void Gen_sim(int op, int mode, ...)
 		}
 		break;
 	case O_OR_R: {		// O=0 SZP C=0
-		int v = va_arg(ap, int);
+		int v = SimArg(sa);
 		RFL.mode = mode | CLROVF;
 		RFL.valid = V_GEN;
 		if (mode & IMMED) {GTRACE3("O_OR_R",0xff,0xff,v);}
@@ -706,7 +793,7 @@ void Gen_sim(int op, int mode, ...)
 		}
 		break;
 	case O_AND_R: {		// O=0 SZP C=0
-		int v = va_arg(ap, int);
+		int v = SimArg(sa);
 		RFL.mode = mode | CLROVF;
 		RFL.valid = V_GEN;
 		if (mode & IMMED) {GTRACE3("O_AND_R",0xff,0xff,v);}
@@ -728,7 +815,7 @@ void Gen_sim(int op, int mode, ...)
 		}
 		break;
 	case O_XOR_R: {		// O=0 SZP C=0
-		int v = va_arg(ap, int);
+		int v = SimArg(sa);
 		RFL.mode = mode | CLROVF;
 		RFL.valid = V_GEN;
 		if (mode & IMMED) {GTRACE3("O_XOR_R",0xff,0xff,v);}
@@ -751,7 +838,7 @@ void Gen_sim(int op, int mode, ...)
 		break;
 	case O_SUB_R: {		// OSZAPC
 		register wkreg v;
-		v.d = va_arg(ap, int);
+		v.d = SimArg(sa);
 		RFL.mode = mode;
 		RFL.valid = V_SUB;
 		if (mode & IMMED) {GTRACE3("O_SUB_R",0xff,0xff,v.d);}
@@ -782,7 +869,7 @@ void Gen_sim(int op, int mode, ...)
 		break;
 	case O_CMP_R: {		// OSZAPC
 		register wkreg v;
-		v.d = va_arg(ap, int);
+		v.d = SimArg(sa);
 		RFL.mode = mode;
 		RFL.valid = V_SUB;
 		if (mode & IMMED) {GTRACE3("O_CMP_R",0xff,0xff,v.d);}
@@ -813,7 +900,7 @@ void Gen_sim(int op, int mode, ...)
 	case O_ADC_R: {		// OSZAPC
 		register wkreg v;
 		int cy;
-		v.d = va_arg(ap, int);
+		v.d = SimArg(sa);
 		cy = CPUBYTE(Ofs_FLAGS) & 1;
 		RFL.mode = mode;
 		RFL.valid = (cy? V_ADC:V_ADD);
@@ -846,7 +933,7 @@ void Gen_sim(int op, int mode, ...)
 	case O_SBB_R: {		// OSZAPC
 		register wkreg v;
 		int cy;
-		v.d = va_arg(ap, int);
+		v.d = SimArg(sa);
 		cy = CPUBYTE(Ofs_FLAGS) & 1;
 		RFL.mode = mode;
 		RFL.valid = V_SBB;
@@ -983,7 +1070,7 @@ void Gen_sim(int op, int mode, ...)
 		register wkreg v;
 		signed char o = Offs_From_Arg();
 		v.d = 0;
-		if (mode & IMMED) v.d = va_arg(ap,int);
+		if (mode & IMMED) v.d = SimArg(sa);
 		RFL.mode = mode;
 		RFL.valid = V_ADD;
 		if (mode & IMMED) {GTRACE3("O_ADD_FR",0xff,0xff,v.d);}
@@ -1016,7 +1103,7 @@ void Gen_sim(int op, int mode, ...)
 		register wkreg v;
 		signed char o = Offs_From_Arg();
 		v.d = 0;
-		if (mode & IMMED) v.d = va_arg(ap,int);
+		if (mode & IMMED) v.d = SimArg(sa);
 		RFL.mode = mode | CLROVF;
 		RFL.valid = V_GEN;
 		if (mode & IMMED) {GTRACE3("O_OR_FR",0xff,0xff,v.d);}
@@ -1039,7 +1126,7 @@ void Gen_sim(int op, int mode, ...)
 		signed char o = Offs_From_Arg();
 		int cy;
 		v.d = 0;
-		if (mode & IMMED) v.d = va_arg(ap,int);
+		if (mode & IMMED) v.d = SimArg(sa);
 		cy = CPUBYTE(Ofs_FLAGS) & 1;
 		RFL.mode = mode;
 		RFL.valid = (cy? V_ADC:V_ADD);
@@ -1074,7 +1161,7 @@ void Gen_sim(int op, int mode, ...)
 		signed char o = Offs_From_Arg();
 		int cy;
 		v.d = 0;
-		if (mode & IMMED) v.d = va_arg(ap,int);
+		if (mode & IMMED) v.d = SimArg(sa);
 		cy = CPUBYTE(Ofs_FLAGS) & 1;
 		RFL.mode = mode;
 		RFL.valid = V_SBB;
@@ -1109,7 +1196,7 @@ void Gen_sim(int op, int mode, ...)
 		register wkreg v;
 		signed char o = Offs_From_Arg();
 		v.d = 0;
-		if (mode & IMMED) v.d = va_arg(ap,int);
+		if (mode & IMMED) v.d = SimArg(sa);
 		RFL.mode = mode | CLROVF;
 		RFL.valid = V_GEN;
 		if (mode & IMMED) {GTRACE3("O_AND_FR",0xff,0xff,v.d);}
@@ -1131,7 +1218,7 @@ void Gen_sim(int op, int mode, ...)
 		register wkreg v;
 		signed char o = Offs_From_Arg();
 		v.d = 0;
-		if (mode & IMMED) v.d = va_arg(ap,int);
+		if (mode & IMMED) v.d = SimArg(sa);
 		RFL.mode = mode;
 		RFL.valid = V_SUB;
 		if (mode & IMMED) {GTRACE3("O_SUB_FR",0xff,0xff,v.d);}
@@ -1164,7 +1251,7 @@ void Gen_sim(int op, int mode, ...)
 		register wkreg v;
 		signed char o = Offs_From_Arg();
 		v.d = 0;
-		if (mode & IMMED) v.d = va_arg(ap,int);
+		if (mode & IMMED) v.d = SimArg(sa);
 		RFL.mode = mode | CLROVF;
 		RFL.valid = V_GEN;
 		if (mode & IMMED) {GTRACE3("O_XOR_FR",0xff,0xff,v.d);}
@@ -1186,7 +1273,7 @@ void Gen_sim(int op, int mode, ...)
 		register wkreg v;
 		signed char o = Offs_From_Arg();
 		v.d = 0;
-		if (mode & IMMED) v.d = va_arg(ap,int);
+		if (mode & IMMED) v.d = SimArg(sa);
 		RFL.mode = mode;
 		RFL.valid = V_SUB;
 		if (mode & IMMED) {GTRACE3("O_CMP_FR",0xff,0xff,v.d);}
@@ -1400,7 +1487,7 @@ void Gen_sim(int op, int mode, ...)
 		RFL.valid = V_GEN;
 		if (mode & MBYTE) {
 		    if ((mode&(IMMED|DATA16))==(IMMED|DATA16)) {
-			int b = va_arg(ap, int);
+			int b = SimArg(sa);
 			signed char o = Offs_From_Arg();
 			GTRACE3("O_IMUL",o,0xff,b);
 			DR1.ds = (int)DR1.ws.l * b;
@@ -1409,7 +1496,7 @@ void Gen_sim(int op, int mode, ...)
 			of = ((DR1.ds!=0) && (DR1.ds!=-1));
 		    }
 		    else if ((mode&(IMMED|DATA16))==IMMED) {
-			int b = va_arg(ap, int);
+			int b = SimArg(sa);
 			signed char o = Offs_From_Arg();
 			int64_t v;
 			GTRACE3("O_IMUL",o,0xff,b);
@@ -1429,7 +1516,7 @@ void Gen_sim(int op, int mode, ...)
 		}
 		else if (mode&DATA16) {
 		    if (mode&IMMED) {
-			int b = va_arg(ap, int);
+			int b = SimArg(sa);
 			signed char o = Offs_From_Arg();
 			GTRACE3("O_IMUL",o,0xff,b);
 		    	DR1.ds = (int)DR1.ws.l * b;
@@ -1454,7 +1541,7 @@ void Gen_sim(int op, int mode, ...)
 		else {
 		    int64_t v;
 		    if (mode&IMMED) {
-			int b = va_arg(ap, int);
+			int b = SimArg(sa);
 			signed char o = Offs_From_Arg();
 			GTRACE3("O_IMUL",o,0xff,b);
 			v = (int64_t)DR1.ds * b;
@@ -1946,7 +2033,7 @@ void Gen_sim(int op, int mode, ...)
 		break;
 
 	case O_OPAX: {	/* used by DAA..AAD */
-		int n =	va_arg(ap,int);
+		int n =	SimArg(sa);
 		// get n bytes from parameter stack
 		unsigned char subop = Offs_From_Arg();
 		GTRACE3("O_OPAX",0xff,0xff,n);
@@ -2128,7 +2215,7 @@ void Gen_sim(int op, int mode, ...)
 		} break;
 
 	case O_PUSHI: {
-		int v = va_arg(ap, int);
+		int v = SimArg(sa);
 		unsigned long stackm = CPULONG(Ofs_STACKM);
 		GTRACE3("O_PUSHI",0xff,0xff,v);
 		if (mode & DATA16) {
@@ -2251,10 +2338,10 @@ void Gen_sim(int op, int mode, ...)
 		break;
 
 	case O_INT: {
-		unsigned char intno = va_arg(ap, int);
+		unsigned char intno = SimArg(sa);
 		// Check bitmap, GPF if revectored
 		if (test_bit(intno, &TheCPU.int_revectored)) {
-			P0 = va_arg(ap, dosaddr_t);
+			P0 = (dosaddr_t)SimArg(sa);
 			TheCPU.err = EXCP0D_GPF;
 		}
 		else {
@@ -2616,7 +2703,7 @@ void Gen_sim(int op, int mode, ...)
 		}
 		break;
 	case O_SLAHF: {
-		int rcod = va_arg(ap,int)&1;	// 0=LAHF 1=SAHF
+		int rcod = SimArg(sa)&1;	// 0=LAHF 1=SAHF
 		if (rcod==0) {		/* LAHF */
 			GTRACE0("O_LAHF");
 			FlagSync_All();
@@ -2629,7 +2716,7 @@ void Gen_sim(int op, int mode, ...)
 		} }
 		break;
 	case O_SETFL: {
-		unsigned char o1 = (unsigned char)va_arg(ap,int);
+		unsigned char o1 = (unsigned char)SimArg(sa);
 		switch(o1) {	// these are direct on x86
 		case CMC:
 			GTRACE0("O_CMC");
@@ -2663,7 +2750,7 @@ void Gen_sim(int op, int mode, ...)
 		} }
 		break;
 	case O_BSWAP: {
-		unsigned char o1 = (unsigned char)va_arg(ap,int);
+		unsigned char o1 = (unsigned char)SimArg(sa);
 		register long v;
 		GTRACE1("O_BSWAP",o1);
 		v = CPULONG(o1);
@@ -2673,7 +2760,7 @@ void Gen_sim(int op, int mode, ...)
 		}
 		break;
 	case O_SETCC: {
-		unsigned char o1 = (unsigned char)va_arg(ap,int);
+		unsigned char o1 = (unsigned char)SimArg(sa);
 		GTRACE3("O_SETCC",0xff,0xff,o1);
 		FlagSync_All();
 		switch(o1) {
@@ -2701,7 +2788,7 @@ void Gen_sim(int op, int mode, ...)
 		}
 		break;
 	case O_BITOP: {
-		unsigned char o1 = (unsigned char)va_arg(ap,int);
+		unsigned char o1 = (unsigned char)SimArg(sa);
 		signed char o2 = Offs_From_Arg();
 		register int flg;
 		GTRACE3("O_BITOP",o2,0xff,o1);
@@ -2751,12 +2838,12 @@ void Gen_sim(int op, int mode, ...)
 		}
 		} break;
 	case O_SHFD: {
-		unsigned char l_r = (unsigned char)va_arg(ap,int)&8;
+		unsigned char l_r = (unsigned char)SimArg(sa)&8;
 		signed char o = Offs_From_Arg();
 		unsigned char shc;
 		int cy;
 		if (mode & IMMED) {
-			shc = (unsigned char)va_arg(ap,int)&0x1f;
+			shc = (unsigned char)SimArg(sa)&0x1f;
 			GTRACE4("O_SHFD",o,0xff,l_r,shc);
 		}
 		else {
@@ -2866,9 +2953,9 @@ void Gen_sim(int op, int mode, ...)
 		break;
 
 	case JMP_LINK: {	// opc, dspt, retaddr, link
-		int opc = va_arg(ap,int);
-		P0 = va_arg(ap,unsigned int);
-		unsigned int d_nt = va_arg(ap,unsigned int);
+		int opc = SimArg(sa);
+		P0 = (unsigned int)SimArg(sa);
+		unsigned int d_nt = (unsigned int)SimArg(sa);
 		if (opc == CALLd || opc == CALLl)
 			PUSH(mode, d_nt);
 		if (debug_level('e')>2) {
@@ -2880,10 +2967,10 @@ void Gen_sim(int op, int mode, ...)
 
 	case JF_LINK:
 	case JB_LINK: {		// opc, PC, dspt, dspnt, link
-		int opc = va_arg(ap,int);
-		unsigned int PC = va_arg(ap,unsigned int);
-		unsigned int j_t = va_arg(ap,unsigned int);
-		unsigned int j_nt = va_arg(ap,unsigned int);
+		int opc = SimArg(sa);
+		unsigned int PC = (unsigned int)SimArg(sa);
+		unsigned int j_t = (unsigned int)SimArg(sa);
+		unsigned int j_nt = (unsigned int)SimArg(sa);
 		(void)PC;
 		switch(opc) {
 		case JO:      P0 = is_of_set() ? j_t : j_nt; break;
@@ -2919,9 +3006,9 @@ void Gen_sim(int op, int mode, ...)
 		}
 		break;
 	case JLOOP_LINK: {	// opc, dspt, dspnt, link
-		int opc = va_arg(ap,int);
-		unsigned int j_t = va_arg(ap,unsigned int);
-		unsigned int j_nt = va_arg(ap,unsigned int);
+		int opc = SimArg(sa);
+		unsigned int j_t = (unsigned int)SimArg(sa);
+		unsigned int j_nt = (unsigned int)SimArg(sa);
 		int cxv = (mode&ADDR16? --rCX : --rECX);
 		switch(opc) {
 		case LOOP:
@@ -2940,7 +3027,6 @@ void Gen_sim(int op, int mode, ...)
 
 	}
 
-	va_end(ap);
 #ifdef DEBUG_MORE
 	if (debug_level('e')>3) {
 #else
@@ -2975,12 +3061,145 @@ void Gen_sim(int op, int mode, ...)
 }
 
 
+void Gen_sim(int op, int mode, ...)
+{
+	struct simargs sa = { NULL, NULL, NULL, 0 };
+	SimUop *U = UopRec;
+	va_list ap;
+
+	va_start(ap, mode);
+	sa.ap = &ap;
+	if (U) {
+		UopRec = NULL;
+		uop_begin(&sa, 0, op, mode);
+	}
+	gen_sim(op, mode, &sa);
+	UopRec = U;
+	va_end(ap);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+
+/* instructions which decode to Gen/AddrGen calls only */
+static int uop_cacheable(unsigned int PC)
+{
+	int n;
+
+	for (n = 0; n < 4; n++) {
+		switch (Fetch(PC + n)) {
+		case 0x26: case 0x2e: case 0x36: case 0x3e:
+		case 0x64 ... 0x67:
+			continue;
+		case 0x00 ... 0x05: case 0x08 ... 0x0d:
+		case 0x10 ... 0x15: case 0x18 ... 0x1d:
+		case 0x20 ... 0x25: case 0x28 ... 0x2d:
+		case 0x30 ... 0x35: case 0x38 ... 0x3d:
+		case 0x40 ... 0x5f:
+		case 0x68 ... 0x6b:
+		case 0x80 ... 0x8d:
+		case 0x90 ... 0x99:
+		case 0xa8: case 0xa9:
+		case 0xb0 ... 0xc1:
+		case 0xc6: case 0xc7:
+		case 0xd0 ... 0xd3:
+		case 0xf6: case 0xf7:
+			return 1;
+		default:
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Execute the instruction at *PC from the cache. If it is not there,
+ * returns 0 and, when the instruction can be cached, starts recording
+ * the ops the interpreter is going to generate for it.
+ */
+int SimUopRun(unsigned int *PC, int *mode)
+{
+	unsigned int pc = *PC;
+	const int *w, *end;
+	SimUop *U;
+
+	UopRec = NULL;
+	if (EFLAGS & TF)
+		return 0;
+	if (!UopCache) {
+		UopCache = calloc(UOP_CACHE, sizeof(SimUop));
+		if (!UopCache)
+			return 0;
+	}
+	U = &UopCache[UOP_HASH(pc)];
+	if (!U->valid || U->pc != pc || U->cs != LONG_CS ||
+	    U->mode != *mode || U->v86 != V86MODE() ||
+	    memcmp(U->code, MEM_BASE32(pc), U->len) != 0) {
+		if (uop_cacheable(pc) && !vga_read_access(pc)) {
+			int i;
+			U->valid = U->bad = 0;
+			U->pc = pc;
+			U->cs = LONG_CS;
+			U->mode = *mode;
+			U->v86 = V86MODE();
+			U->nw = 0;
+			/* as decoded, the instruction may modify itself */
+			for (i = 0; i < UOP_MAXLEN; i++)
+				U->code[i] = Fetch(pc + i);
+			UopFlushed = 0;
+			UopRec = U;
+		}
+		return 0;
+	}
+	OVERR_DS = U->ovds;
+	OVERR_SS = U->ovss;
+	w = U->w;
+	end = w + U->nw;
+	while (w < end) {
+		struct simargs sa = { NULL, w + 2, NULL, 0 };
+		int h = w[0];
+
+		if (h & UOP_AGEN)
+			addrgen_sim(UOP_OP(h), w[1], &sa);
+		else
+			gen_sim(UOP_OP(h), w[1], &sa);
+		if (TheCPU.err)
+			return 1;	/* restart at *PC */
+		w += 2 + UOP_NARGS(h);
+	}
+	*mode = U->fmode;
+	*PC = U->next;
+	return 1;
+}
+
+/* The interpreter finished the instruction SimUopRun() started recording */
+void SimUopRecEnd(unsigned int PC, int mode)
+{
+	SimUop *U = UopRec;
+
+	UopRec = NULL;
+	if (!U || U->bad || UopFlushed || TheCPU.err ||
+	    PC <= U->pc || PC - U->pc > UOP_MAXLEN)
+		return;
+	/* ModRM checks 32-bit addresses in vm86 mode outside of the ops */
+	if (V86MODE() && !(mode & ADDR16))
+		return;
+	U->len = PC - U->pc;
+	U->fmode = mode;
+	U->next = PC;
+	U->ovds = OVERR_DS;
+	U->ovss = OVERR_SS;
+	U->valid = 1;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 
 
 static unsigned int CloseAndExec_sim(unsigned int PC, int mode)
 {
 	unsigned int ret;
+
+	UopFlushed = 1;
 	if (debug_level('e')>1) {
 	    if (sigalrm_pending()>0) e_printf("** SIGALRM is pending\n");
 	    if (debug_level('e')>2) {
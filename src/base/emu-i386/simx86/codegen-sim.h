@@ -85,6 +85,8 @@ extern void FlagSync_All (void);
 extern void Gen_sim(int op, int mode, ...);
 extern void AddrGen_sim(int op, int mode, ...);
 extern void InitGen_sim(void);
+extern int SimUopRun(unsigned int *PC, int *mode);
+extern void SimUopRecEnd(unsigned int PC, int mode);
 
 /////////////////////////////////////////////////////////////////////////////
 
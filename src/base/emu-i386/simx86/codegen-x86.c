@@ -117,6 +117,7 @@
 #ifdef HOST_ARCH_X86
 #include "codegen-x86.h"
 #include "cpatch.h"
+#include "tcache.h"
 
 static void Gen_x86(int op, int mode, ...);
 static void AddrGen_x86(int op, int mode, ...);
@@ -124,6 +125,8 @@ static unsigned int CloseAndExec_x86(unsigned int PC, int mode);
 
 hitimer_u TimeStartExec;
 static TNode *LastXNode = NULL;
+static int TraceHeadKey;
+static int TraceHeadPending;
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -488,14 +491,16 @@ static unsigned char *CodeGen(unsigned char *CodePtr, unsigned char *BaseGenBuf,
 	case O_DEC_R:
 		rcod = 0x08fe;
 arith0:		{
-		G1(POPdx,Cp);	// get flags from stack into %%edx
 		switch (IG->op) {
 		case O_ADC_R: // tests carry
 		case O_SBB_R: // tests carry
 		case O_INC_R: // preserves carry
 		case O_DEC_R: // preserves carry
-			// shr $1,%%edx to get carry flag from stack
-			G2M(0xd1,0xea,Cp);
+			// get carry flag from stack
+			PopFlagsCF(Cp);
+			break;
+		default:
+			PopFlags(Cp);	// get flags from stack into %%edx
 		}
 		if (mode & MBYTE) {
 			if (mode & IMMED) {
@@ -519,11 +524,12 @@ arith0:		{
 				G2(0x4301|rcod,Cp); G1(IG->p0,Cp);
 			}
 		}
-		G1(PUSHF,Cp);	// flags back on stack
+		PushFlags(Cp);	// flags back on stack
 		}
 		break;
 	case O_CLEAR:
-		G3M(POPdx,0x31,0xc0,Cp);	//ignore flags; xorl %%eax,%%eax
+		PopFlags(Cp);			// ignore flags
+		G2M(0x31,0xc0,Cp);		// xorl %%eax,%%eax
 		if (mode & MBYTE) {
 			// movb %%al,offs(%%ebx)
 			G3M(0x88,0x43,IG->p0,Cp);
@@ -532,10 +538,10 @@ arith0:		{
 			// mov{wl} %%{e}ax,offs(%%ebx)
 			Gen66(mode,Cp); G3M(0x89,0x43,IG->p0,Cp);
 		}
-		G1(PUSHF,Cp);	// new flags on stack
+		PushFlags(Cp);	// new flags on stack
 		break;
 	case O_TEST:
-		G1(POPdx,Cp);			// ignore flags
+		PopFlags(Cp);			// ignore flags
 		if (mode & MBYTE) {
 			// testb $0xff,offs(%%ebx)
 			G4M(0xf6,0x43,IG->p0,0xffu,Cp);
@@ -548,13 +554,13 @@ arith0:		{
 			// test $0xffffffff,offs(%%ebx)
 			G3M(0xf7,0x43,IG->p0,Cp); G4(0xffffffff,Cp);
 		}
-		G1(PUSHF,Cp);	// new flags on stack
+		PushFlags(Cp);	// new flags on stack
 		break;
 	case O_SBSELF:
 		// if CY=0 -> reg=0,  flag=xx46
 		// if CY=1 -> reg=-1, flag=xx97
 		// pop %%edx; shr $1,%%edx to get carry flag from stack
-		G3M(POPdx,0xd1,0xea,Cp);
+		PopFlagsCF(Cp);
 		// sbbl %%eax,%%eax
 		G2M(0x19,0xc0,Cp);
 		if (mode & MBYTE) {
@@ -565,7 +571,7 @@ arith0:		{
 			// mov{wl} %%{e}ax,offs(%%ebx)
 			Gen66(mode,Cp); G3M(0x89,0x43,IG->p0,Cp);
 		}
-		G1(PUSHF,Cp);	// flags back on stack
+		PushFlags(Cp);	// flags back on stack
 		break;
 	case O_ADD_FR:
 		rcod = ADDbfrm; /* 0x00 */ goto arith1;
@@ -584,11 +590,12 @@ arith0:		{
 	case O_CMP_FR:
 		rcod = CMPbfrm; /* 0x38 */
 arith1:
-		G1(POPdx,Cp);	// get flags from stack into %%edx
 		if (IG->op == O_ADC_FR || IG->op == O_SBB_FR) {
-			// shr $1,%%edx to get carry flag from stack
-			G2M(0xd1,0xea,Cp);
+			// get carry flag from stack
+			PopFlagsCF(Cp);
 		}
+		else
+			PopFlags(Cp);	// get flags from stack into %%edx
 		if (mode & MBYTE) {
 			if (mode & IMMED) {
 				// OPb $immed,offs(%%ebx)
@@ -612,7 +619,7 @@ arith1:
 				G2(0x4301|rcod,Cp); G1(IG->p0,Cp);
 			}
 		}
-		G1(PUSHF,Cp);	// flags back on stack
+		PushFlags(Cp);	// flags back on stack
 		break;
 	case O_NOT:
 		if (mode & MBYTE) {
@@ -626,7 +633,7 @@ arith1:
 		}
 		break;
 	case O_NEG:
-		G1(POPdx,Cp);	// ignore flags from stack
+		PopFlags(Cp);	// ignore flags from stack
 		if (mode & MBYTE) {
 			// negb %%al
 			G2M(0xf6,0xd8,Cp);
@@ -636,12 +643,11 @@ arith1:
 			Gen66(mode,Cp);
 			G2M(0xf7,0xd8,Cp);
 		}
-		G1(PUSHF,Cp);	// new flags on stack
+		PushFlags(Cp);	// new flags on stack
 		break;
 	case O_INC:
-		G1(POPdx,Cp);	// get flags from stack into %%edx
-		// shr $1,%%edx to get preserved carry flag from stack
-		G2M(0xd1,0xea,Cp);
+		// get preserved carry flag from stack
+		PopFlagsCF(Cp);
 		if (mode & MBYTE) {
 			// incb %%al
 			G2M(0xfe,0xc0,Cp);
@@ -662,12 +668,11 @@ arith1:
 			G1(0x40,Cp);
 #endif
 		}
-		G1(PUSHF,Cp);	// flags back on stack before writing
+		PushFlags(Cp);	// flags back on stack before writing
 		break;
 	case O_DEC:
-		G1(POPdx,Cp);	// get flags from stack into %%edx
-		// shr $1,%%edx to get preserved carry flag from stack
-		G2M(0xd1,0xea,Cp);
+		// get preserved carry flag from stack
+		PopFlagsCF(Cp);
 		if (mode & MBYTE) {
 			// decb %%al
 			G2M(0xfe,0xc8,Cp);
@@ -688,7 +693,7 @@ arith1:
 			G1(0x48,Cp);
 #endif
 		}
-		G1(PUSHF,Cp);	// flags back on stack
+		PushFlags(Cp);	// flags back on stack
 		break;
 	case O_CMPXCHG: {
 		G1(POPdx,Cp);	// ignore flags from stack
@@ -2795,6 +2800,64 @@ static void Gen_x86(int op, int mode, ...)
 /////////////////////////////////////////////////////////////////////////////
 
 
+/*
+ * Lazy flags: an op which sets the guest flags pops the old ones from
+ * the stack and pushes the new ones back. When the next op touching the
+ * flags is another of the same kind, and only plain register moves are
+ * in between, the push and the pop are both left out and the flags stay
+ * in the host register. The moves can't fault, so the stack is always
+ * as the fault handler expects when an access to guest memory is made.
+ * Runs don't go past the end of an instruction with other ops either,
+ * as BreakNode() may put a tail there.
+ */
+static int FlagOp(int op)
+{
+	switch (op) {
+	case O_ADD_R: case O_OR_R: case O_ADC_R: case O_SBB_R:
+	case O_AND_R: case O_SUB_R: case O_XOR_R: case O_CMP_R:
+	case O_INC_R: case O_DEC_R:
+	case O_ADD_FR: case O_OR_FR: case O_ADC_FR: case O_SBB_FR:
+	case O_AND_FR: case O_SUB_FR: case O_XOR_FR: case O_CMP_FR:
+	case O_CLEAR: case O_TEST: case O_SBSELF: case O_NEG:
+	case O_INC: case O_DEC:
+		return 1;
+	case L_REG: case S_REG: case L_REG2REG: case L_IMM: case L_IMM_R1:
+	case L_MOVZS: case L_ZXAX: case S_DI_R: case O_NOT: case O_XCHG:
+	case L_NOP:
+		return 0;	// leaves flags and stack alone
+	}
+	return -1;
+}
+
+static void FlagsInReg(IMeta *I0, int n)
+{
+	IGen *prev = NULL;
+	int i, j;
+
+	for (i=0; i<n; i++) {
+	    IMeta *I = &I0[i];
+	    int other = 0;
+	    for (j=0; j<I->ngen; j++) {
+		IGen *IG = &(I->gen[j]);
+		int k = FlagOp(IG->op);
+		IG->hflags = 0;
+		if (k > 0) {
+		    if (prev) {
+			prev->hflags |= HF_OUT;
+			IG->hflags |= HF_IN;
+		    }
+		    prev = IG;
+		}
+		else if (k < 0) {
+		    prev = NULL;
+		    other = 1;
+		}
+	    }
+	    if (other)
+		prev = NULL;
+	}
+}
+
 static CodeBuf *ProduceCode(unsigned int PC, IMeta *I0)
 {
 	int i,j,nap,mall_req;
@@ -2836,6 +2899,7 @@ static CodeBuf *ProduceCode(unsigned int PC, IMeta *I0)
 	I0->daddr = 0;
 	if (debug_level('e')>1)
 	    e_printf("CodeBuf=%p siz %zd CodePtr=%p\n",GenCodeBuf,GenBufSize,CodePtr);
+	FlagsInReg(I0, CurrIMeta);
 
 	for (i=0; i<CurrIMeta; i++) {
 	    IMeta *I = &I0[i];
@@ -3026,7 +3090,7 @@ static void NodeLinker(TNode *LG, TNode *G)
 			    G,G->key,G->addr,
 			    ra, L->t_target, T->nrefs, L->t_ref, *L->t_ref);
 		    }
-		    _nodeflagbackrefs(LG, G->flags);
+		    _nodeflagbackrefs(LG, G->flags & ~(F_JMPF|F_SBLK));
 		    if (debug_level('e')>8) { backref *bk = T->bkr.next;
 #ifdef DEBUG_LINKER
 			if (bk==NULL) { dbug_printf("bkr null\n"); leavedos_main(0x8108); }
@@ -3077,7 +3141,7 @@ static void NodeLinker(TNode *LG, TNode *G)
 				G,G->key,G->addr,
 				ra, L->nt_target, T->nrefs, L->nt_ref, *L->nt_ref);
 			}
-			_nodeflagbackrefs(LG, G->flags);
+			_nodeflagbackrefs(LG, G->flags & ~(F_JMPF|F_SBLK));
 			if (debug_level('e')>8) { backref *bk = T->bkr.next;
 #ifdef DEBUG_LINKER
 			    if (bk==NULL) { dbug_printf("bkr null\n"); leavedos_main(0x8109); }
@@ -3241,6 +3305,19 @@ void NodeUnlinker(TNode *G)
  *
  */
 
+static void SetupNode(TNode *G)
+{
+	/* mprotect the page here; a page fault will be triggered
+	 * if some other code tries to write over the page including
+	 * this node */
+	e_markpage(G->seqbase, G->seqlen);
+	e_mprotect(G->seqbase, G->seqlen);
+	/* check links INSIDE current node */
+	if (0 == (EFLAGS & EFLAGS_TF) ) {
+		NodeLinker(G, G);
+	}
+}
+
 static unsigned int CloseAndExec_x86(unsigned int PC, int mode)
 {
 	IMeta *I0;
@@ -3270,20 +3347,80 @@ static unsigned int CloseAndExec_x86(unsigned int PC, int mode)
 #endif
 	G = Move2Tree(I0, GenCodeBuf);		/* when is G==NULL? */
 	/* InstrMeta will be zeroed at this point */
-	/* mprotect the page here; a page fault will be triggered
-	 * if some other code tries to write over the page including
-	 * this node */
-	e_markpage(G->seqbase, G->seqlen);
-	e_mprotect(G->seqbase, G->seqlen);
 	G->cs = LONG_CS;
 	G->mode = mode;
-	/* check links INSIDE current node */
-	if (0 == (EFLAGS & EFLAGS_TF) ) {
-		NodeLinker(G, G);
-	}
+	TCacheStore(G);
+	SetupNode(G);
 	return Exec_x86(G);
 }
 
+/*
+ * Take the translation of the sequence at PC from the persistent cache,
+ * if there is one. Returns 1 if a node was added.
+ */
+int RestoreNode_x86(unsigned int PC, int mode)
+{
+	TNode *G = TCacheFetch(PC, mode);
+
+	if (G == NULL)
+		return 0;
+	G->cs = LONG_CS;
+	G->mode = mode;
+	SetupNode(G);
+	return 1;
+}
+
+/* count the entries into a node from the run loop */
+static void CountExec(TNode *G)
+{
+	if (++G->execs == HOT_NODE_EXECS &&
+	    (G->flags & (F_JMPF|F_SBLK)) == F_JMPF) {
+		TraceHeadKey = G->key;
+		TraceHeadPending = 1;
+	}
+}
+
+/* turn a hot node into a trace head, after the run loop is left:
+ * this drops the node, so LastXNode must not point to it */
+static void FlushTraceHead(void)
+{
+	if (!TraceHeadPending)
+		return;
+	TraceHeadPending = 0;
+	LastXNode = NULL;
+	MakeTraceHead(TraceHeadKey);
+}
+
+static void Exec_x86_fpu_pre(void)
+{
+	unsigned short fpuc;
+
+	if (TheCPU.fpstate) {
+		loadfpstate(*TheCPU.fpstate);
+		TheCPU.fpstate = NULL;
+	}
+	/* mask exceptions in generated code */
+	asm ("fstcw	%0" : "=m"(TheCPU.fpuc));
+	fpuc = TheCPU.fpuc | 0x3f;
+	asm ("fldcw	%0" :: "m"(fpuc));
+}
+
+static void Exec_x86_fpu_post(void)
+{
+	int exs;
+
+	__asm__ __volatile__ ("fstsw	%0" : "=m"(exs));
+	exs &= 0x7f;
+	if (exs) {
+		e_printf("FPU: error status %02x\n",exs);
+		if ((exs & ~TheCPU.fpuc) & 0x3f) {
+			__asm__ __volatile__ ("fnclex\n" ::: "memory");
+			e_printf("FPU exception\n");
+			/* TheCPU.err = EXCP10_COPR; */
+		}
+	}
+}
+
 static unsigned int Exec_x86_pre(unsigned char *ecpu)
 {
 	unsigned long flg;
@@ -3386,17 +3523,8 @@ unsigned int Exec_x86(TNode *G)
 #ifdef ASM_DUMP
 	fprintf(aLog,"%p: exec\n",G->key);
 #endif
-	if (seqflg & F_FPOP) {
-		if (TheCPU.fpstate) {
-			loadfpstate(*TheCPU.fpstate);
-			TheCPU.fpstate = NULL;
-		}
-		/* mask exceptions in generated code */
-		unsigned short fpuc;
-		asm ("fstcw	%0" : "=m"(TheCPU.fpuc));
-		fpuc = TheCPU.fpuc | 0x3f;
-		asm ("fldcw	%0" :: "m"(fpuc));
-	}
+	if (seqflg & F_FPOP)
+		Exec_x86_fpu_pre();
 
 	flg = Exec_x86_pre(ecpu);
 #if PROFILE
@@ -3415,19 +3543,8 @@ unsigned int Exec_x86(TNode *G)
 	Exec_x86_post(flg, mem_ref);
 
 	/* was there at least one FP op in the sequence? */
-	if (seqflg & F_FPOP) {
-		int exs;
-		__asm__ __volatile__ ("fstsw	%0" : "=m"(exs));
-		exs &= 0x7f;
-		if (exs) {
-			e_printf("FPU: error status %02x\n",exs);
-			if ((exs & ~TheCPU.fpuc) & 0x3f) {
-				__asm__ __volatile__ ("fnclex\n" ::: "memory");
-				e_printf("FPU exception\n");
-				/* TheCPU.err = EXCP10_COPR; */
-			}
-		}
-	}
+	if (seqflg & F_FPOP)
+		Exec_x86_fpu_post();
 
 	if (debug_level('e')) {
 #if PROFILE
@@ -3466,7 +3583,7 @@ unsigned int Exec_x86(TNode *G)
 
 #if defined(SINGLESTEP)
 	InvalidateNodeRange(G->key, 1, NULL);
-	avltr_delete(G->key);
+	DeleteNode(G->key);
 	if (debug_level('e')>1) e_printf("\n%s",e_print_regs());
 #else
 	/*
@@ -3488,39 +3605,53 @@ unsigned int Exec_x86(TNode *G)
 		if (debug_level('e')>2 && G != LastXNode)
 			e_printf("New LastXNode=%08x\n",G->key);
 		LastXNode = G;
+		CountExec(G);
 	}
+	FlushTraceHead();
 #endif
 
 	return ePC;
 }
 
 /* fast loop, only used if nothing special is going on; if anything
-   out of the ordinary happens, the above Exec_x86() is called */
+   out of the ordinary happens, the above Exec_x86() is called.
+   The FPU is set up once, when the first node using it is met, and
+   checked once on the way out */
 unsigned int Exec_x86_fast(TNode *G)
 {
 	unsigned char *ecpu = CPUOFFS(0);
 	unsigned long flg = Exec_x86_pre(ecpu);
 	unsigned int ePC, mem_ref;
 	unsigned mode = G->mode;
+	int fpu = 0;
 
 	do {
+		if ((G->flags & F_FPOP) && !fpu) {
+			Exec_x86_fpu_pre();
+			fpu = 1;
+		}
 		ePC = Exec_x86_asm(&mem_ref, &flg, ecpu, G->addr);
 		if (G->alive > 0) {
-			if (LastXNode->clink.unlinked_jmp_targets &&
+			if (LastXNode && LastXNode->alive > 0 &&
+			    LastXNode->clink.unlinked_jmp_targets &&
 			    (LastXNode->clink.t_target == G->key ||
 			     LastXNode->clink.nt_target == G->key))
 				NodeLinker(LastXNode, G);
 			LastXNode = G;
+			CountExec(G);
 		}
 		if (sigalrm_pending()) {
 			CEmuStat|=CeS_SIGPEND;
 			break;
 		}
 	} while (!TheCPU.err && (G=FindTree(ePC)) &&
-		 GoodNode(G, mode) && !(G->flags & (F_FPOP|F_INHI)));
+		 GoodNode(G, mode) && !(G->flags & F_INHI));
 
 	Exec_x86_post(flg, mem_ref);
+	if (fpu)
+		Exec_x86_fpu_post();
 	sigalrm_pending_w(0);
+	FlushTraceHead();
 	return ePC;
 }
 
@@ -47,6 +47,7 @@
 extern unsigned int VgaAbsBankBase;
 extern unsigned int Exec_x86(TNode *G);
 extern unsigned int Exec_x86_fast(TNode *G);
+extern int RestoreNode_x86(unsigned int PC, int mode);
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -73,6 +74,19 @@ extern unsigned int Exec_x86_fast(TNode *G);
 #define PopPushF(Cp)	if (((Cp)==BaseGenBuf)||((Cp)[-1]!=PUSHF)) \
 				G2(0x9c9d,(Cp))
 
+/* Runs of ops which set the flags from scratch or from the carry only
+ * keep the guest flags in the host flags register between them instead
+ * of going through the stack; see FlagsInReg() */
+#define HF_IN	1	/* IGen.hflags: flags are in the host register */
+#define HF_OUT	2	/* IGen.hflags: leave them there */
+
+// pop flags (ignored) into %edx
+#define PopFlags(Cp)	{ if (!(IG->hflags & HF_IN)) G1(POPdx,(Cp)); }
+// pop %edx; shr $1,%edx to get the carry flag from the stack
+#define PopFlagsCF(Cp)	{ if (!(IG->hflags & HF_IN)) G3M(POPdx,0xd1,0xea,(Cp)); }
+// flags back on stack
+#define PushFlags(Cp)	{ if (!(IG->hflags & HF_OUT)) G1(PUSHF,(Cp)); }
+
 // cld; btl $0xa,EFLAGS(%ebx); jnc 1f; std; 1f:
 #define GetDF(Cp)		\
   G4M(CLD,TwoByteESC,0xba,0x63,Cp);	\
@@ -192,6 +192,8 @@
 #define F_HITC	0x0002
 #define F_SLFL	0x0004
 #define F_INHI	0x0008
+#define F_JMPF	0x0010	// ends with a jump a superblock could follow
+#define F_SBLK	0x0020	// superblock, built from a trace head
 
 /////////////////////////////////////////////////////////////////////////////
 
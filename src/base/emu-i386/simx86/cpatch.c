@@ -67,6 +67,7 @@ void m_munprotect(unsigned int addr, unsigned int len, unsigned char *eip)
 /*	if (UnCpatch((void *)(eip-3))) leavedos_main(0); */
 	len = PAGE_ALIGN(addr+len-1) - (addr & _PAGE_MASK);
 	addr &= _PAGE_MASK;
+	SmcPageInvals++;
 	InvalidateNodeRange(addr,len,eip);
 }
 
@@ -222,8 +223,12 @@ void stk_16(dosaddr_t addr, Bit16u value)
 	in_cpatch++;
 	assert(InCompiledCode);
 	InCompiledCode--;
-	e_invalidate(addr, 2);
-	WRITE_WORD(addr, value);
+	if (e_subpage_ok(addr, 2))
+		e_write_subpage(addr, &value, 2);
+	else {
+		e_invalidate(addr, 2);
+		WRITE_WORD(addr, value);
+	}
 	InCompiledCode++;
 	in_cpatch--;
 }
@@ -233,22 +238,32 @@ void stk_32(dosaddr_t addr, Bit32u value)
 	in_cpatch++;
 	assert(InCompiledCode);
 	InCompiledCode--;
-	e_invalidate(addr, 4);
-	WRITE_DWORD(addr, value);
+	if (e_subpage_ok(addr, 4))
+		e_write_subpage(addr, &value, 4);
+	else {
+		e_invalidate(addr, 4);
+		WRITE_DWORD(addr, value);
+	}
 	InCompiledCode++;
 	in_cpatch--;
 }
 
 void wri_8(dosaddr_t addr, Bit8u value, unsigned char *eip)
 {
+	int sub;
+
 	in_cpatch++;
 	assert(InCompiledCode);
 	InCompiledCode--;
-	m_munprotect(addr, 1, eip);
+	sub = e_subpage_ok(addr, 1);
+	if (!sub)
+		m_munprotect(addr, 1, eip);
 	InCompiledCode++;
 	if (!emu_ldt_write(addr, value, 1)) {
 		if (vga_write_access(addr))
 			vga_write(addr, value);
+		else if (sub)
+			e_write_subpage(addr, &value, 1);
 		else
 			WRITE_BYTE(addr,value);
 	}
@@ -257,14 +272,20 @@ void wri_8(dosaddr_t addr, Bit8u value, unsigned char *eip)
 
 void wri_16(dosaddr_t addr, Bit16u value, unsigned char *eip)
 {
+	int sub;
+
 	in_cpatch++;
 	assert(InCompiledCode);
 	InCompiledCode--;
-	m_munprotect(addr, 2, eip);
+	sub = e_subpage_ok(addr, 2);
+	if (!sub)
+		m_munprotect(addr, 2, eip);
 	InCompiledCode++;
 	if (!emu_ldt_write(addr, value, 2)) {
 		if (vga_write_access(addr))
 			vga_write_word(addr, value);
+		else if (sub)
+			e_write_subpage(addr, &value, 2);
 		else
 			WRITE_WORD(addr,value);
 	}
@@ -273,14 +294,20 @@ void wri_16(dosaddr_t addr, Bit16u value, unsigned char *eip)
 
 void wri_32(dosaddr_t addr, Bit32u value, unsigned char *eip)
 {
+	int sub;
+
 	in_cpatch++;
 	assert(InCompiledCode);
 	InCompiledCode--;
-	m_munprotect(addr, 4, eip);
+	sub = e_subpage_ok(addr, 4);
+	if (!sub)
+		m_munprotect(addr, 4, eip);
 	InCompiledCode++;
 	if (!emu_ldt_write(addr, value, 4)) {
 		if (vga_write_access(addr))
 			vga_write_dword(addr, value);
+		else if (sub)
+			e_write_subpage(addr, &value, 4);
 		else
 			WRITE_DWORD(addr,value);
 	}
@@ -877,7 +877,7 @@ static void print_statistics(void)
 		    (long long)CleanupTime/config.CPUSpeedInMhz);
 	dbug_printf("Max tree nodes    %16d\n",MaxNodes);
 	dbug_printf("Max node size     %16d\n",MaxNodeSize);
-	dbug_printf("Max tree depth    %16d\n",MaxDepth);
+	dbug_printf("Max chain depth   %16d\n",MaxDepth);
 	dbug_printf("Nodes parsed      %16d\n",TotalNodesParsed);
 	dbug_printf("Find misses       %16d\n",NodesNotFound);
 	dbug_printf("Nodes executed    %16d\n",TotalNodesExecd);
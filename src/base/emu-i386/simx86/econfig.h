@@ -52,11 +52,30 @@
 #undef	ASM_DUMP
 #define ASM_DUMP_FILE	"/DOS/asmdump.log"
 
-#define AVL_MAX_HEIGHT	20
+#define BLKDIR_L2_BITS	10	/* pages per second-level directory table */
+#define BLKDIR_BUCKETS	32	/* key hash buckets per page, power of 2 */
 #undef	DEBUG_TREE
 #define DEBUG_TREE_FILE	"/DOS/treedump.log"
 
+#define TCACHE_SIZE	(64 << 20)	/* persistent translation cache file */
+#define TCACHE_BUCKETS	65536	/* power of 2 */
+#define TCACHE_QUEUE	1024	/* nodes waiting to be saved */
+
+/* predecoded instructions for the sim backend */
+#define UOP_CACHE	4096	/* entries, power of 2 */
+#define UOP_MAXLEN	16	/* guest bytes of a cached instruction */
+#define UOP_MAXWORDS	64	/* recorded op headers and arguments */
+
 #define	USE_LINKER	1	// 0 or 1
+/* a sequence entered this many times from the run loop is rebuilt as
+ * a superblock following its forward jumps */
+#define HOT_NODE_EXECS	64
+#define SB_MAX_GAP	64	/* max bytes skipped by a followed jump */
+#define SB_MAX_SPAN	4096	/* max source extent of a superblock */
+#define TRACE_HEADS	1024	/* power of 2 */
+/* data writes done around the code in a protected DPMI page before
+ * giving the page up */
+#define SUBPAGE_WRITES	64
 #undef	DEBUG_LINKER
 #undef	SHOW_STAT
 
@@ -690,6 +690,9 @@ extern int Running;		/* into interpreter loop */
 extern unsigned int mMaxMem;
 extern int UseLinker;
 extern int PageFaults;
+extern int SmcFaults;
+extern int SmcSubpageWrites;
+extern int SmcPageInvals;
 
 extern volatile int CEmuStat;
 extern volatile int InCompiledCode;
@@ -728,6 +731,8 @@ int e_markpage(unsigned int addr, size_t len);
 int e_unmarkpage(unsigned int addr, size_t len);
 int e_querymark(unsigned int addr, size_t len);
 int e_querymark_all(unsigned int addr, size_t len);
+int e_subpage_ok(dosaddr_t addr, size_t len);
+void e_write_subpage(dosaddr_t addr, const void *src, size_t len);
 void m_munprotect(unsigned int addr, unsigned int len, unsigned char *eip);
 void mprot_init(void);
 void mprot_end(void);
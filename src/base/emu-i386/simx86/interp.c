@@ -36,6 +36,7 @@
 #include <string.h>
 #include "emu86.h"
 #include "codegen-arch.h"
+#include "tcache.h"
 #include "port.h"
 #include "emudpmi.h"
 #include "mhpdbg.h"
@@ -307,6 +308,26 @@ static unsigned int _JumpGen(unsigned int P2, int mode, int opc,
 		    TheCPU.eip = d_t;
 		    return j_t;
 		}
+#ifdef HOST_ARCH_X86
+		/* a short forward jump inside a sequence: follow it if the
+		 * sequence is a trace head and the code skipped over and
+		 * jumped to is not compiled, else remember the jump so the
+		 * sequence can become one when hot */
+		if (!CONFIG_CPUSIM && !(EFLAGS & TF) && opc != JMPld &&
+		    CurrIMeta > 0 && j_t >= P1 && j_t - P1 <= SB_MAX_GAP) {
+		    unsigned int S = InstrMeta[0].npc;
+		    if (IsTraceHead(S) && j_t - S < SB_MAX_SPAN &&
+			!e_querymark(P1, j_t - P1 + 1)) {
+			if (debug_level('e')>1)
+			    e_printf("** JMP: followed to %08x\n", j_t);
+			InstrMeta[0].flags |= F_SBLK;
+			TheCPU.mode |= SKIPOP;
+			TheCPU.eip = d_t;
+			return j_t;
+		    }
+		    InstrMeta[0].flags |= F_JMPF;
+		}
+#endif
 #endif
 		if (dsp <= 0) mode |= CKSIGN;
 		if (CONFIG_CPUSIM)
@@ -436,7 +457,7 @@ static unsigned int FindExecCode(unsigned int PC)
 		/* try fast inner loop if nothing special is going on */
 		if (!(EFLAGS & TF) && !(CEmuStat & (CeS_INHI|CeS_MOVSS)) &&
 		    !debug_level('e') &&
-		    GoodNode(G, mode) && !(G->flags & (F_FPOP|F_INHI)))
+		    GoodNode(G, mode) && !(G->flags & F_INHI))
 			PC = Exec_x86_fast(G);
 		else
 #endif
@@ -525,6 +546,10 @@ static unsigned int interp_pre(unsigned int PC, const int mode, int *_NewNode,
 			}
 		}
 #ifdef HOST_ARCH_X86
+		/* at the start of a sequence, try the translation cache */
+		if (TCacheActive && !CONFIG_CPUSIM && !NewNode &&
+		    !(EFLAGS & TF) && !e_querymark(PC, 1))
+			RestoreNode_x86(PC, mode);
 		if (!CONFIG_CPUSIM && e_querymark(PC, 1)) {
 			unsigned int P2 = PC;
 			if (NewNode) {
@@ -654,7 +679,11 @@ static unsigned int _Interp86(unsigned int PC, int basemode)
 		PC = interp_pre(PC, mode, &NewNode, &P0);
 		if (TheCPU.err)
 			return PC;
-		PC = InterpOne(PC, &basemode, &mode, &NewNode);
+		if (!CONFIG_CPUSIM || !SimUopRun(&PC, &mode)) {
+			PC = InterpOne(PC, &basemode, &mode, &NewNode);
+			if (CONFIG_CPUSIM)
+				SimUopRecEnd(PC, mode);
+		}
 		if (TheCPU.err)
 			return PC;
 		PC = interp_post(PC, mode, &NewNode, &P0);
@@ -59,11 +59,16 @@ typedef struct _mpmap {
 	int mega;
 	unsigned char pagemap[32];	/* (32*8)=256 pages *4096 = 1M */
 	uint64_t subpage[(0x100000>>CGRAN)/UINT64_WIDTH];	/* 2^CGRAN-byte granularity, 1M/2^CGRAN bits */
+	unsigned char dwrites[256];	/* data writes let through per page */
 } tMpMap;
 
 static tMpMap *MpH = NULL;
 unsigned int mMaxMem = 0;
 int PageFaults = 0;
+/* self-modifying code counters, reported and reset by CollectStat() */
+int SmcFaults = 0;
+int SmcSubpageWrites = 0;
+int SmcPageInvals = 0;
 static tMpMap *LastMp = NULL;
 
 static int e_munprotect(unsigned int addr, size_t len);
@@ -105,6 +110,8 @@ static int AddMpMap(unsigned int addr, unsigned int aend, int onoff)
 		M->next = MpH; MpH = M;
 		M->mega = (page>>8);
 	    }
+	    if (onoff && !test_bit(page&255, M->pagemap))
+		M->dwrites[page&255] = 0;
 	    if (bp < 32) {
 		bs |= (((unsigned)(onoff? test_and_set_bit(page&255, M->pagemap) :
 			    test_and_clear_bit(page&255, M->pagemap)) & 1) << bp);
@@ -366,6 +373,49 @@ static int e_munprotect(unsigned int addr, size_t len)
 	return ret;
 }
 
+/*
+ * A write into a protected DPMI page which does not hit any of the code
+ * marked in it can be done without unprotecting the page, and so
+ * without throwing away all the other nodes there. Pages taking more
+ * than SUBPAGE_WRITES such writes are considered data pages, and the
+ * write is left to the usual invalidate-and-unprotect path.
+ * Low memory has an unprotected alias and never needs this.
+ */
+int e_subpage_ok(dosaddr_t addr, size_t len)
+{
+	tMpMap *M;
+	int page;
+
+	if (addr < LOWMEM_SIZE + HMASIZE || ((addr ^ (addr+len-1)) & _PAGE_MASK))
+		return 0;
+	if (!e_querymprot(addr) || e_querymark(addr, len))
+		return 0;
+	M = FindM(addr);
+	page = (addr >> PAGE_SHIFT) & 255;
+	if (M->dwrites[page] >= SUBPAGE_WRITES)
+		return 0;
+	M->dwrites[page]++;
+	return 1;
+}
+
+/* Do a write allowed by e_subpage_ok() */
+void e_write_subpage(dosaddr_t addr, const void *src, size_t len)
+{
+	dosaddr_t page = addr & _PAGE_MASK;
+
+	if (mprotect_mapping(MAPPING_CPUEMU, page, PAGE_SIZE,
+			PROT_READ|PROT_WRITE|PROT_EXEC) < 0) {
+		e_printf("MPSUB: %s\n",strerror(errno));
+		InvalidateNodeRange(page, PAGE_SIZE, NULL);
+		SmcPageInvals++;
+		memcpy(MEM_BASE32(addr), src, len);
+		return;
+	}
+	memcpy(MEM_BASE32(addr), src, len);
+	mprotect_mapping(MAPPING_CPUEMU, page, PAGE_SIZE, PROT_READ|PROT_EXEC);
+	SmcSubpageWrites++;
+}
+
 #ifdef HOST_ARCH_X86
 int e_handle_pagefault(dosaddr_t addr, unsigned err, sigcontext_t *scp)
 {
@@ -415,6 +465,7 @@ int e_handle_pagefault(dosaddr_t addr, unsigned err, sigcontext_t *scp)
 #if PROFILE
 	if (debug_level('e')) PageFaults++;
 #endif
+	SmcFaults++;
 	in_dosemu = !(InCompiledCode || in_vm86 || DPMIValidSelector(_scp_cs));
 	if (in_vm86)
 		p = SEG_ADR((unsigned char *), cs, ip);
@@ -454,6 +505,7 @@ int e_handle_pagefault(dosaddr_t addr, unsigned err, sigcontext_t *scp)
 	/* We HAVE to invalidate all the code in the page
 	 * if the page is going to be unprotected */
 	addr &= _PAGE_MASK;
+	SmcPageInvals++;
 	return InvalidateNodeRange(addr, PAGE_SIZE, p);
 }
 
@@ -483,6 +535,7 @@ void mprot_init(void)
 	MpH = NULL;
 	AddMpMap(0,0,0);	/* first mega in first entry */
 	PageFaults = 0;
+	SmcFaults = SmcSubpageWrites = SmcPageInvals = 0;
 }
 
 void mprot_end(void)
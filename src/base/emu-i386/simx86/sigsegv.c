@@ -84,30 +84,24 @@ void e_VgaMovs(unsigned char **rdi, unsigned char **rsi, unsigned int rep,
 	}
 	break;
     case 2:		/* writing from mem to VGA */
-	switch (abs(dp)) {
-	case 1: /* byte move */
-	    while (rep--) {
-		vga_write(edi,READ_BYTE(esi));
-		esi+=dp,edi+=dp;
-	    }
-	    break;
-	case 2: /* word move */
-	    while (rep--) {
-		vga_write_word(edi,READ_WORD(esi));
-		esi+=dp,edi+=dp;
-	    }
-	    break;
-	case 4: /* long move */
-	    while (rep--) {
-		vga_write_dword(edi,READ_DWORD(esi));
-		esi+=dp,edi+=dp;
-	    }
-	    break;
+	/* VGA writes don't touch the latches, so the order doesn't
+	 * matter and the whole range can be written at once */
+	if (rep) {
+	    unsigned int len = rep * abs(dp);
+	    int back = dp < 0 ? len - abs(dp) : 0;
+	    memcpy_dos_to_vga(edi - back, esi - back, len);
+	    esi += rep * dp, edi += rep * dp;
 	}
 	break;
     case 3:		/* VGA to VGA */
 	switch (abs(dp)) {
 	case 1: /* byte move */
+		/* a forward copy onto itself repeats the pattern */
+		if (dp > 0 && (edi <= esi || edi >= esi + rep)) {
+		  vga_memcpy(edi, esi, rep);
+		  esi += rep, edi += rep;
+		  break;
+		}
 	        while (rep--) {
 		  vga_write(edi,vga_read(esi));
 		  esi+=dp,edi+=dp;
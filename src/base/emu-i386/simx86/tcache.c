@@ -0,0 +1,463 @@
+/***************************************************************************
+ *
+ * All modifications in this file to the original code are
+ * (C) Copyright 1992, ..., 2014 the "DOSEMU-Development-Team".
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ *
+ *
+ *  SIMX86 persistent translation cache
+ *
+ *  Translated sequences are saved, together with their link points
+ *  and the guest bytes they were generated from, into a memory-mapped
+ *  file shared between dosemu runs. When the interpreter reaches a PC
+ *  with no code, the file is searched for a sequence starting there
+ *  whose guest bytes, CS base, mode and CPU state (V86, IOPL, CPL)
+ *  still match; if one is found it enters the node directory as if it
+ *  had just been compiled.
+ *
+ *  The generated code only refers to the CPU state through ebx and to
+ *  guest memory through ebp, so it can be reused as is. The file is
+ *  discarded when it was written by a different build or with CPU
+ *  options that change code generation.
+ *
+ *  Saving is done by a worker thread: the emulation thread only takes
+ *  a copy of the new node and queues it, hashing, locking the file
+ *  against other runs and writing the entry happen in the background.
+ *  Readers never lock, entries are published with a release store.
+ *
+ ***************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "emu86.h"
+#include "dlmalloc.h"
+#include "codegen-arch.h"
+#include "emudpmi.h"
+#include "version.h"
+#include "tcache.h"
+
+#ifdef HOST_ARCH_X86
+
+#define TC_MAGIC	"SIMX86TC"
+#define TC_VERSION	2
+#define TC_ALIGN(n)	(((n) + 7) & ~7)
+
+struct tc_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t sig;
+	uint32_t size;
+	uint32_t used;		/* end of the entry area */
+	uint32_t entries;
+	uint32_t index[TCACHE_BUCKETS];	/* entry chain heads, 0=empty */
+};
+
+struct tc_entry {
+	uint32_t next;		/* next entry in the same bucket */
+	uint32_t key, cs, mode;
+	uint64_t hash;		/* of the guest bytes */
+	uint32_t seqbase;
+	uint16_t seqlen, seqnum, len, flags;
+	uint8_t t_type, state, pad[2];
+	uint32_t t_rel, nt_rel;
+	/* followed by seqlen guest bytes, seqnum+1 Addr2Pc and len bytes
+	 * of code */
+	unsigned char data[];
+};
+
+/* a node waiting to be saved, entry fields except next and hash */
+struct tc_job {
+	struct tc_job *next;
+	uint32_t size;
+	struct tc_entry e;
+};
+
+int TCacheActive = 0;
+int TCacheHits = 0;
+int TCacheStores = 0;
+int TCacheDropped = 0;
+
+static struct tc_header *TcHdr;
+static uint32_t tc_sig;
+static int tc_fd = -1;
+static int tc_full;
+
+static pthread_t tc_thr;
+static pthread_mutex_t tc_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tc_cond = PTHREAD_COND_INITIALIZER;
+static struct tc_job *tc_qhead, **tc_qtail = &tc_qhead;
+static int tc_qlen, tc_stop;
+
+static void *tc_worker(void *arg);
+
+static uint64_t tc_hash(const unsigned char *p, unsigned len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static unsigned tc_bucket(unsigned key, unsigned cs, int mode)
+{
+	unsigned h = key * 0x9e3779b1u ^ cs * 0x85ebca6bu ^ mode;
+
+	return (h ^ (h >> 16)) & (TCACHE_BUCKETS-1);
+}
+
+/* Everything code generation depends on besides the guest code itself */
+static uint32_t tc_signature(void)
+{
+	char buf[256];
+	int n;
+
+	n = snprintf(buf, sizeof(buf), "%s %i %i %zu %zu %i%i%i%i",
+		     VERSTR, REVISION, GCC_VERSION_CODE, sizeof(TheCPU),
+		     sizeof(Addr2Pc), config.cpuprefetcht0, config.cpufxsr,
+		     config.cpusse, PROFILE);
+	return (uint32_t)tc_hash((unsigned char *)buf, n);
+}
+
+/* the CPU state the generated code depends on besides the mode */
+static uint8_t tc_cpu_state(void)
+{
+	return V86MODE() | (REALMODE() << 1) | (IOPL << 2) | (CPL << 4) |
+	    ((TheCPU.cr[4] & (CR4_VME|CR4_PVI)) << 6);
+}
+
+/* the file may have been set up again by another build meanwhile */
+static int tc_header_ok(void)
+{
+	return memcmp(TcHdr->magic, TC_MAGIC, sizeof(TcHdr->magic)) == 0 &&
+	    TcHdr->version == TC_VERSION && TcHdr->sig == tc_sig &&
+	    TcHdr->size == TCACHE_SIZE && TcHdr->used <= TCACHE_SIZE;
+}
+
+/* the guest code can only be read from where the JIT itself runs */
+static int tc_goodrange(dosaddr_t addr, unsigned len)
+{
+	if (addr + len < addr || addr + len > mMaxMem)
+		return 0;
+	if (addr + len <= LOWMEM_SIZE + HMASIZE)
+		return 1;
+	return dpmi_is_valid_range(addr, len);
+}
+
+void TCacheInit(void)
+{
+	struct stat st;
+	void *m;
+
+	if (!config.cpuemu_tcache || !config.cpuemu_tcache[0])
+		return;
+	tc_fd = open(config.cpuemu_tcache, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (tc_fd == -1) {
+		error("simx86: cannot open translation cache %s: %s\n",
+		      config.cpuemu_tcache, strerror(errno));
+		return;
+	}
+	flock(tc_fd, LOCK_EX);
+	if (fstat(tc_fd, &st) == -1 || st.st_size != TCACHE_SIZE) {
+		if (ftruncate(tc_fd, 0) == -1 ||
+		    ftruncate(tc_fd, TCACHE_SIZE) == -1) {
+			error("simx86: cannot size translation cache: %s\n",
+			      strerror(errno));
+			goto err;
+		}
+	}
+	m = mmap(NULL, TCACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 tc_fd, 0);
+	if (m == MAP_FAILED) {
+		error("simx86: cannot map translation cache: %s\n",
+		      strerror(errno));
+		goto err;
+	}
+	TcHdr = m;
+	tc_sig = tc_signature();
+	if (!tc_header_ok()) {
+		e_printf("TCache: initializing %s\n", config.cpuemu_tcache);
+		memset(TcHdr, 0, sizeof(*TcHdr));
+		memcpy(TcHdr->magic, TC_MAGIC, sizeof(TcHdr->magic));
+		TcHdr->version = TC_VERSION;
+		TcHdr->sig = tc_sig;
+		TcHdr->size = TCACHE_SIZE;
+		TcHdr->used = TC_ALIGN(sizeof(*TcHdr));
+	}
+	flock(tc_fd, LOCK_UN);
+	e_printf("TCache: %s has %u entries, %u bytes used\n",
+		 config.cpuemu_tcache, TcHdr->entries, TcHdr->used);
+	tc_full = 0;
+	TCacheHits = TCacheStores = TCacheDropped = 0;
+	tc_stop = 0;
+	if (pthread_create(&tc_thr, NULL, tc_worker, NULL) != 0) {
+		error("simx86: cannot start translation cache thread\n");
+		munmap(TcHdr, TCACHE_SIZE);
+		TcHdr = NULL;
+		close(tc_fd);
+		tc_fd = -1;
+		return;
+	}
+#if defined(HAVE_PTHREAD_SETNAME_NP) && defined(__GLIBC__)
+	pthread_setname_np(tc_thr, "dosemu: tcache");
+#endif
+	TCacheActive = 1;
+	return;
+
+err:
+	flock(tc_fd, LOCK_UN);
+	close(tc_fd);
+	tc_fd = -1;
+}
+
+void TCacheDone(void)
+{
+	if (!TCacheActive)
+		return;
+	/* let the worker drain the queue */
+	pthread_mutex_lock(&tc_mtx);
+	tc_stop = 1;
+	pthread_cond_signal(&tc_cond);
+	pthread_mutex_unlock(&tc_mtx);
+	pthread_join(tc_thr, NULL);
+	e_printf("TCache: %d hits, %d stores, %d dropped, %u entries\n",
+		 TCacheHits, TCacheStores, TCacheDropped, TcHdr->entries);
+	munmap(TcHdr, TCACHE_SIZE);
+	close(tc_fd);
+	TcHdr = NULL;
+	tc_fd = -1;
+	TCacheActive = 0;
+}
+
+static struct tc_entry *tc_entry(uint32_t off)
+{
+	return off ? (struct tc_entry *)((unsigned char *)TcHdr + off) : NULL;
+}
+
+/*
+ * Readers don't lock, so whatever comes from the file is checked before
+ * use: the entry must lie below `used', and entries are appended, so a
+ * chain only goes down, which also rules out loops.
+ */
+static struct tc_entry *tc_entry_checked(uint32_t off, uint32_t below,
+					 uint32_t used)
+{
+	struct tc_entry *E;
+
+	if (off == 0 || off >= below || off & 7 ||
+	    off < TC_ALIGN(sizeof(*TcHdr)) ||
+	    used - off < offsetof(struct tc_entry, data))
+		return NULL;
+	E = tc_entry(off);
+	if (used - off - offsetof(struct tc_entry, data) <
+	    E->seqlen + (E->seqnum + 1) * sizeof(Addr2Pc) + E->len)
+		return NULL;
+	return E;
+}
+
+static int tc_match(const struct tc_entry *E, unsigned key, unsigned cs,
+		    int mode, uint8_t state)
+{
+	return E->key == key && E->cs == cs && E->mode == (uint32_t)mode &&
+	    E->state == state;
+}
+
+/* write out a queued node, worker thread only */
+static void tc_write(struct tc_job *J)
+{
+	struct tc_entry *N = &J->e, *E;
+	unsigned b = tc_bucket(N->key, N->cs, N->mode);
+	uint32_t off, used;
+
+	N->hash = tc_hash(N->data, N->seqlen);
+	flock(tc_fd, LOCK_EX);
+	/* a run of another build may have set the file up again */
+	if (!tc_header_ok()) {
+		e_printf("TCache: %s was reinitialized, not saving\n",
+			 config.cpuemu_tcache);
+		__atomic_store_n(&tc_full, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+	used = TcHdr->used;
+	/* another run may have saved the same sequence meanwhile */
+	for (E = tc_entry_checked(TcHdr->index[b], used, used); E;
+	     E = tc_entry_checked(E->next, (unsigned char *)E -
+				  (unsigned char *)TcHdr, used)) {
+		if (tc_match(E, N->key, N->cs, N->mode, N->state) &&
+		    E->hash == N->hash && E->seqbase == N->seqbase &&
+		    E->seqlen == N->seqlen)
+			goto out;
+	}
+	off = used;
+	if (off + J->size > TcHdr->size) {
+		e_printf("TCache: %s is full\n", config.cpuemu_tcache);
+		__atomic_store_n(&tc_full, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+	E = tc_entry(off);
+	memcpy(E, N, J->size);
+	E->next = TcHdr->index[b];
+	/* readers do not lock and check entries against used: publish
+	 * the entry last */
+	__atomic_store_n(&TcHdr->used, off + J->size, __ATOMIC_RELEASE);
+	__atomic_store_n(&TcHdr->index[b], off, __ATOMIC_RELEASE);
+	TcHdr->entries++;
+	__atomic_add_fetch(&TCacheStores, 1, __ATOMIC_RELAXED);
+out:
+	flock(tc_fd, LOCK_UN);
+}
+
+static void *tc_worker(void *arg)
+{
+	struct tc_job *J;
+
+	pthread_mutex_lock(&tc_mtx);
+	for (;;) {
+		while (!tc_qhead && !tc_stop)
+			pthread_cond_wait(&tc_cond, &tc_mtx);
+		if (!tc_qhead)
+			break;
+		J = tc_qhead;
+		tc_qhead = J->next;
+		if (!tc_qhead)
+			tc_qtail = &tc_qhead;
+		tc_qlen--;
+		pthread_mutex_unlock(&tc_mtx);
+		if (!tc_full)
+			tc_write(J);
+		free(J);
+		pthread_mutex_lock(&tc_mtx);
+	}
+	pthread_mutex_unlock(&tc_mtx);
+	return NULL;
+}
+
+/*
+ * Queue a freshly translated node for saving. Must be called before the
+ * node is linked or patched, as its code is copied as is.
+ */
+void TCacheStore(TNode *G)
+{
+	unsigned nap = G->seqnum + 1;
+	struct tc_job *J;
+	struct tc_entry *E;
+	uint32_t size;
+
+	if (!TCacheActive || __atomic_load_n(&tc_full, __ATOMIC_RELAXED) ||
+	    G->seqlen == 0 || !tc_goodrange(G->seqbase, G->seqlen))
+		return;
+	size = TC_ALIGN(offsetof(struct tc_entry, data) + G->seqlen +
+			nap * sizeof(Addr2Pc) + G->len);
+	J = malloc(offsetof(struct tc_job, e) + size);
+	if (!J)
+		return;
+	J->next = NULL;
+	J->size = size;
+	E = &J->e;
+	memset(E, 0, offsetof(struct tc_entry, data));
+	E->key = G->key;
+	E->cs = G->cs;
+	E->mode = G->mode;
+	E->state = tc_cpu_state();
+	E->seqbase = G->seqbase;
+	E->seqlen = G->seqlen;
+	E->seqnum = G->seqnum;
+	E->len = G->len;
+	E->flags = G->flags;
+	E->t_type = G->clink.t_type;
+	if (G->clink.t_type >= JMP_LINK)
+		E->t_rel = (unsigned char *)G->clink.t_link.abs - G->addr;
+	if (G->clink.t_type > JMP_LINK)
+		E->nt_rel = (unsigned char *)G->clink.nt_link.abs - G->addr;
+	memcpy(E->data, MEM_BASE32(G->seqbase), G->seqlen);
+	memcpy(E->data + G->seqlen, G->pmeta, nap * sizeof(Addr2Pc));
+	memcpy(E->data + G->seqlen + nap * sizeof(Addr2Pc), G->addr, G->len);
+
+	pthread_mutex_lock(&tc_mtx);
+	if (tc_qlen >= TCACHE_QUEUE) {
+		/* the worker is stuck behind another run holding the lock */
+		pthread_mutex_unlock(&tc_mtx);
+		free(J);
+		TCacheDropped++;
+		return;
+	}
+	*tc_qtail = J;
+	tc_qtail = &J->next;
+	tc_qlen++;
+	pthread_cond_signal(&tc_cond);
+	pthread_mutex_unlock(&tc_mtx);
+}
+
+/*
+ * Look for a saved translation of the sequence at PC and add it to the
+ * node directory. The caller marks and protects its pages.
+ */
+TNode *TCacheFetch(unsigned int PC, int mode)
+{
+	unsigned cs = LONG_CS;
+	uint8_t state = tc_cpu_state();
+	struct tc_entry *E;
+	uint32_t off, used;
+
+	if (!TCacheActive || !tc_header_ok())
+		return NULL;
+	off = __atomic_load_n(&TcHdr->index[tc_bucket(PC, cs, mode)],
+			      __ATOMIC_ACQUIRE);
+	used = __atomic_load_n(&TcHdr->used, __ATOMIC_ACQUIRE);
+	if (used > TCACHE_SIZE)
+		return NULL;
+	for (E = tc_entry_checked(off, used, used); E;
+	     E = tc_entry_checked(E->next, (unsigned char *)E -
+				  (unsigned char *)TcHdr, used)) {
+		unsigned char *src;
+		unsigned nap;
+		CodeBuf *cb;
+		linkdesc lk;
+		TNode *G;
+
+		if (!tc_match(E, PC, cs, mode, state) ||
+		    !tc_goodrange(E->seqbase, E->seqlen))
+			continue;
+		src = MEM_BASE32(E->seqbase);
+		if (tc_hash(src, E->seqlen) != E->hash ||
+		    memcmp(src, E->data, E->seqlen) != 0)
+			continue;
+
+		/* same as when closing a sequence: nothing may overlap */
+		if (e_querymark(E->seqbase, E->seqlen))
+			InvalidateNodeRange(E->seqbase, E->seqlen, NULL);
+
+		nap = E->seqnum + 1;
+		cb = dlmalloc(offsetof(CodeBuf, meta) + nap * sizeof(Addr2Pc) +
+			      E->len);
+		memcpy(cb->meta, E->data + E->seqlen, nap * sizeof(Addr2Pc));
+		memcpy(&cb->meta[nap], E->data + E->seqlen +
+		       nap * sizeof(Addr2Pc), E->len);
+		memset(&lk, 0, sizeof(lk));
+		lk.t_type = E->t_type;
+		lk.t_link.rel = E->t_rel;
+		lk.nt_link.rel = E->nt_rel;
+		G = Cache2Tree(PC, E->seqbase, E->seqlen, E->seqnum, E->len,
+			       E->flags, &lk, cb);
+		TCacheHits++;
+		if (debug_level('e')>2)
+			e_printf("TCache: restored node at %08x len=%d\n",
+				 PC, E->len);
+		return G;
+	}
+	return NULL;
+}
+
+#endif	// HOST_ARCH_X86
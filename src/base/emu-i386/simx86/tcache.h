@@ -0,0 +1,25 @@
+/***************************************************************************
+ *
+ * All modifications in this file to the original code are
+ * (C) Copyright 1992, ..., 2014 the "DOSEMU-Development-Team".
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ *
+ ***************************************************************************/
+
+#ifndef _EMU86_TCACHE_H
+#define _EMU86_TCACHE_H
+
+#ifdef HOST_ARCH_X86
+void TCacheInit(void);
+void TCacheDone(void);
+void TCacheStore(TNode *G);
+TNode *TCacheFetch(unsigned int PC, int mode);
+
+extern int TCacheActive;
+extern int TCacheHits;
+extern int TCacheStores;
+extern int TCacheDropped;
+#endif
+
+#endif
@@ -49,13 +49,25 @@
 #include "emu86.h"
 #include "dlmalloc.h"
 #include "codegen-arch.h"
+#include "tcache.h"
 
 IMeta	*InstrMeta;
 int	CurrIMeta = -1;
 
-/* Tree structure to store collected code sequences */
-avltr_tree CollectTree;
-avltr_traverser Traverser;
+/* Directory of collected code sequences, indexed by linear page */
+static BlkPage **BlkDir[BLKDIR_L1_SIZE];
+/* All nodes, newest first, and the next one the aging sweep visits */
+static TNode *NodeList;
+static TNode *CleanCursor;
+
+/* Sequence starts which are rebuilt as superblocks. A head whose
+ * superblock gets invalidated is not tried again. */
+#define TH_HEAD		1
+#define TH_FAILED	2
+static struct {
+	int key;
+	int state;
+} TraceHeads[TRACE_HEADS];
 int ninodes = 0;
 
 int NodesCleaned = 0;
@@ -64,6 +76,16 @@ int NodesExecd = 0;
 int CleanFreq = 8;
 int CreationIndex = 0;
 
+/* lookup/invalidation counters, reported and reset by CollectStat() */
+int DirPages = 0;
+int FindCalls = 0;
+int FindFastHits = 0;
+int FindDirHits = 0;
+int FindMisses = 0;
+int InvalScans = 0;
+int InvalNodes = 0;
+int SuperBlocks = 0;
+
 #if PROFILE
 int MaxDepth = 0;
 int MaxNodes = 0;
@@ -89,19 +111,19 @@ int NodeLimit = 10000;
 #define ADDR_IN_RANGE(a,l,h)		({typeof(a) _a2=(a);	\
 	((_a2 >= (l)) && (_a2 < (h))); })
 
-/////////////////////////////////////////////////////////////////////////////
+#define BLKPAGE(a)	((unsigned)(a) >> PAGE_SHIFT)
+#define BLKHASH(k)	(((k) ^ ((k) >> 5)) & (BLKDIR_BUCKETS-1))
+#define NODEEND(G)	((G)->seqbase + (G)->seqlen)
+#define TRACEHASH(k)	(((k) ^ ((k) >> 10)) & (TRACE_HEADS-1))
 
-#define NEXTNODE(g)	({__typeof__(g) _g = (g)->link[1]; \
-			  if ((g)->rtag == PLUS) \
-			    while (_g->link[0]!=NULL) _g=_g->link[0]; \
-			  _g; })
+/////////////////////////////////////////////////////////////////////////////
 
 static inline TNode *Tmalloc(void)
 {
-  TNode *G  = TNodePool->link[0];
-  TNode *G1 = G->link[0];
+  TNode *G  = TNodePool->hnext;
+  TNode *G1 = G->hnext;
   if (G1==TNodePool) leavedos_main(0x4c4c); // return NULL;
-  TNodePool->link[0] = G1; G->link[0]=NULL;
+  TNodePool->hnext = G1;
   memset(G, 0, sizeof(TNode));	// "bug covering"
   return G;
 }
@@ -110,468 +132,249 @@ static inline void Tfree(TNode *G)
 {
   G->key = G->alive = 0;
   G->addr = NULL;
-  G->link[0] = TNodePool->link[0];
-  TNodePool->link[0] = G;
+  G->hnext = TNodePool->hnext;
+  TNodePool->hnext = G;
 }
 
 /////////////////////////////////////////////////////////////////////////////
 
-static inline void datacopy(TNode *nd, TNode *ns)
+static inline BlkPage *blkdir_get(unsigned page)
 {
-  char *s = (char *)&(ns->key);
-  char *d = (char *)&(nd->key);
-  int l = sizeof(TNode)-offsetof(TNode,key);
-  memcpy(d,s,l);
+  BlkPage **L2 = BlkDir[page >> BLKDIR_L2_BITS];
+  if (L2 == NULL) return NULL;
+  return L2[page & (BLKDIR_L2_SIZE-1)];
 }
 
-static TNode *avltr_probe (const int key, int *found)
+static BlkPage *blkdir_alloc(unsigned page)
 {
-  avltr_tree *tree = &CollectTree;
-  TNode *t;
-  TNode *s, *p, *q, *r;
-  int k = 1;
-
-  t = &tree->root;
-  s = p = t->link[0];
-
-  if (s == NULL) {
-      tree->count++;
-      ninodes = tree->count;
-      q = t->link[0] = Tmalloc();
-      q->link[0] = NULL;
-      q->link[1] = t;
-      q->rtag = MINUS;
-      q->bal = 0;
-      return q;
+  BlkPage ***L2 = &BlkDir[page >> BLKDIR_L2_BITS];
+  BlkPage **P;
+
+  if (*L2 == NULL)
+    *L2 = calloc(BLKDIR_L2_SIZE, sizeof(BlkPage *));
+  P = &(*L2)[page & (BLKDIR_L2_SIZE-1)];
+  if (*P == NULL) {
+    *P = calloc(1, sizeof(BlkPage));
+    DirPages++;
   }
+  return *P;
+}
 
-  for (;;) {
-      int diff = (key - p->key);
-
-      if (diff < 0) {
-	  p->cache = 0;
-	  q = p->link[0];
-	  if (q == NULL) {
-	      q = Tmalloc();
-	      p->link[0] = q;
-	      q->link[0] = NULL;
-	      q->link[1] = p;
-	      q->rtag = MINUS;
-	      break;
-	  }
-      }
-      else if (diff > 0) {
-	  p->cache = 1;
-	  q = p->link[1];
-	  if (p->rtag == MINUS) {
-	      q = Tmalloc();
-	      q->link[1] = p->link[1];
-	      q->rtag = p->rtag;
-	      p->link[1] = q;
-	      p->rtag = PLUS;
-	      q->link[0] = NULL;
-	      break;
-	  }
-      }
-      else {	/* found */
-        *found = 1;
-	return p;
-      }
+static void blkdir_release(unsigned page)
+{
+  BlkPage **L2 = BlkDir[page >> BLKDIR_L2_BITS];
+  BlkPage **P = &L2[page & (BLKDIR_L2_SIZE-1)];
 
-      if (q->bal != 0) t = p, s = q;
-      p = q;
-      k++;
-/**/ if (k>=AVL_MAX_HEIGHT) leavedos_main(0x777);
-#if PROFILE
-      if (debug_level('e')) if (k>MaxDepth) MaxDepth=k;
-#endif
-  }
+  if (--(*P)->refs > 0) return;
+  free(*P);
+  *P = NULL;
+  DirPages--;
+}
 
-  tree->count++;
-  ninodes = tree->count;
+/* Enter a node in the directory. Its key and source range must be set. */
+static void blkdir_insert(TNode *G)
+{
+  unsigned p0 = BLKPAGE(G->seqbase);
+  unsigned p1 = BLKPAGE(NODEEND(G));
+  unsigned p;
+  BlkPage *P;
+
+  for (p = p0; p <= p1; p++) {
+    P = blkdir_alloc(p);
+    P->refs++;
+    if (P->reach < (int)(p - p0)) P->reach = p - p0;
+  }
+  /* the key lies inside the source range, so its page exists now */
+  P = blkdir_get(BLKPAGE(G->key));
+  G->hnext = P->bucket[BLKHASH(G->key)];
+  P->bucket[BLKHASH(G->key)] = G;
+
+  P = blkdir_get(p0);
+  G->pnext = P->starts;
+  if (G->pnext) G->pnext->pprev = &G->pnext;
+  G->pprev = &P->starts;
+  P->starts = G;
+
+  G->lnext = NodeList;
+  if (G->lnext) G->lnext->lprev = &G->lnext;
+  G->lprev = &NodeList;
+  NodeList = G;
+  ninodes++;
 #if PROFILE
   if (debug_level('e')) if (ninodes > MaxNodes) MaxNodes = ninodes;
 #endif
-  q->bal = 0;
-
-  r = p = s->link[(int) s->cache];
-  while (p != q) {
-      p->bal = p->cache * 2 - 1;
-      p = p->link[(int) p->cache];
-  }
+}
 
-  if (s->cache == 0) {
-      if (s->bal == 0) {
-	  s->bal = -1;
-	  return q;
-      }
-      else if (s->bal == +1) {
-	  s->bal = 0;
-	  return q;
-      }
+static void blkdir_remove(TNode *G)
+{
+  unsigned p0 = BLKPAGE(G->seqbase);
+  unsigned p1 = BLKPAGE(NODEEND(G));
+  unsigned p;
+  TNode **H;
 
-      if (r->bal == -1)	{
-	  p = r;
-	  if (r->rtag == MINUS) {
-	      s->link[0] = NULL;
-	      r->link[1] = s;
-	      r->rtag = PLUS;
-	  }
-	  else {
-	      s->link[0] = r->link[1];
-	      r->link[1] = s;
-	  }
-	  s->bal = r->bal = 0;
-      }
-      else {
-	  p = r->link[1];
-	  r->link[1] = p->link[0];
-	  p->link[0] = r;
-	  s->link[0] = p->link[1];
-	  p->link[1] = s;
-	  if (p->bal == -1) s->bal = 1, r->bal = 0;
-	    else if (p->bal == 0) s->bal = r->bal = 0;
-	      else s->bal = 0, r->bal = -1;
-	  p->bal = 0;
-	  p->rtag = PLUS;
-	  if (s->link[0] == s) s->link[0] = NULL;
-	  if (r->link[1] == NULL) {
-	      r->link[1] = p;
-	      r->rtag = MINUS;
-	  }
-      }
-  }
-  else {
-      if (s->bal == 0) {
-	  s->bal = 1;
-	  return q;
-      }
-      else if (s->bal == -1) {
-	  s->bal = 0;
-	  return q;
-      }
+  H = &blkdir_get(BLKPAGE(G->key))->bucket[BLKHASH(G->key)];
+  while (*H != G) H = &(*H)->hnext;
+  *H = G->hnext;
 
-      if (r->bal == +1)	{
-	  p = r;
-	  if (r->link[0] == NULL) {
-	      s->rtag = MINUS;
-	      r->link[0] = s;
-	  }
-	  else {
-	      s->link[1] = r->link[0];
-	      s->rtag = PLUS;
-	      r->link[0] = s;
-	  }
-	  s->bal = r->bal = 0;
-      }
-      else {
-	  p = r->link[0];
-	  r->link[0] = p->link[1];
-	  p->link[1] = r;
-	  s->link[1] = p->link[0];
-	  p->link[0] = s;
-	  if (p->bal == +1) s->bal = -1, r->bal = 0;
-	    else if (p->bal == 0) s->bal = r->bal = 0;
-	      else s->bal = 0, r->bal = 1;
-	  p->rtag = PLUS;
-	  if (s->link[1] == NULL) {
-	      s->link[1] = p;
-	      s->rtag = MINUS;
-	  }
-	  if (r->link[0] == r) r->link[0] = NULL;
-	  p->bal = 0;
-      }
-  }
+  *G->pprev = G->pnext;
+  if (G->pnext) G->pnext->pprev = G->pprev;
 
-  if (t != &tree->root && s == t->link[1]) t->link[1] = p;
-    else t->link[0] = p;
+  if (CleanCursor == G) CleanCursor = G->lnext;
+  *G->lprev = G->lnext;
+  if (G->lnext) G->lnext->lprev = G->lprev;
+  ninodes--;
 
-  return q;
+  for (p = p0; p <= p1; p++)
+    blkdir_release(p);
 }
 
-
-void avltr_delete (const int key)
+static TNode *blkdir_find(int key)
 {
-  avltr_tree *tree = &CollectTree;
-  TNode *pa[AVL_MAX_HEIGHT];		/* Stack P: Nodes. */
-  unsigned char a[AVL_MAX_HEIGHT];	/* Stack P: Bits. */
-  int k = 1;				/* Stack P: Pointer. */
-  TNode *p;
-
-  a[0] = 0;
-  pa[0] = &tree->root;
-  p = tree->root.link[0];
-  if (p == NULL) return;
-
-  for (;;) {
-      int diff = (key - p->key);
-
-      if (diff==0) break;
-      pa[k] = p;
-      if (diff < 0) {
-	  if (p->link[0] == NULL) return;
-	  p = p->link[0]; a[k] = 0;
-      }
-      else if (diff > 0) {
-	  if (p->rtag != PLUS) return;
-	  p = p->link[1]; a[k] = 1;
-      }
-      k++;
-/**/ if (k>=AVL_MAX_HEIGHT) leavedos_main(0x777);
-  }
-#if !defined(SINGLESTEP)&&!defined(SINGLEBLOCK)
-  if (debug_level('e')>2)
-	e_printf("Found node to delete at %p(%08x)\n",p,p->key);
+  BlkPage *P = blkdir_get(BLKPAGE(key));
+  TNode *G;
+#if PROFILE
+  int k = 1;
 #endif
-  tree->count--;
-  ninodes = tree->count;
-
-  {
-    TNode *t = p;
-    TNode **q = &pa[k - 1]->link[(int) a[k - 1]];
-
-    if (t->rtag == MINUS) {
-	if (t->link[0] != NULL) {
-	    TNode *const x = t->link[0];
-
-	    *q = x;
-	    (*q)->bal = 0;
-	    if (x->rtag == MINUS) {
-		if (a[k - 1] == 1) x->link[1] = t->link[1];
-		  else x->link[1] = pa[k - 1];
-	    }
-	}
-	else {
-	    *q = t->link[a[k - 1]];
-	    if (a[k - 1] == 0) pa[k - 1]->link[0] = NULL;
-	      else pa[k - 1]->rtag = MINUS;
-	}
-    }
-    else {
-	TNode *r = t->link[1];
-	if (r->link[0] == NULL) {
-	    r->link[0] = t->link[0];
-	    r->bal = t->bal;
-	    if (r->link[0] != NULL) {
-		TNode *s = r->link[0];
-		while (s->rtag == PLUS) s = s->link[1];
-		s->link[1] = r;
-	    }
-	    *q = r;
-	    a[k] = 1;
-	    pa[k++] = r;
-	}
-	else {
-	    TNode *s = r->link[0];
-
-	    a[k] = 1;
-	    pa[k++] = t;
-
-	    a[k] = 0;
-	    pa[k++] = r;
 
-	    while (s->link[0] != NULL) {
-		r = s;
-		s = r->link[0];
-		a[k] = 0;
-		pa[k++] = r;
-	    }
-
-	    if (t->mblock) dlfree(t->mblock);
-/* e_printf("<03 node exchange %p->%p>\n",s,t); */
-	    datacopy(t, s);
-/**/	    if (t->addr==NULL) leavedos_main(0x8130);
-	    /* keep the node reference to itself */
-	    t->mblock->bkptr = t;
-	    s->addr = NULL;
-	    s->mblock = NULL;
-	    memset(&s->clink, 0, sizeof(linkdesc));
-	    s->key = 0;
-
-	    if (s->rtag == PLUS) r->link[0] = s->link[1];
-	      else r->link[0] = NULL;
-	    p = s;
-	}
-    }
+  if (P == NULL) return NULL;
+  for (G = P->bucket[BLKHASH(key)]; G; G = G->hnext) {
+    if (G->key == key) break;
+#if PROFILE
+    k++;
+#endif
   }
-
-/**/ if (Traverser.p==p) Traverser.init=0;
-#if !defined(SINGLESTEP)&&!defined(SINGLEBLOCK)
-  if (debug_level('e')>2) e_printf("Remove node %p\n",p);
+#if PROFILE
+  if (debug_level('e')) if (k>MaxDepth) MaxDepth=k;
 #endif
+  return G;
+}
+
+static void FreeNode(TNode *G)
+{
 #ifdef DEBUG_LINKER
-	if (p->clink.nrefs) {
-	    dbug_printf("Cannot delete - nrefs=%d\n",p->clink.nrefs);
+	if (G->clink.nrefs) {
+	    dbug_printf("Cannot delete - nrefs=%d\n",G->clink.nrefs);
 	    leavedos_main(0x9140);
 	}
-	if (p->clink.bkr.next) {
+	if (G->clink.bkr.next) {
 	    dbug_printf("Cannot delete - bkr busy\n");
 	    leavedos_main(0x9141);
 	}
-	if (p->clink.t_ref || p->clink.nt_ref) {
+	if (G->clink.t_ref || G->clink.nt_ref) {
 	    dbug_printf("Cannot delete - ref busy\n");
 	    leavedos_main(0x9142);
 	}
 #endif
-  if (p->mblock) dlfree(p->mblock);
-  Tfree(p);
+  if (debug_level('e')>2) e_printf("Remove node %p\n",G);
+  blkdir_remove(G);
+  if (G->mblock) dlfree(G->mblock);
+  G->mblock = NULL;
+  Tfree(G);
+}
 
-  while (--k) {
-      TNode *const s = pa[k];
+void DeleteNode(const int key)
+{
+  TNode *G = blkdir_find(key);
 
-      if (a[k] == 0) {
-	  TNode *const r = s->link[1];
+  if (G == NULL) return;
+#if !defined(SINGLESTEP)&&!defined(SINGLEBLOCK)
+  if (debug_level('e')>2)
+	e_printf("Found node to delete at %p(%08x)\n",G,G->key);
+#endif
+  FreeNode(G);
+}
 
-	  if (s->bal == -1) {
-	      s->bal = 0;
-	      continue;
-	  }
-	  else if (s->bal == 0) {
-	      s->bal = +1;
-	      break;
-	  }
+/*
+ * Called when a node ending with a forward jump (F_JMPF) has been
+ * entered HOT_NODE_EXECS times from the run loop, once the loop is
+ * left and nothing refers to the node any more. The node is dropped
+ * and its start recorded as a trace head; when the interpreter builds
+ * it again it follows the jump instead of closing the sequence, so
+ * that the chain runs as a single block. The jump target is dropped
+ * too if no other node links to it, otherwise its code is in the way.
+ */
+void MakeTraceHead(int key)
+{
+  int h = TRACEHASH(key);
+  TNode *G = blkdir_find(key);
+  TNode *B;
 
-	  if (s->rtag == MINUS || r->bal == 0) {
-	      s->link[1] = r->link[0];
-	      r->link[0] = s;
-	      r->bal = -1;
-	      pa[k - 1]->link[(int) a[k - 1]] = r;
-	      break;
-	  }
-	  else if (r->bal == +1) {
-	      if (r->link[0] != NULL) {
-		  s->rtag = PLUS;
-		  s->link[1] = r->link[0];
-	      }
-	      else
-		s->rtag = MINUS;
-	      r->link[0] = s;
-	      s->bal = r->bal = 0;
-	      pa[k - 1]->link[a[k - 1]] = r;
-	  }
-	  else {
-	      p = r->link[0];
-	      if (p->rtag == PLUS) r->link[0] = p->link[1];
-	        else r->link[0] = NULL;
-	      p->link[1] = r;
-	      p->rtag = PLUS;
-	      if (p->link[0] == NULL) {
-		  s->link[1] = p;
-		  s->rtag = MINUS;
-	      }
-	      else {
-		  s->link[1] = p->link[0];
-		  s->rtag = PLUS;
-	      }
-	      p->link[0] = s;
-	      if (p->bal == +1)	s->bal = -1, r->bal = 0;
-	        else if (p->bal == 0) s->bal = r->bal = 0;
-		  else s->bal = 0, r->bal = +1;
-	      p->bal = 0;
-	      pa[k - 1]->link[(int) a[k - 1]] = p;
-	      if (a[k - 1] == 1) pa[k - 1]->rtag = PLUS;
-	  }
-      }
-      else {
-	  TNode *const r = s->link[0];
+  if (G == NULL || G->alive <= 0) return;
+  if (TraceHeads[h].key == G->key && TraceHeads[h].state == TH_FAILED)
+	return;
+  TraceHeads[h].key = G->key;
+  TraceHeads[h].state = TH_HEAD;
+  if (debug_level('e')>1)
+	e_printf("Trace head at %08x\n",G->key);
+  if (G->clink.t_ref && (B = *G->clink.t_ref) != NULL &&
+      B->alive > 0 && B != G && B->clink.nrefs == 1)
+	InvalidateNodeRange(B->key, 1, NULL);
+  InvalidateNodeRange(G->key, 1, NULL);
+}
 
-	  if (s->bal == +1) {
-	      s->bal = 0;
-	      continue;
-	  }
-	  else if (s->bal == 0) {
-	      s->bal = -1;
-	      break;
-	  }
+int IsTraceHead(int key)
+{
+  int h = TRACEHASH(key);
 
-	  if (s->link[0] == NULL || r->bal == 0) {
-	      s->link[0] = r->link[1];
-	      r->link[1] = s;
-	      r->bal = +1;
-	      pa[k - 1]->link[(int) a[k - 1]] = r;
-	      break;
-	  }
-	  else if (r->bal == -1) {
-	      if (r->rtag == PLUS) s->link[0] = r->link[1];
-	        else s->link[0] = NULL;
-	      r->link[1] = s;
-	      r->rtag = PLUS;
-	      s->bal = r->bal = 0;
-	      pa[k - 1]->link[a[k - 1]] = r;
-	  }
-	  else {
-	      p = r->link[1];
-	      if (p->link[0] != NULL) {
-		  r->rtag = PLUS;
-		  r->link[1] = p->link[0];
-	      }
-	      else
-		r->rtag = MINUS;
-	      p->link[0] = r;
-	      if (p->rtag == MINUS) s->link[0] = NULL;
-	        else s->link[0] = p->link[1];
-	      p->link[1] = s;
-	      p->rtag = PLUS;
-	      if (p->bal == -1)	s->bal = +1, r->bal = 0;
-	        else if (p->bal == 0) s->bal = r->bal = 0;
-		  else s->bal = 0, r->bal = -1;
-	      p->bal = 0;
-	      if (a[k - 1] == 1)
-		pa[k - 1]->rtag = PLUS;
-	      pa[k - 1]->link[(int) a[k - 1]] = p;
-	  }
-      }
-  }
+  return TraceHeads[h].key == key && TraceHeads[h].state == TH_HEAD;
+}
+
+static void TraceHeadFailed(int key)
+{
+  int h = TRACEHASH(key);
+
+  if (TraceHeads[h].key == key)
+	TraceHeads[h].state = TH_FAILED;
 }
 
 #endif	// HOST_ARCH_X86
 
 /////////////////////////////////////////////////////////////////////////////
 
-static void avltr_init(void)
+static void blkdir_init(void)
 {
 #ifdef HOST_ARCH_X86
  if (!config.cpusim) {
   int i;
   TNode *G;
 
-  CollectTree.root.link[0] = NULL;
-  CollectTree.root.link[1] = &CollectTree.root;
-  CollectTree.root.rtag = PLUS;
-  CollectTree.count = 0;
-  Traverser.init = 0;
-  Traverser.p = NULL;
+  memset(BlkDir, 0, sizeof(BlkDir));
+  NodeList = CleanCursor = NULL;
+  memset(findtree_cache, 0, sizeof(findtree_cache));
+  memset(TraceHeads, 0, sizeof(TraceHeads));
 
   G = TNodePool;
   for (i=0; i<(NODES_IN_POOL-1); i++) {
 	TNode *G1 = G; G++;
-	G1->link[0] = G;
+	G1->hnext = G;
   }
-  G->link[0] = TNodePool;
+  G->hnext = TNodePool;
 
   InstrMeta = malloc(sizeof(IMeta) * MAXINODES);
   memset(InstrMeta, 0, sizeof(IMeta));
  }
 #endif
-  g_printf("avltr_init\n");
+  g_printf("blkdir_init\n");
   CurrIMeta = -1;
   NodesCleaned = 0;
   ninodes = 0;
+  DirPages = 0;
 }
 
 
 #ifdef HOST_ARCH_X86
 
-void avltr_destroy(void)
+void blkdir_destroy(void)
 {
-  avltr_tree *tree;
+  TNode *G;
+  int i, j;
 #if PROFILE
   hitimer_t t0 = 0;
 #endif
 
-  tree = &CollectTree;
   e_printf("--------------------------------------------------------------\n");
-  e_printf("Destroy AVLtree with %d nodes\n",ninodes);
+  e_printf("Destroy block directory with %d nodes on %d pages\n",
+	   ninodes, DirPages);
   e_printf("--------------------------------------------------------------\n");
 #ifdef DEBUG_TREE
   DumpTree (tLog);
@@ -581,41 +384,24 @@ void avltr_destroy(void)
 #endif
 
   mprot_end();
-  if (tree->root.link[0] != &tree->root) {
-      TNode *an[AVL_MAX_HEIGHT];	/* Stack A: nodes. */
-      char ab[AVL_MAX_HEIGHT];		/* Stack A: bits. */
-      int ap = 0;			/* Stack A: height. */
-      TNode *p = tree->root.link[0];
-
-      for (;;) {
-	  while (p != NULL) {
-	      ab[ap] = 0;
-	      an[ap++] = p;
-	      p = p->link[0];
-	  }
-
-	  for (;;) {
-	      backref *B;
-	      if (ap == 0) goto quit;
-
-	      p = an[--ap];
-	      if (ab[ap] == 0) {
-		  ab[ap++] = 1;
-		  if (p->rtag == MINUS) continue;
-		  p = p->link[1];
-		  break;
-	      }
-	      B = p->clink.bkr.next;
-	      while (B) {
-		  backref *B2 = B;
-		  B = B->next;
-		  free(B2);
-	      }
-	      if (p->mblock) dlfree(p->mblock);
-	  }
+  for (G = NodeList; G; G = G->lnext) {
+      backref *B = G->clink.bkr.next;
+      while (B) {
+	  backref *B2 = B;
+	  B = B->next;
+	  free(B2);
       }
+      if (G->mblock) dlfree(G->mblock);
   }
-quit:
+  NodeList = CleanCursor = NULL;
+  for (i=0; i<BLKDIR_L1_SIZE; i++) {
+      if (BlkDir[i] == NULL) continue;
+      for (j=0; j<BLKDIR_L2_SIZE; j++)
+	  free(BlkDir[i][j]);
+      free(BlkDir[i]);
+      BlkDir[i] = NULL;
+  }
+  ninodes = DirPages = 0;
   free(InstrMeta);
 #if PROFILE
   if (debug_level('e')) {
@@ -635,15 +421,12 @@ quit:
  */
 unsigned int FindPC(unsigned char *addr)
 {
-  TNode *G = &CollectTree.root;
+  TNode *G;
   unsigned char *ahE;
   Addr2Pc *AP;
   unsigned int i;
 
-  for (;;) {
-      /* walk to next node */
-      G = NEXTNODE(G);
-      if (G == &CollectTree.root) break;
+  for (G = NodeList; G; G = G->lnext) {
       if (!G->addr || !G->pmeta || G->alive<=0) continue;
       ahE = G->addr + G->len;
       if (!ADDR_IN_RANGE(addr,G->addr,ahE)) continue;
@@ -666,7 +449,7 @@ unsigned int FindPC(unsigned char *addr)
 
 static void CheckLinks(void)
 {
-  TNode *G = &CollectTree.root;
+  TNode *G = NULL;
   TNode *GL;
   unsigned char *p;
   linkdesc *L, *T;
@@ -675,8 +458,8 @@ static void CheckLinks(void)
 
   for (;;) {
     /* walk to next node */
-    G = NEXTNODE(G);
-    if (G == &CollectTree.root) {
+    G = G ? G->lnext : NodeList;
+    if (G == NULL) {
 	e_printf("DEBUG: node link check ok\n");
 	return;
     }
@@ -783,7 +566,7 @@ nquit:
 
 void DumpTree (FILE *fd)
 {
-  TNode *G = &CollectTree.root;
+  TNode *G = NULL;
   linkdesc *L;
   backref *B;
   int nn;
@@ -794,8 +577,8 @@ void DumpTree (FILE *fd)
 
   while (nn < 10000) {		// sorry,only 4 digits available
     /* walk to next node */
-    G = NEXTNODE(G);
-    if (G == &CollectTree.root) {
+    G = G ? G->lnext : NodeList;
+    if (G == NULL) {
 	fprintf(fd,"\n== EOT ====================================================\n");
 	fflush(fd);
 	return;
@@ -808,8 +591,8 @@ void DumpTree (FILE *fd)
     }
     fprintf(fd,"%04d Node %p at %08x..%08x mblock=%p flags=%#x\n",
 	nn,G,G->key,(G->seqbase+G->seqlen-1),G->mblock,G->flags);
-    fprintf(fd,"     AVL (%p:%p),%d,%d,%d,%d\n",G->link[0],G->link[1],
-		G->bal,G->cache,G->pad,G->rtag);
+    fprintf(fd,"     DIR page=%05x bucket=%d next=%p\n",BLKPAGE(G->key),
+		BLKHASH(G->key),G->hnext);
     fprintf(fd,"     source:     instr=%d, len=%#x\n",G->seqnum,G->seqlen);
     fprintf(fd,"     translated: len=%#x\n",G->len);
     L = &G->clink;
@@ -872,20 +655,11 @@ static int TraverseAndClean(void)
   if (debug_level('e')) t0 = GETTSC();
 #endif
 
-  if (Traverser.init == 0) {
-      Traverser.p = G = &CollectTree.root;
-      Traverser.init = 1;
-  }
-  else
-      G = Traverser.p;
-
-  /* walk to next node */
-  G = NEXTNODE(G);
-  if (G == &CollectTree.root) {
-      G = NEXTNODE(G);
-      if (G == &CollectTree.root)
-          return 0;
-  }
+  /* visit next node, wrapping around at the end of the list */
+  G = CleanCursor ? CleanCursor : NodeList;
+  if (G == NULL)
+      return 0;
+  CleanCursor = G;
 
   if ((G->addr != NULL) && (G->alive>0)) {
       G->alive -= AGENODE;
@@ -897,14 +671,14 @@ static int TraverseAndClean(void)
   }
   if ((G->addr == NULL) || (G->alive<=0)) {
       if (debug_level('e')>2) e_printf("Delete node %08x\n",G->key);
-      avltr_delete(G->key);
+      FreeNode(G);		/* also advances CleanCursor */
       cnt++;
   }
   else {
       if (debug_level('e')>3)
 	e_printf("TraverseAndClean: node at %08x of %d life=%d\n",
 		G->key,ninodes,G->alive);
-      Traverser.p = G;
+      CleanCursor = G->lnext;
   }
 #if PROFILE
   if (debug_level('e')) CleanupTime += (GETTSC() - t0);
@@ -913,26 +687,16 @@ static int TraverseAndClean(void)
 }
 
 /*
- * Add a node to the collector tree.
- * The code is linearly stored in the CodeBuf and its associated structures
- * are in the InstrMeta array. We allocate a buffer and copy the code, then
- * we copy the sequence data from the head element of InstrMeta. In this
- * process we lose all the correspondences between original code and compiled
- * code addresses. At the end, we reset both CodeBuf and InstrMeta to prepare
- * for a new sequence.
+ * Enter a node for a translated sequence into the directory. The CodeBuf
+ * must already hold the code; the Addr2Pc table is filled by the caller.
+ * For jump-terminated sequences the link points in lk are offsets into
+ * the code.
  */
-TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
+static TNode *AddNode(int key, int seqbase, int seqlen, int seqnum, int len,
+		      int flags, const linkdesc *lk, CodeBuf *GenCodeBuf)
 {
-  TNode *nG = NULL;
-#if PROFILE
-  hitimer_t t0 = 0;
-  if (debug_level('e')) t0 = GETTSC();
-#endif
-  int key;
-  int len, found, nap;
-  IMeta *I;
-  int i, apl=0;
-  Addr2Pc *ap;
+  TNode *nG;
+  int i, nap;
   CodeBuf *mallmb;
   void **cp;
 
@@ -942,54 +706,48 @@ TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
 	for (i=0; i<CreationIndex; i++) TraverseAndClean();
   }
 
-  key = I0->npc;
-
-  found = 0;
-  nG = avltr_probe(key, &found);
-/**/ if (nG==NULL) leavedos_main(0x8201);
-
-  if (found) {
+  nG = blkdir_find(key);
+  if (nG) {
 	if (debug_level('e')>2) {
 		e_printf("Equal keys: replace node %p at %08x\n",
 			nG,key);
 	}
-	/* ->REPLACE the code of the node found with the latest
-	   compiled version */
+	/* ->REPLACE the node found with the latest compiled version.
+	   Its source range may differ, so take it out of the directory */
 	NodeUnlinker(nG);
-	if (nG->mblock) dlfree(nG->mblock);
+	FreeNode(nG);
   }
-  else {
+  nG = Tmalloc();
 #if !defined(SINGLESTEP)&&!defined(SINGLEBLOCK)
-	if (debug_level('e')>2) {
-		e_printf("New TNode %d at=%p key=%08x\n",
-			ninodes,nG,key);
-		if (debug_level('e')>3)
-			e_printf("Header: len=%d n_ops=%d PC=%08x\n",
-				I0->totlen, I0->ncount, I0->npc);
-	}
-#endif
-	nG->key = key;
+  if (debug_level('e')>2) {
+	e_printf("New TNode %d at=%p key=%08x\n",
+		ninodes,nG,key);
+	if (debug_level('e')>3)
+		e_printf("Header: len=%d n_ops=%d PC=%08x\n",
+			len, seqnum, key);
   }
+#endif
+  nG->key = key;
 
-  /* transfer info from first node of the Meta list to our new node */
-  nG->seqbase = I0->seqbase;
-  nG->seqlen = I0->seqlen;
-  nG->seqnum = I0->ncount;
+  nG->seqbase = seqbase;
+  nG->seqlen = seqlen;
+  nG->seqnum = seqnum;
+  nG->len = len;
 #if PROFILE
   if (debug_level('e')) if (nG->len > MaxNodeSize) MaxNodeSize = nG->len;
 #endif
-  nG->len = len = I0->totlen;
-  nG->flags = I0->flags;
+  nG->flags = flags;
   nG->alive = NODELIFE(nG);
+  if (flags & F_SBLK) SuperBlocks++;
+  blkdir_insert(nG);
   findtree_cache[key&FINDTREE_CACHE_HASH_MASK] = nG;
 
   /* allocate the extra memory used by the node. This includes the
    * translated code plus the table of correspondences between source
    * and translated addresses.
    * The first longword of the memory block is special; it stores a
-   * back-pointer to the node. This because nodes can be moved in
-   * memory when rebalancing the AVL tree, while we need absolute and
-   * constant memory references.
+   * back-pointer to the node. Inter-node links go through it, so
+   * that they can be followed and undone from the code block alone.
    * The second longword is equal to its own address. Guess why.
    * After that come the offset table, then the code.
    */
@@ -1004,26 +762,51 @@ TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
   nG->addr = (unsigned char *)&mallmb->meta[nap];
 
   /* setup structures for inter-node linking */
-  nG->clink.t_type  = I0->clink.t_type;
+  nG->clink.t_type  = lk->t_type;
   nG->clink.unlinked_jmp_targets = 0;
-  if (I0->clink.t_type >= JMP_LINK) {
-    nG->clink.t_link.abs  = (unsigned int *)(nG->addr + I0->clink.t_link.rel);
+  if (lk->t_type >= JMP_LINK) {
+    nG->clink.t_link.abs  = (unsigned int *)(nG->addr + lk->t_link.rel);
     nG->clink.t_target = *nG->clink.t_link.abs;
     nG->clink.unlinked_jmp_targets |= TARGET_T;
   }
   else
-    nG->clink.t_link.abs  = I0->clink.t_link.abs;
-  if (I0->clink.t_type > JMP_LINK) {
-    nG->clink.nt_link.abs = (unsigned int *)(nG->addr + I0->clink.nt_link.rel);
+    nG->clink.t_link.abs  = lk->t_link.abs;
+  if (lk->t_type > JMP_LINK) {
+    nG->clink.nt_link.abs = (unsigned int *)(nG->addr + lk->nt_link.rel);
     nG->clink.nt_target = *nG->clink.nt_link.abs;
     nG->clink.unlinked_jmp_targets |= TARGET_NT;
   }
   else
-    nG->clink.nt_link.abs = I0->clink.nt_link.abs;
+    nG->clink.nt_link.abs = lk->nt_link.abs;
   if ((debug_level('e')>3) && nG->clink.t_type)
 	dbug_printf("Link %d: %p:%08x\n",nG->clink.t_type,
 		nG->clink.nt_link.abs,
 		(nG->clink.t_type>JMP_LINK? *nG->clink.nt_link.abs:0));
+  return nG;
+}
+
+/*
+ * Add a node to the collector tree.
+ * The code is linearly stored in the CodeBuf and its associated structures
+ * are in the InstrMeta array. We allocate a buffer and copy the code, then
+ * we copy the sequence data from the head element of InstrMeta. In this
+ * process we lose all the correspondences between original code and compiled
+ * code addresses. At the end, we reset both CodeBuf and InstrMeta to prepare
+ * for a new sequence.
+ */
+TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
+{
+  TNode *nG;
+#if PROFILE
+  hitimer_t t0 = 0;
+  if (debug_level('e')) t0 = GETTSC();
+#endif
+  IMeta *I;
+  int i, apl=0;
+  Addr2Pc *ap;
+
+  nG = AddNode(I0->npc, I0->seqbase, I0->seqlen, I0->ncount, I0->totlen,
+	       I0->flags, &I0->clink, GenCodeBuf);
 
   /* setup source/xlated instruction offsets */
   ap = nG->pmeta;
@@ -1051,6 +834,29 @@ TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf)
   return nG;
 }
 
+/*
+ * Add a node whose CodeBuf, including its Addr2Pc table, was taken from
+ * the persistent translation cache instead of being generated.
+ */
+TNode *Cache2Tree(int key, int seqbase, int seqlen, int seqnum, int len,
+		  int flags, const linkdesc *lk, CodeBuf *GenCodeBuf)
+{
+  TNode *nG;
+#if PROFILE
+  hitimer_t t0 = 0;
+  if (debug_level('e')) t0 = GETTSC();
+#endif
+
+  nG = AddNode(key, seqbase, seqlen, seqnum, len, flags, lk, GenCodeBuf);
+#ifdef DEBUG_LINKER
+  CheckLinks();
+#endif
+#if PROFILE
+  if (debug_level('e')) AddTime += (GETTSC() - t0);
+#endif
+  return nG;
+}
+
 
 TNode *FindTree(int key)
 {
@@ -1065,10 +871,12 @@ TNode *FindTree(int key)
 	TheCPU.sigprof_pending = 0;
   }
 
+  FindCalls++;
   /* fast path: using cache indexed by low 12 bits of PC:
      ~99.99% success rate */
   I = findtree_cache[key&FINDTREE_CACHE_HASH_MASK];
   if (I && (I->alive>0) && (I->key==key)) {
+	FindFastHits++;
 	if (debug_level('e')) {
 	    if (debug_level('e')>4)
 		e_printf("Found key %08x via cache\n", key);
@@ -1079,30 +887,17 @@ TNode *FindTree(int key)
 	I->alive = NODELIFE(I);
 	return I;
   }
-  if (!e_querymark(key, 1))
+  if (!e_querymark(key, 1)) {
+	FindMisses++;
 	return NULL;
+  }
 
 #if PROFILE
   if (debug_level('e')) t0 = GETTSC();
 #endif
-  I = CollectTree.root.link[0];
-  if (I == NULL) return NULL;	/* always NULL the first time! */
-
-  for (;;) {
-      int diff = (key - I->key);
-
-      if (diff < 0) {
-	  I = I->link[0];
-	  if (I == NULL) goto endsrch;
-      }
-      else if (diff > 0) {
-	  if (I->rtag == MINUS) goto endsrch;
-	  I = I->link[1];
-      }
-      else break;
-  }
-
+  I = blkdir_find(key);
   if (I && I->addr && (I->alive>0)) {
+	FindDirHits++;
 	if (debug_level('e')>3) e_printf("Found key %08x\n",key);
 	I->alive = NODELIFE(I);
 	findtree_cache[key&FINDTREE_CACHE_HASH_MASK] = I;
@@ -1114,11 +909,11 @@ TNode *FindTree(int key)
 #endif
 	return I;
   }
-
-endsrch:
 #if PROFILE
   if (debug_level('e')) SearchTime += (GETTSC() - t0);
 #endif
+
+  FindMisses++;
   if ((ninodes>500) && (((++tccount) >= CleanFreq) || NodesCleaned)) {
 	while (NodesCleaned > 0) {
 	    (void)TraverseAndClean();
@@ -1180,18 +975,12 @@ static void BreakNode(TNode *G, unsigned char *eip)
   e_printf("============ Node %08x break failed\n",G->key);
 }
 
-static TNode *DoDelNode(TNode *G)
-{
-  if (Traverser.p == G)
-    Traverser.p = NEXTNODE(G);
-  avltr_delete(G->key);
-  return CollectTree.root.link[0];
-}
-
 int InvalidateNodeRange(int al, int len, unsigned char *eip)
 {
   TNode *G;
+  BlkPage *P;
   int ah;
+  unsigned p, p1;
   int cleaned = 0;
 #if PROFILE
   hitimer_t t0 = 0;
@@ -1201,56 +990,33 @@ int InvalidateNodeRange(int al, int len, unsigned char *eip)
   ah = al + len;
   if (debug_level('e')>1) dbug_printf("Invalidate area %08x..%08x\n",al,ah);
 
-  G = CollectTree.root.link[0];
-  if (G == NULL) goto quit;
-  /* find nearest (lesser than) node */
-  for (;;) {
-      if (G == NULL) goto quit;
-      if (G->key > al) {
-	/* no need to check for dead node here as the left-most
-	 * node will not be overlapped by anything from left */
-	if (G->link[0]==NULL) break;
-	G = G->link[0];
-      }
-      else if (G->key < al) {
-        TNode *G2;
-	G2 = G->link[1];
-	if (G2 == &CollectTree.root || G2->key > al) {
-	  if (G->alive <= 0) {
-	    /* remove dead node as it may be overlapped by good one */
-	    G = DoDelNode(G);
-	    continue;
-	  }
-	  break;
-	} else G = G2;
-      }
-      else {
-	if (G->alive <= 0) {
-	  G = DoDelNode(G);
-	  continue;
-	}
-	break;
-      }
-  }
-  if (debug_level('e')>1) e_printf("Invalidate from node %08x on\n",G->key);
-
-  /* walk tree in ascending, hopefully sorted, address order */
-  for (;;) {
-      if (G == &CollectTree.root || G->key >= ah)
-        break;
-      if (G->addr && (G->alive>0)) {
-	int ahG = G->seqbase + G->seqlen;
-	if (RANGE_IN_RANGE(G->seqbase,ahG,al,ah)) {
+  /* nodes overlapping the range start at most 'reach' pages before it */
+  p = BLKPAGE(al);
+  p1 = (len > 0 ? BLKPAGE(ah - 1) : p);
+  P = blkdir_get(p);
+  if (P) p -= P->reach;
+
+  for (; p <= p1; p++) {
+      P = blkdir_get(p);
+      if (P == NULL) continue;
+      for (G = P->starts; G; G = G->pnext) {
+	InvalScans++;
+	if (G->addr && (G->alive>0)) {
+	  int ahG = NODEEND(G);
+	  if (RANGE_IN_RANGE(G->seqbase,ahG,al,ah)) {
 	    unsigned char *ahE = G->addr + G->len;
 	    if (debug_level('e')>1)
 		dbug_printf("Invalidated node %p at %08x\n",G,G->key);
 	    G->alive = 0;
 	    e_unmarkpage(G->seqbase, G->seqlen);
 	    NodeUnlinker(G);
+	    if (G->flags & F_SBLK)
+		TraceHeadFailed(G->key);
 	    cleaned++;
 	    NodesCleaned++;
+	    InvalNodes++;
 	    /* if the current eip is in *any* chunk of code that is deleted
-	        (not just the one written to)
+		(not just the one written to)
 	       then we need to break the node immediately to go back to
 	       the interpreter; otherwise the remaining chunk (that does
 	       not officially exist anymore) that the SIGSEGV or patched
@@ -1262,11 +1028,10 @@ int InvalidateNodeRange(int al, int len, unsigned char *eip)
 			     eip,G->addr,ahE);
 		BreakNode(G, eip);
 	    }
+	  }
 	}
       }
-      G = NEXTNODE(G);
   }
-quit:
   if (debug_level('e') && e_querymark(al, len))
     error("simx86: InvalidateNodeRange did not clear all code for %#08x, len=%x\n",
 	  al, len);
@@ -1288,6 +1053,7 @@ static void do_invalidate(unsigned data, int cnt)
 #ifdef HOST_ARCH_X86
 	/* e_querymprotrange prevents coming here for sim */
 	assert (!config.cpusim);
+	SmcPageInvals++;
 	InvalidateNodeRange(data, cnt, 0);
 #endif
 }
@@ -1502,7 +1268,22 @@ void CollectStat (void)
 			ninodes,NodesParsed,NodesExecd,CreationIndex,
 			CleanFreq);
 #endif
+	if (debug_level('e')>1 && FindCalls) {
+		/* the directory only serves the findtree_cache misses */
+		e_printf("SIGPROF find=%d cache=%d%% dir=%d%% miss=%d%% "
+			"pages=%d inval=%d/%d sblk=%d\n", FindCalls,
+			(int)(FindFastHits*100LL/FindCalls),
+			(int)(FindDirHits*100LL/FindCalls),
+			(int)(FindMisses*100LL/FindCalls), DirPages,
+			InvalNodes, InvalScans, SuperBlocks);
+	}
+	if (debug_level('e')>1 && SmcFaults + SmcSubpageWrites + SmcPageInvals)
+		e_printf("SIGPROF smc faults=%d subpage=%d pageinv=%d\n",
+			SmcFaults, SmcSubpageWrites, SmcPageInvals);
 	NodesParsed = NodesExecd = 0;
+	FindCalls = FindFastHits = FindDirHits = FindMisses = 0;
+	InvalScans = InvalNodes = SuperBlocks = 0;
+	SmcFaults = SmcSubpageWrites = SmcPageInvals = 0;
 }
 
 
@@ -1516,11 +1297,15 @@ void InitTrees(void)
 	    TNodePool = calloc(NODES_IN_POOL, sizeof(TNode));
 #endif
 
-	avltr_init();
+	blkdir_init();
+#ifdef HOST_ARCH_X86
+	if (!config.cpusim)
+	    TCacheInit();
+#endif
 
 #ifdef HOST_ARCH_X86
 	if (!config.cpusim && debug_level('e')>1) {
-	    e_printf("Root tree node at %p\n",&CollectTree.root);
+	    e_printf("Block directory at %p\n",BlkDir);
 	    e_printf("TNode pool at %p\n",TNodePool);
 	}
 #endif
@@ -1551,7 +1336,8 @@ void EndGen(void)
 	CurrIMeta = -1;
 #ifdef HOST_ARCH_X86
 	if (!config.cpusim) {
-	    avltr_destroy();
+	    TCacheDone();
+	    blkdir_destroy();
 	    free(TNodePool); TNodePool=NULL;
 	}
 #endif
@@ -47,11 +47,11 @@
 // Tree node key definition.
 //
 
-struct avltr_node;
+struct tnode;
 
 typedef struct _bkref {
 	struct _bkref *next;
-	struct avltr_node **ref;
+	struct tnode **ref;
 	char branch;
 } backref;
 
@@ -71,12 +71,12 @@ typedef struct _lnkdesc {
 	} nt_link;
 	unsigned int t_target, nt_target;
 	unsigned unlinked_jmp_targets;
-	struct avltr_node **t_ref, **nt_ref;
+	struct tnode **t_ref, **nt_ref;
 	backref bkr;
 } linkdesc;
 
 typedef struct _imgen {
-	unsigned int op, mode, ovds;
+	unsigned int op, mode, ovds, hflags;
 	unsigned int p0,p1,p2,p3,p4;
 	linkdesc *lt;
 } IGen;
@@ -95,7 +95,7 @@ typedef struct _imeta {
 } IMeta;
 
 typedef struct _codebufhdr {
-	struct avltr_node *bkptr;
+	struct tnode *bkptr;
 	void *selfptr;
 	Addr2Pc meta[0]; /* there are nap of these */
 	/* behind these follows the code */
@@ -116,18 +116,16 @@ extern int EmuSignals;
 extern int NodesFound;
 extern int TreeCleanups;
 
-typedef struct avltr_node
+typedef struct tnode
 {
-/* ----- Structure for a node in a right-threaded AVL tree. ----- */
-    struct avltr_node *link[2];	/* Subtrees or threads. */
-    signed char bal;		/* Balance factor. */
-    char cache;			/* Used during insertion. */
-    char pad;			/* Reserved for fully threaded trees. */
-    signed char rtag;		/* Right thread tag. */
-/* -------------------------------------------------------------- */
-	int key;		/* signed! and don't move it from here! */
+/* ----- Links into the block directory and the global node list ----- */
+	struct tnode *hnext;		/* next node in the same key bucket */
+	struct tnode *pnext, **pprev;	/* nodes starting on the same page */
+	struct tnode *lnext, **lprev;	/* all nodes, in creation order */
 /* -------------------------------------------------------------- */
+	int key;
 	int alive;
+	unsigned execs;			/* entries from the run loop */
 	CodeBuf *mblock;
 	unsigned char *addr;
 	Addr2Pc *pmeta;
@@ -138,31 +136,40 @@ typedef struct avltr_node
 	unsigned mode;
 } TNode;
 
-/* Used for traversing a right-threaded AVL tree. */
-typedef struct avltr_traverser
-{
-    int init;				/* Initialized? */
-    struct avltr_node *p;		/* Last node returned. */
-} avltr_traverser;
-
-/* Structure which holds information about a threaded AVL tree. */
-typedef struct avltr_tree
-{
-    struct avltr_node root;	/* Tree root node. */
-    int count;			/* Number of nodes in the tree. */
-} avltr_tree;
-
-/* Tag types. */
-#define PLUS +1
-#define MINUS -1
+/* Block directory: a two-level table indexed by the linear page number.
+ * Every page covered by translated code has an entry; nodes are hashed
+ * by key in the entry of the page their key is on, and chained by
+ * seqbase in the entry of the page their source code starts on. */
+#define BLKDIR_L1_BITS	(32 - PAGE_SHIFT - BLKDIR_L2_BITS)
+#define BLKDIR_L1_SIZE	(1 << BLKDIR_L1_BITS)
+#define BLKDIR_L2_SIZE	(1 << BLKDIR_L2_BITS)
+
+typedef struct blkpage {
+	TNode *bucket[BLKDIR_BUCKETS];	/* nodes keyed on this page */
+	TNode *starts;			/* nodes whose seqbase is on this page */
+	int refs;			/* nodes whose source covers this page */
+	int reach;			/* max distance in pages back to the
+					   start of a node covering this page */
+} BlkPage;
+
+extern int DirPages;
+extern int FindCalls;
+extern int FindFastHits;
+extern int FindDirHits;
+extern int FindMisses;
+extern int InvalScans;
+extern int InvalNodes;
+extern int SuperBlocks;
 
 #ifdef HOST_ARCH_X86
-extern avltr_tree CollectTree;
-
-void avltr_delete (const int key);
+void DeleteNode(const int key);
+void MakeTraceHead(int key);
+int IsTraceHead(int key);
 //
 TNode *FindTree(int key);
 TNode *Move2Tree(IMeta *I0, CodeBuf *GenCodeBuf);
+TNode *Cache2Tree(int key, int seqbase, int seqlen, int seqnum, int len,
+		  int flags, const linkdesc *lk, CodeBuf *GenCodeBuf);
 //
 #endif
 
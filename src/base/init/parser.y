@@ -230,7 +230,7 @@ enum {
 %token CHECKUSERVAR
 
 	/* main options */
-%token FASTFLOPPY HOGTHRESH SPEAKER IPXSUPPORT IPXNETWORK NOVELLHACK
+%token FASTFLOPPY FATFS_CACHE HOGTHRESH SPEAKER IPXSUPPORT IPXNETWORK NOVELLHACK
 %token ETHDEV TAPDEV VDESWITCH SLIRPARGS NETSOCK VNET
 %token DEBUG MOUSE SERIAL COM KEYBOARD TERMINAL VIDEO EMURETRACE TIMER
 %token MATHCO CPU CPUSPEED BOOTDRIVE SWAP_BOOTDRIVE
@@ -246,7 +246,7 @@ enum {
 	/* speaker */
 %token EMULATED NATIVE
 	/* cpuemu */
-%token CPUEMU CPU_VM CPU_VM_DPMI VM86 KVM
+%token CPUEMU CPUEMU_TCACHE CPU_VM CPU_VM_DPMI VM86 KVM
 	/* keyboard */
 %token RAWKEYBOARD
 %token PRESTROKE
@@ -459,6 +459,11 @@ line:		CHARSET '{' charset_flags '}' {}
 			config.fastfloppy = ($2!=0);
 			c_printf("CONF: fastfloppy = %d\n", config.fastfloppy);
 			}
+		| FATFS_CACHE bool
+			{
+			config.fatfs_cache = ($2!=0);
+			c_printf("CONF: fatfs_cache = %d\n", config.fatfs_cache);
+			}
 		| CPU expression
 			{
 			int cpu = cpu_override (($2%100)==86?($2/100)%10:0);
@@ -486,6 +491,17 @@ line:		CHARSET '{' charset_flags '}' {}
 			config.cpusim = $2;
 			c_printf("CONF: CPUEMU set to %s\n",
 				config.cpusim ? "sim" : "jit");
+#endif
+			}
+		| CPUEMU_TCACHE string_expr
+			{
+#ifdef X86_EMULATOR
+			free(config.cpuemu_tcache);
+			config.cpuemu_tcache = $2;
+			c_printf("CONF: CPUEMU translation cache %s\n",
+				config.cpuemu_tcache);
+#else
+			free($2);
 #endif
 			}
 		| CPUSPEED real_expression
@@ -871,6 +871,22 @@ int dos_read(int fd, unsigned data, int cnt)
   return (ret);
 }
 
+int dos_pread(int fd, unsigned data, int cnt, off_t offs)
+{
+  int ret;
+  if (vga.inst_emu && data >= 0xa0000 && data < 0xc0000) {
+    char buf[cnt];
+    ret = RPT_SYSCALL(pread(fd, buf, cnt, offs));
+    if (ret >= 0)
+      memcpy_to_vga(data, buf, ret);
+  }
+  else
+    ret = RPT_SYSCALL(pread(fd, LINEAR2UNIX(data), cnt, offs));
+  if (ret > 0)
+	e_invalidate(data, ret);
+  return (ret);
+}
+
 int unix_write(int fd, const void *data, int cnt)
 {
   return RPT_SYSCALL(write(fd, data, cnt));
@@ -880,12 +896,11 @@ int dos_write(int fd, unsigned data, int cnt)
 {
   int ret;
   const unsigned char *d;
-  unsigned char *buf;
 
   if (!cnt)
     return 0;
-  buf = alloca(cnt);
   if (vga.inst_emu && data >= 0xa0000 && data < 0xc0000) {
+    unsigned char *buf = alloca(cnt);
     memcpy_from_vga(buf, data, cnt);
     d = buf;
   } else {
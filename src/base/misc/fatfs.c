@@ -22,29 +22,6 @@
  */
 
 
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-/*
- * Debug level.
- * 0 - normal / 1 - useful / 2 - too much
- */
-#define DEBUG_FATFS	2
-
-
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-#define fatfs_msg(x...) d_printf("fatfs: " x)
-
-#if DEBUG_FATFS >= 1
-#define fatfs_deb(x...) d_printf("fatfs: " x)
-#else
-#define fatfs_deb(x...)
-#endif
-
-#if DEBUG_FATFS >= 2
-#define fatfs_deb2(x...) d_printf("fatfs: " x)
-#else
-#define fatfs_deb2(x...)
-#endif
-
 #define FATFS_IMPL
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -83,16 +60,20 @@ static int read_boot(fatfs_t *, unsigned char *buf);
 static int read_fat(fatfs_t *, unsigned, unsigned char *buf);
 static int read_root(fatfs_t *, unsigned, unsigned char *buf);
 static int read_data(fatfs_t *, unsigned, unsigned char *buf);
+static int read_data_run(fatfs_t *, unsigned, unsigned, int);
 static void make_label(fatfs_t *);
 static unsigned new_obj(fatfs_t *);
 static void scan_dir(fatfs_t *, unsigned);
 static char *full_name(fatfs_t *, unsigned, const char *);
-static void add_object(fatfs_t *, unsigned, char *);
+static void add_object(fatfs_t *, unsigned, char *, const struct fc_ent *);
 static unsigned dos_time(time_t *);
 static unsigned make_dos_entry(fatfs_t *, const obj_t *, unsigned char **);
 static unsigned find_obj(fatfs_t *, unsigned);
+static void index_clusters(fatfs_t *, unsigned);
 static void assign_clusters(fatfs_t *, unsigned, unsigned);
 static int read_cluster(fatfs_t *, unsigned, unsigned, unsigned char *buf);
+static struct fatfs_fd *get_fd(fatfs_t *, unsigned);
+static void file_readahead(struct fatfs_fd *, off_t, unsigned);
 static int read_file(fatfs_t *, unsigned, unsigned, unsigned,
 	unsigned char *buf);
 static int read_dir(fatfs_t *, unsigned, unsigned, unsigned,
@@ -282,8 +263,8 @@ void fatfs_init(struct disk *dp)
   f->obj = NULL;
   f->objs = f->alloc_objs = 0;
 
-  f->fd = -1;
-  f->fd_obj = 0;
+  for(i = 0; i < FATFS_FDS; i++)
+    f->fds[i].fd = -1;
 
   new_obj(f);			/* going to be our root dir object */
   if(f->obj == NULL) {
@@ -312,6 +293,7 @@ void fatfs_init(struct disk *dp)
   f->obj[0].name = f->dir;
   f->obj[0].full_name = f->dir;
   f->obj[0].is.dir = 1;
+  fcache_init(f);
   scan_dir(f, 0);	/* set # of root entries accordingly ??? */
 }
 
@@ -333,9 +315,16 @@ void fatfs_done(struct disk *dp)
       free(f->obj[u].full_name);
   }
 
+  for(u = 0; u < FATFS_FDS; u++) {
+    if(f->fds[u].obj) close(f->fds[u].fd);
+  }
+
+  fcache_done(f);
+
   if(f->ffn) free(f->ffn);
   if(f->boot_sec) free(f->boot_sec);
   if(f->obj) free(f->obj);
+  if(f->clu_obj) free(f->clu_obj);
 
   free(dp->fatfs); dp->fatfs = NULL;
 }
@@ -354,6 +343,12 @@ int fatfs_read(fatfs_t *f, unsigned buf, unsigned pos, int len)
   if(!f->ok) return -1;
 
   while(l) {
+    /* file data goes straight to DOS memory, a run at a time */
+    if((i = read_data_run(f, buf, pos, l)) < 0) return i;
+    if(i) {
+      buf += i << 9; pos += i; l -= i;
+      continue;
+    }
     if((i = read_sec(f, pos, b))) return i;
     MEMCPY_2DOS(buf, b, 0x200);
     e_invalidate(buf, 0x200);
@@ -487,6 +482,57 @@ int read_data(fatfs_t *f, unsigned pos, unsigned char *buf)
   return read_cluster(f, pos / f->cluster_secs + 2, pos % f->cluster_secs, buf);
 }
 
+/*
+ * Read up to len sectors starting at sector pos into DOS memory at buf
+ * with a single pread(), as long as they are consecutive sectors of
+ * one file.
+ * Returns # of read sectors, 0 = not file data (use read_sec()),
+ * -1 = sector not found, -2 = read error.
+ */
+int read_data_run(fatfs_t *f, unsigned buf, unsigned pos, int len)
+{
+  unsigned u0, clu, oi, sec, cnt, data;
+  obj_t *o;
+  off_t ofs;
+  struct fatfs_fd *fp;
+  int ret;
+
+  u0 = f->reserved_secs + f->fat_secs * f->fats + f->root_secs;
+  if(pos < u0 || pos >= f->total_secs) return 0;
+  if((unsigned) len > f->total_secs - pos) len = f->total_secs - pos;
+  pos -= u0;
+  clu = pos / f->cluster_secs + 2;
+
+  if(!f->got_all_objs && clu >= f->first_free_cluster) assign_clusters(f, clu, 0);
+
+  if(!(oi = find_obj(f, clu))) return 0;
+  o = f->obj + oi;
+  if(o->is.dir) return 0;
+
+  /* sector within the file; the clusters of an object are contiguous */
+  sec = (clu - o->start) * f->cluster_secs + pos % f->cluster_secs;
+  ofs = (off_t) sec << 9;
+  if(ofs >= o->size) return 0;
+  if((unsigned) len > o->len * f->cluster_secs - sec) len = o->len * f->cluster_secs - sec;
+
+  cnt = len << 9;
+  data = o->size - ofs;
+  if(data > cnt) data = cnt;
+
+  fatfs_deb2("read_data_run: obj %u, sec %u, %d secs\n", oi, sec, len);
+
+  if(!(fp = get_fd(f, oi))) return -1;
+  file_readahead(fp, ofs, data);
+  if((ret = dos_pread(fp->fd, buf, data, ofs)) == -1) return -2;
+  /* the tail of the last cluster, or what the file lost meanwhile */
+  if(ret < cnt) {
+    MEMSET_DOS(buf + ret, 0, cnt - ret);
+    e_invalidate(buf + ret, cnt - ret);
+  }
+
+  return len;
+}
+
 static int get_bpb_version(struct on_disk_bpb *bpb)
 {
 
@@ -757,9 +803,13 @@ static int sys_file_idx(const char *name, fatfs_t *f)
     return idx;
 }
 
-static int d_filter(const struct dirent *d)
+static int d_skip_dots(const struct dirent *d)
+{
+    return strcmp(d->d_name, ".") != 0 && strcmp(d->d_name, "..") != 0;
+}
+
+static int d_filter(const char *name)
 {
-    const char *name = d->d_name;
     int idx;
 
     if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
@@ -855,15 +905,15 @@ static void init_sfiles(void)
     sys_done = 1;
 }
 
-static int d_compar(const struct dirent **d1, const struct dirent **d2)
+static int d_compar(const void *p1, const void *p2)
 {
-    const char *name1 = (*d1)->d_name;
-    const char *name2 = (*d2)->d_name;
+    const char *name1 = (*(const struct fc_ent * const *)p1)->name;
+    const char *name2 = (*(const struct fc_ent * const *)p2)->name;
     int idx1 = get_s_idx(name1, cur_d);
     int idx2 = get_s_idx(name2, cur_d);
     int prio1, prio2;
     if (idx1 == -1 && idx2 == -1)
-	return alphasort(d1, d2);
+	return strcoll(name1, name2);
     if (idx1 == -1)
 	return 1;
     if (idx2 == -1)
@@ -876,7 +926,7 @@ static int d_compar(const struct dirent **d1, const struct dirent **d2)
 	return -1;
     if (prio2 && (!prio1 || prio2 < prio1))
 	return 1;
-    return alphasort(d1, d2);
+    return strcoll(name1, name2);
 }
 
 static void set_vol_and_len(fatfs_t *f, unsigned oi)
@@ -908,6 +958,62 @@ static void set_vol_and_len(fatfs_t *f, unsigned oi)
   o->len = (o->size + u - 1) / u;
 }
 
+/*
+ * Returns the entries of directory oi (named name) with their stat()
+ * data, from the fatfs cache if it is up to date or else from the host.
+ * *cached is set if the cache owns the result.
+ */
+static struct fc_dir *get_dir_list(fatfs_t *f, unsigned oi, const char *name,
+	int *cached)
+{
+  struct stat sb, esb;
+  struct dirent **dlist;
+  struct fc_dir *d;
+  char *s;
+  int i, num, dfd;
+
+  *cached = 0;
+  if(mfs_stat_file(f->mfs_idx, name, &sb)) {
+    fatfs_msg("%s stat failed\n", name);
+    return NULL;
+  }
+  if((d = fcache_get_dir(f, &sb))) {
+    fatfs_deb2("get_dir_list: \"%s\" (cached)\n", name);
+    *cached = 1;
+    return d;
+  }
+
+  dfd = mfs_open_file(f->mfs_idx, name, O_RDONLY | O_DIRECTORY);
+  if (dfd == -1) {
+    fatfs_msg("%s open failed\n", name);
+    return NULL;
+  }
+  num = scandirat(dfd, ".", &dlist, d_skip_dots, NULL);
+  close(dfd);
+  if (num < 0) {
+    fatfs_msg("fatfs: scandir failed for %s\n", name);
+    return NULL;
+  }
+
+  d = fc_dir_new(&sb, num);
+  for (i = 0; i < num; i++) {
+    if (d) {
+      s = full_name(f, oi, dlist[i]->d_name);
+      if (fc_dir_set_ent(d, i, dlist[i]->d_name,
+          (s && mfs_stat_file(f->mfs_idx, s, &esb) == 0) ? &esb : NULL)) {
+        fc_dir_free(d);
+        d = NULL;
+      }
+    }
+    free(dlist[i]);
+  }
+  free(dlist);
+  if (d)
+    *cached = fcache_put_dir(f, d);
+
+  return d;
+}
+
 /*
  * Reads the directory entries and assigns the object ids.
  */
@@ -917,10 +1023,10 @@ void scan_dir(fatfs_t *f, unsigned oi)
   char *s, *name;
   unsigned u;
   int i;
-  struct dirent **dlist;
-  int num;
+  struct fc_dir *dir;
+  struct fc_ent **dlist;
+  int num, cached;
   int read_bb;
-  int dfd;
 
   // just checking...
   if(!o->is.dir || o->size || !o->name || o->is.scanned) {
@@ -942,18 +1048,21 @@ void scan_dir(fatfs_t *f, unsigned oi)
     memset(f->sys_found, 0, sizeof(f->sys_found));
     f->sys_objs = 0;
   }
-  dfd = mfs_open_file(f->mfs_idx, name, O_RDONLY | O_DIRECTORY);
-  if (dfd == -1) {
-    fatfs_msg("%s open failed\n", name);
+  dir = get_dir_list(f, oi, name, &cached);
+  if (!dir)
+    return;
+  dlist = malloc(dir->ents * sizeof(*dlist) + 1);
+  if (!dlist) {
+    if (!cached)
+      fc_dir_free(dir);
     return;
   }
   cur_d = f;
-  num = scandirat(dfd, ".", &dlist, d_filter, d_compar);
-  close(dfd);
-  if (num < 0) {
-    fatfs_msg("fatfs: scandir failed for %s\n", name);
-    return;
+  for (i = 0, num = 0; i < dir->ents; i++) {
+    if (d_filter(dir->ent[i].name))
+      dlist[num++] = &dir->ent[i];
   }
+  qsort(dlist, num, sizeof(*dlist), d_compar);
   if (!sys_done)
     init_sfiles();
 
@@ -979,7 +1088,7 @@ void scan_dir(fatfs_t *f, unsigned oi)
     struct stat sb;
 
     if (sys_type == MS_D) {
-        s = full_name(f, oi, dlist[0]->d_name); /* io.sys */
+        s = full_name(f, oi, dlist[0]->name); /* io.sys */
         if (s && mfs_stat_file(f->mfs_idx, s, &sb) == 0) {
             if((fd = mfs_open_file(f->mfs_idx, s, O_RDONLY)) != -1) {
                 buf = malloc(sb.st_size + 1);
@@ -1026,7 +1135,7 @@ void scan_dir(fatfs_t *f, unsigned oi)
 
     if (sys_type == PC_D) {
         /* see if it is PC-DOS or Original DR-DOS */
-        s = full_name(f, oi, dlist[0]->d_name);
+        s = full_name(f, oi, dlist[0]->name);
         if (s && mfs_stat_file(f->mfs_idx, s, &sb) == 0) {
             if((fd = mfs_open_file(f->mfs_idx, s, O_RDONLY)) != -1) {
                 buf = malloc(sb.st_size + 1);
@@ -1065,7 +1174,7 @@ void scan_dir(fatfs_t *f, unsigned oi)
             }
         }
         /* see if it is MS-DOS 4.0 */
-        s = full_name(f, oi, dlist[1]->d_name);
+        s = full_name(f, oi, dlist[1]->name);
         if (s && mfs_stat_file(f->mfs_idx, s, &sb) == 0) {
             if((fd = mfs_open_file(f->mfs_idx, s, O_RDONLY)) != -1) {
                 buf = malloc(sb.st_size + 1);
@@ -1091,7 +1200,7 @@ void scan_dir(fatfs_t *f, unsigned oi)
 
     if (sys_type == MOS_D) {
       /* see if it is old MOS */
-      s = full_name(f, oi, dlist[0]->d_name);
+      s = full_name(f, oi, dlist[0]->name);
       if (s && mfs_stat_file(f->mfs_idx, s, &sb) == 0 && sb.st_size == 128880) {
         if((fd = mfs_open_file(f->mfs_idx, s, O_RDONLY)) != -1) {
           uint32_t buf;
@@ -1132,12 +1241,11 @@ void scan_dir(fatfs_t *f, unsigned oi)
     }
   }
 
-  for (i = 0; i < num; i++) {
-    struct dirent *dent = dlist[i];
-    add_object(f, oi, dent->d_name);
-    free(dent);
-  }
+  for (i = 0; i < num; i++)
+    add_object(f, oi, dlist[i]->name, dlist[i]);
   free(dlist);
+  if (!cached)
+    fc_dir_free(dir);
 
   set_vol_and_len(f, oi);
   if (!oi && f->sys_objs)
@@ -1204,14 +1312,15 @@ char *full_name(fatfs_t *f, unsigned oi, const char *name)
 }
 
 
-static void _add_object(fatfs_t *f, unsigned parent, char *s, const char *name)
+static void _add_object(fatfs_t *f, unsigned parent, char *s, const char *name,
+	const struct fc_ent *e)
 {
   struct stat sb;
   obj_t tmp_o = {{0}, 0};
   unsigned u;
 
   fatfs_deb("trying to add \"%s\":\n", s);
-  if(mfs_stat_file(f->mfs_idx, s, &sb)) {
+  if(fc_ent_stat(e, &sb)) {
       fatfs_deb("file not found\n");
       return;
   }
@@ -1273,7 +1382,7 @@ err:
   free(tmp_o.full_name);
 }
 
-void add_object(fatfs_t *f, unsigned parent, char *nm)
+void add_object(fatfs_t *f, unsigned parent, char *nm, const struct fc_ent *e)
 {
   char *s, *name = nm;
 
@@ -1295,11 +1404,11 @@ void add_object(fatfs_t *f, unsigned parent, char *nm)
   }
   if (strcasecmp(name, config_sys) == 0 &&
       strcasecmp(name, real_config_sys) != 0) {
-    _add_object(f, parent, s, real_config_sys);
+    _add_object(f, parent, s, real_config_sys, e);
     fatfs_deb("fatfs: subst %s -> %s\n", name, real_config_sys);
   }
 
-  return _add_object(f, parent, s, name);
+  return _add_object(f, parent, s, name, e);
 }
 
 unsigned dos_time(time_t *tt)
@@ -1408,23 +1517,86 @@ unsigned make_dos_entry(fatfs_t *f, const obj_t *o, unsigned char **e)
 }
 
 
+/*
+ * Returns the object cluster clu belongs to, 0 if none.
+ *
+ * Looks clu up in the cluster index, trying the last hit and its
+ * successor first to make sequential reads cheap.
+ */
 unsigned find_obj(fatfs_t *f, unsigned clu)
 {
-  unsigned u;
+  unsigned u, lo, hi, mid;
+  obj_t *o;
 
   if(clu >= f->first_free_cluster) return 0;
 
-  for(u = 0; u < f->objs; u++) {
-    if(
-      !f->obj[u].is.not_real &&
-      clu >= f->obj[u].start &&
-      clu < f->obj[u].start + f->obj[u].len
-    ) break;
+  if(f->clu_idx_bad) {
+    for(u = 0; u < f->objs; u++) {
+      if(
+        !f->obj[u].is.not_real &&
+        clu >= f->obj[u].start &&
+        clu < f->obj[u].start + f->obj[u].len
+      ) break;
+    }
+
+    if(u == f->objs) return 0;
+
+    return u;
+  }
+
+  for(u = f->clu_last; u < f->clu_objs && u <= f->clu_last + 1; u++) {
+    o = f->obj + f->clu_obj[u];
+    if(clu >= o->start && clu < o->start + o->len) {
+      f->clu_last = u;
+      return f->clu_obj[u];
+    }
   }
 
-  if(u == f->objs) return 0;
+  /* find the last object starting at or before clu */
+  lo = 0;
+  hi = f->clu_objs;
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(f->obj[f->clu_obj[mid]].start <= clu)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if(lo == 0) return 0;
+  o = f->obj + f->clu_obj[lo - 1];
+  if(clu >= o->start + o->len) return 0;
+
+  f->clu_last = lo - 1;
+
+  return f->clu_obj[lo - 1];
+}
+
+
+/*
+ * Add object oi to the cluster index. Clusters are handed out in
+ * ascending order, so appending keeps the index sorted.
+ */
+void index_clusters(fatfs_t *f, unsigned oi)
+{
+  void *p;
+  unsigned new_objs;
+
+  if(f->clu_idx_bad || f->obj[oi].len == 0) return;
 
-  return u;
+  if(f->clu_objs >= f->alloc_clu_objs) {
+    new_objs = f->alloc_clu_objs ? f->alloc_clu_objs : 256;
+    p = realloc(f->clu_obj, (f->alloc_clu_objs + new_objs) * sizeof *f->clu_obj);
+    if(p == NULL) {
+      fatfs_msg("index_clusters: out of memory (%u objs)\n", f->clu_objs);
+      f->clu_idx_bad = 1;
+      return;
+    }
+    f->clu_obj = p;
+    f->alloc_clu_objs += new_objs;
+  }
+
+  f->clu_obj[f->clu_objs++] = oi;
 }
 
 
@@ -1462,6 +1634,8 @@ void assign_clusters(fatfs_t *f, unsigned max_clu, unsigned max_obj)
       /* do not overflow the root of a boot drive */
       if (f->obj[u].parent == 0 && f->sys_type)
         leavedos(20);
+    } else {
+      index_clusters(f, u);
     }
     fatfs_deb("assign_clusters: obj %u, start %u, len %u (%s)\n",
 	u, f->obj[u].start, f->obj[u].len, f->obj[u].name);
@@ -1502,16 +1676,9 @@ int read_file(fatfs_t *f, unsigned oi, unsigned clu, unsigned pos,
 	unsigned char *buf)
 {
   obj_t *o = f->obj + oi;
-  char *s;
-  off_t ofs;
+  struct fatfs_fd *fp;
 
-  if(f->fd_obj && oi != f->fd_obj) {
-     close(f->fd);
-     f->fd = -1;
-     f->fd_obj = 0;
-  }
-
-  fatfs_deb2("read_file: obj %u, cluster %u, sec %u%s\n", oi, clu, pos, f->fd_obj ? " (fd cached)" : "");
+  fatfs_deb2("read_file: obj %u, cluster %u, sec %u\n", oi, clu, pos);
 
   if(clu && o->start == 0) return -1;
   if(clu < o->start) return -1;
@@ -1523,24 +1690,74 @@ int read_file(fatfs_t *f, unsigned oi, unsigned clu, unsigned pos,
   }
   if(pos >= o->size) return 0;
 
-  s = o->full_name;
-  fatfs_deb2("going to read 0x200 bytes from file \"%s\", ofs 0x%x \n", s, pos);
+  fatfs_deb2("going to read 0x200 bytes from file \"%s\", ofs 0x%x \n", o->full_name, pos);
+
+  if(!(fp = get_fd(f, oi))) return -1;
+
+  file_readahead(fp, pos, 0x200);
+  if(pread(fp->fd, buf, 0x200, pos) == -1) return -2;
+
+  return 0;
+}
 
-  if(f->fd_obj == 0) {
-    if((f->fd = mfs_open_file(f->mfs_idx, s, O_RDONLY | O_CLOEXEC)) == -1) {
-      fatfs_deb("fatfs: open %s failed\n", s);
-      return -1;
+
+/*
+ * Returns the open host file for object oi, NULL if it can't be opened.
+ * A few files stay open, the least recently used one gets closed when
+ * another one is needed.
+ */
+struct fatfs_fd *get_fd(fatfs_t *f, unsigned oi)
+{
+  struct fatfs_fd *fp, *lru = f->fds;
+  int i;
+
+  for(i = 0; i < FATFS_FDS; i++) {
+    fp = f->fds + i;
+    if(fp->obj == oi) {
+      fp->used = ++f->fd_used;
+      fatfs_deb2("get_fd: obj %u (fd cached)\n", oi);
+      return fp;
     }
-    f->fd_obj = oi;
+    if(!fp->obj || (lru->obj && fp->used < lru->used)) lru = fp;
+  }
+
+  if(lru->obj) {
+    close(lru->fd);
+    lru->fd = -1;
+    lru->obj = 0;
+  }
+
+  if((lru->fd = mfs_open_file(f->mfs_idx, f->obj[oi].full_name, O_RDONLY | O_CLOEXEC)) == -1) {
+    fatfs_deb("fatfs: open %s failed\n", f->obj[oi].full_name);
+    return NULL;
   }
+  lru->obj = oi;
+  lru->used = ++f->fd_used;
+  lru->next_ofs = lru->ra_ofs = 0;
 
-  if((ofs = lseek(f->fd, pos, SEEK_SET)) == -1) return -1;
+  /* objects from the cache are only checked against the file now */
+  if(f->fc) {
+    struct stat sb;
+    if(fstat(lru->fd, &sb) == 0 && (sb.st_size != f->obj[oi].size ||
+        dos_time(&sb.st_mtime) != f->obj[oi].time))
+      fcache_stale(f);
+  }
 
-  if(ofs != pos) return -1;
+  return lru;
+}
 
-  if(read(f->fd, buf, 0x200) == -1) return -2;
 
-  return 0;
+/*
+ * Keep the host reading ahead of a file that is read sequentially.
+ */
+void file_readahead(struct fatfs_fd *fp, off_t ofs, unsigned len)
+{
+  if(ofs == fp->next_ofs && ofs + len + FATFS_RA_SIZE / 2 > fp->ra_ofs) {
+    if(fp->ra_ofs < ofs + len) fp->ra_ofs = ofs + len;
+    posix_fadvise(fp->fd, fp->ra_ofs, FATFS_RA_SIZE, POSIX_FADV_WILLNEED);
+    fp->ra_ofs += FATFS_RA_SIZE;
+  }
+  fp->next_ofs = ofs + len;
 }
 
 
@@ -0,0 +1,398 @@
+/*
+ * (C) Copyright 1992, ..., 2014 the "DOSEMU-Development-Team".
+ *
+ * for details see file COPYING in the DOSEMU distribution
+ */
+
+/*
+ * Persistent cache of the host directories behind a fatfs drive.
+ *
+ * For every scanned directory the cache keeps the list of its entries
+ * together with the stat() data fatfs uses (type, size, mtime), keyed
+ * by the directory's device, inode, mtime and ctime. The object table,
+ * cluster assignment and DOS directory entries are derived from exactly
+ * this data in a deterministic way, so a cache hit rebuilds the same
+ * drive without the scandir() and the stat() per file.
+ *
+ * The cache lives in ~/.dosemu/fatfs_cache, one file per drive, which
+ * is mmap()ed at fatfs_init() and replaced with rename() when new
+ * directories were scanned, so that concurrent instances can share it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "emu.h"
+#include "disks.h"
+#include "utilities.h"
+#include "dosemu_config.h"
+#include "fatfs.h"
+#include "fatfs_priv.h"
+
+#define FC_MAGIC	0x43465344	/* "DSFC" */
+#define FC_VERSION	1
+#define FC_HASH		1024
+
+struct fc_file_hdr {
+  uint32_t magic, version;
+  uint32_t dirs, pad;
+};
+
+struct fc_file_dir {
+  uint64_t dev, ino;
+  int64_t mtime, mtime_ns, ctime, ctime_ns;
+  uint32_t ents, pad;
+};
+
+struct fc_file_ent {
+  uint64_t size;
+  int64_t mtime;
+  uint32_t mode;			/* 0 = stat() failed */
+  uint32_t name_len;			/* name follows, 0-terminated */
+};
+
+struct fcache {
+  char *path;
+  void *map;
+  size_t map_size;
+  unsigned dirs;
+  unsigned dirty:1;
+  unsigned stale:1;			/* found out of date, don't save */
+  struct fc_dir *hash[FC_HASH];
+};
+
+#define FC_ALIGN(x) (((x) + 7) & ~(size_t) 7)
+
+static unsigned fc_hash(uint64_t dev, uint64_t ino)
+{
+  return (ino ^ (ino >> 10) ^ (dev * 31)) % FC_HASH;
+}
+
+static int fc_key_match(const struct fc_dir *d, const struct stat *sb)
+{
+  return d->dev == sb->st_dev && d->ino == sb->st_ino &&
+      d->mtime == sb->st_mtim.tv_sec && d->mtime_ns == sb->st_mtim.tv_nsec &&
+      d->ctime == sb->st_ctim.tv_sec && d->ctime_ns == sb->st_ctim.tv_nsec;
+}
+
+static char *fc_file_name(const char *dir)
+{
+  char *cdir, *ret, name[32];
+  uint64_t h = 14695981039346656037ULL;
+  const char *p;
+
+  for(p = dir; *p; p++) {
+    h ^= (unsigned char) *p;
+    h *= 1099511628211ULL;
+  }
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long) h);
+
+  cdir = assemble_path(dosemu_localdir_path, "fatfs_cache");
+  if(!exists_dir(cdir) && mkdir(cdir, S_IRWXU) && errno != EEXIST) {
+    fatfs_msg("fcache: can't create %s: %s\n", cdir, strerror(errno));
+    free(cdir);
+    return NULL;
+  }
+  ret = assemble_path(cdir, name);
+  free(cdir);
+  return ret;
+}
+
+static void fc_insert(struct fcache *fc, struct fc_dir *d)
+{
+  unsigned h = fc_hash(d->dev, d->ino);
+
+  d->next = fc->hash[h];
+  fc->hash[h] = d;
+  fc->dirs++;
+}
+
+/*
+ * Parse a mapped cache file. Names point into the mapping.
+ */
+static int fc_parse(struct fcache *fc)
+{
+  unsigned char *p = fc->map, *end = p + fc->map_size;
+  const struct fc_file_hdr *hdr = fc->map;
+  unsigned i, j;
+
+  if(fc->map_size < sizeof(*hdr) || hdr->magic != FC_MAGIC ||
+      hdr->version != FC_VERSION)
+    return -1;
+  p += sizeof(*hdr);
+
+  for(i = 0; i < hdr->dirs; i++) {
+    const struct fc_file_dir *fd = (const void *) p;
+    struct fc_dir *d;
+
+    if(p + sizeof(*fd) > end) return -1;
+    p += sizeof(*fd);
+    d = fc_dir_new(NULL, fd->ents);
+    if(!d) return -1;
+    d->dev = fd->dev;
+    d->ino = fd->ino;
+    d->mtime = fd->mtime;
+    d->mtime_ns = fd->mtime_ns;
+    d->ctime = fd->ctime;
+    d->ctime_ns = fd->ctime_ns;
+    d->mapped = 1;
+    fc_insert(fc, d);
+
+    for(j = 0; j < d->ents; j++) {
+      const struct fc_file_ent *fe = (const void *) p;
+      struct fc_ent *e = d->ent + j;
+
+      if(p + sizeof(*fe) > end) return -1;
+      p += sizeof(*fe);
+      if(fe->name_len >= (size_t) (end - p) || p[fe->name_len] != '\0')
+        return -1;
+      e->name = (char *) p;
+      e->mode = fe->mode;
+      e->size = fe->size;
+      e->mtime = fe->mtime;
+      p += FC_ALIGN(fe->name_len + 1);
+    }
+  }
+
+  return 0;
+}
+
+static void fc_clear(struct fcache *fc)
+{
+  struct fc_dir *d, *n;
+  unsigned h;
+
+  for(h = 0; h < FC_HASH; h++) {
+    for(d = fc->hash[h]; d; d = n) {
+      n = d->next;
+      fc_dir_free(d);
+    }
+    fc->hash[h] = NULL;
+  }
+  fc->dirs = 0;
+}
+
+void fcache_init(fatfs_t *f)
+{
+  struct fcache *fc;
+  struct stat sb;
+  int fd;
+
+  if(!config.fatfs_cache || !dosemu_localdir_path) return;
+
+  fc = calloc(1, sizeof(*fc));
+  if(!fc) return;
+  fc->path = fc_file_name(f->dir);
+  if(!fc->path) {
+    free(fc);
+    return;
+  }
+  f->fc = fc;
+
+  fd = open(fc->path, O_RDONLY | O_CLOEXEC);
+  if(fd == -1) {
+    fatfs_deb("fcache: no cache for %s\n", f->dir);
+    return;
+  }
+  if(fstat(fd, &sb) == 0 && sb.st_size > 0) {
+    fc->map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(fc->map == MAP_FAILED)
+      fc->map = NULL;
+    else
+      fc->map_size = sb.st_size;
+  }
+  close(fd);
+
+  if(fc->map && fc_parse(fc)) {
+    fatfs_msg("fcache: %s is damaged, ignored\n", fc->path);
+    fc_clear(fc);
+    fc->dirty = 1;
+  }
+  fatfs_msg("fcache: %u dirs cached for %s\n", fc->dirs, f->dir);
+}
+
+static int fc_write(struct fcache *fc, int fd)
+{
+  struct fc_file_hdr hdr = { FC_MAGIC, FC_VERSION, fc->dirs, 0 };
+  static const char zero[8];
+  struct fc_dir *d;
+  unsigned h, j;
+  FILE *fp;
+
+  fp = fdopen(fd, "w");
+  if(!fp) {
+    close(fd);
+    return -1;
+  }
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  for(h = 0; h < FC_HASH; h++) {
+    for(d = fc->hash[h]; d; d = d->next) {
+      struct fc_file_dir fd = { d->dev, d->ino, d->mtime, d->mtime_ns,
+          d->ctime, d->ctime_ns, d->ents, 0 };
+      fwrite(&fd, sizeof(fd), 1, fp);
+      for(j = 0; j < d->ents; j++) {
+        const struct fc_ent *e = d->ent + j;
+        size_t len = strlen(e->name);
+        struct fc_file_ent fe = { e->size, e->mtime, e->mode, len };
+        fwrite(&fe, sizeof(fe), 1, fp);
+        fwrite(e->name, len, 1, fp);
+        fwrite(zero, FC_ALIGN(len + 1) - len, 1, fp);
+      }
+    }
+  }
+  if(ferror(fp)) {
+    fclose(fp);
+    return -1;
+  }
+  return fclose(fp);
+}
+
+void fcache_done(fatfs_t *f)
+{
+  struct fcache *fc = f->fc;
+  char *tmp;
+  int fd;
+
+  if(!fc) return;
+  f->fc = NULL;
+
+  if(fc->dirty && !fc->stale) {
+    tmp = malloc(strlen(fc->path) + 16);
+    sprintf(tmp, "%s.%d", fc->path, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd == -1 || fc_write(fc, fd) || rename(tmp, fc->path)) {
+      fatfs_msg("fcache: can't write %s: %s\n", fc->path, strerror(errno));
+      unlink(tmp);
+    } else {
+      fatfs_msg("fcache: %u dirs saved for %s\n", fc->dirs, f->dir);
+    }
+    free(tmp);
+  }
+
+  fc_clear(fc);
+  if(fc->map) munmap(fc->map, fc->map_size);
+  free(fc->path);
+  free(fc);
+}
+
+/*
+ * Something on the drive changed behind the cache's back: drop the
+ * cache file so that the next start scans the directories again.
+ */
+void fcache_stale(fatfs_t *f)
+{
+  struct fcache *fc = f->fc;
+
+  if(!fc || fc->stale) return;
+  fatfs_msg("fcache: %s changed, cache dropped\n", f->dir);
+  unlink(fc->path);
+  fc->stale = 1;
+}
+
+/*
+ * Returns the cached listing of the directory described by sb, NULL if
+ * there is none or if it is out of date.
+ */
+struct fc_dir *fcache_get_dir(fatfs_t *f, const struct stat *sb)
+{
+  struct fcache *fc = f->fc;
+  struct fc_dir *d, **dp;
+
+  if(!fc) return NULL;
+
+  dp = &fc->hash[fc_hash(sb->st_dev, sb->st_ino)];
+  for(; (d = *dp); dp = &d->next) {
+    if(d->dev != sb->st_dev || d->ino != sb->st_ino) continue;
+    if(fc_key_match(d, sb)) return d;
+    /* directory changed, rescan */
+    *dp = d->next;
+    fc->dirs--;
+    fc->dirty = 1;
+    fc_dir_free(d);
+    break;
+  }
+
+  return NULL;
+}
+
+/*
+ * Hands a freshly scanned directory to the cache. Returns 1 if the
+ * cache took it over, 0 if the caller has to free it.
+ */
+int fcache_put_dir(fatfs_t *f, struct fc_dir *d)
+{
+  struct fcache *fc = f->fc;
+
+  if(!fc) return 0;
+  fc_insert(fc, d);
+  fc->dirty = 1;
+  return 1;
+}
+
+struct fc_dir *fc_dir_new(const struct stat *sb, unsigned ents)
+{
+  struct fc_dir *d = calloc(1, sizeof(*d) + ents * sizeof(d->ent[0]));
+
+  if(!d) return NULL;
+  d->ents = ents;
+  if(sb) {
+    d->dev = sb->st_dev;
+    d->ino = sb->st_ino;
+    d->mtime = sb->st_mtim.tv_sec;
+    d->mtime_ns = sb->st_mtim.tv_nsec;
+    d->ctime = sb->st_ctim.tv_sec;
+    d->ctime_ns = sb->st_ctim.tv_nsec;
+  }
+  return d;
+}
+
+void fc_dir_free(struct fc_dir *d)
+{
+  unsigned i;
+
+  if(!d->mapped) {
+    for(i = 0; i < d->ents; i++)
+      free(d->ent[i].name);
+  }
+  free(d);
+}
+
+/*
+ * Fill in entry i of a new listing; sb is NULL if stat() failed.
+ * Returns -1 if out of memory.
+ */
+int fc_dir_set_ent(struct fc_dir *d, unsigned i, const char *name,
+	const struct stat *sb)
+{
+  struct fc_ent *e = d->ent + i;
+
+  e->name = strdup(name);
+  if(!e->name) return -1;
+  if(sb) {
+    e->mode = sb->st_mode;
+    e->size = sb->st_size;
+    e->mtime = sb->st_mtime;
+  }
+  return 0;
+}
+
+/*
+ * Returns the stat() data of an entry as far as fatfs uses it,
+ * -1 if the entry could not be stat()ed.
+ */
+int fc_ent_stat(const struct fc_ent *e, struct stat *sb)
+{
+  if(!e->mode) return -1;
+  memset(sb, 0, sizeof(*sb));
+  sb->st_mode = e->mode;
+  sb->st_size = e->size;
+  sb->st_mtime = e->mtime;
+  return 0;
+}
@@ -7,6 +7,26 @@
 #ifndef FATFS_PRIV_H
 #define FATFS_PRIV_H
 
+/*
+ * Debug level.
+ * 0 - normal / 1 - useful / 2 - too much
+ */
+#define DEBUG_FATFS	2
+
+#define fatfs_msg(x...) d_printf("fatfs: " x)
+
+#if DEBUG_FATFS >= 1
+#define fatfs_deb(x...) d_printf("fatfs: " x)
+#else
+#define fatfs_deb(x...)
+#endif
+
+#if DEBUG_FATFS >= 2
+#define fatfs_deb2(x...) d_printf("fatfs: " x)
+#else
+#define fatfs_deb2(x...)
+#endif
+
 #define MAX_DIR_NAME_LEN	256	/* max size of fully qualified path */
 #define MAX_FILE_NAME_LEN	256	/* max size of a file name */
 
@@ -34,6 +54,34 @@ typedef struct {
 
 enum { FAT_TYPE_NONE, FAT_TYPE_FAT12, FAT_TYPE_FAT16, FAT_TYPE_FAT32 };
 
+#define FATFS_FDS	4		/* open host files kept around */
+#define FATFS_RA_SIZE	(256 * 1024)	/* readahead window, in bytes */
+
+/* a host directory listing, see fatfs_cache.c */
+struct fc_ent {
+  char *name;
+  unsigned mode;			/* 0 = stat() failed */
+  uint64_t size;
+  int64_t mtime;
+};
+
+struct fc_dir {
+  uint64_t dev, ino;			/* key, with the times below */
+  int64_t mtime, mtime_ns, ctime, ctime_ns;
+  unsigned mapped:1;			/* names live in the cache file */
+  struct fc_dir *next;
+  unsigned ents;
+  struct fc_ent ent[];
+};
+
+struct fatfs_fd {
+  int fd;
+  unsigned obj;				/* 0 = slot unused */
+  unsigned long used;			/* LRU stamp */
+  off_t next_ofs;			/* where a sequential read goes on */
+  off_t ra_ofs;				/* end of the readahead issued */
+};
+
 struct fatfs_s {
   char *dir;				/* base directory name */
   unsigned ok;				/* successfully initialized */
@@ -60,16 +108,34 @@ struct fatfs_s {
   unsigned sys_objs;
   obj_t *obj;
 
+  unsigned *clu_obj;			/* objects with clusters, by start */
+  unsigned clu_objs, alloc_clu_objs;
+  unsigned clu_last;			/* clu_obj[] index of last lookup */
+  unsigned clu_idx_bad;			/* index incomplete, scan obj[] */
+
   char *ffn, *ffn_ptr;			/* buffer for file names */
   unsigned ffn_obj;
 
   unsigned char *boot_sec;
 
-  int fd;
-  unsigned fd_obj;
+  struct fatfs_fd fds[FATFS_FDS];
+  unsigned long fd_used;
 
   int sys_found[MAX_SYS_IDX];
   struct sys_dsc sfiles[MAX_SYS_IDX];
+
+  struct fcache *fc;			/* persistent dir cache, or NULL */
 };
 
+void fcache_init(fatfs_t *f);
+void fcache_done(fatfs_t *f);
+void fcache_stale(fatfs_t *f);
+struct fc_dir *fcache_get_dir(fatfs_t *f, const struct stat *sb);
+int fcache_put_dir(fatfs_t *f, struct fc_dir *d);
+struct fc_dir *fc_dir_new(const struct stat *sb, unsigned ents);
+void fc_dir_free(struct fc_dir *d);
+int fc_dir_set_ent(struct fc_dir *d, unsigned i, const char *name,
+	const struct stat *sb);
+int fc_ent_stat(const struct fc_ent *e, struct stat *sb);
+
 #endif
@@ -33,6 +33,9 @@
 
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include "memory.h"
 
 #include "emu.h"
@@ -69,11 +72,21 @@ struct io_callback_s {
   int fd;
   unsigned flags;
 };
+struct io_stats_s {
+  unsigned wakeups;
+  unsigned completes;
+  uint64_t woken;		/* us, when the fd got masked */
+  uint64_t lat_total;		/* us from wakeup to ioselect_complete() */
+  uint64_t lat_max;
+};
 #define MAX_FD FD_SETSIZE
 static struct io_callback_s io_callback_func[MAX_FD];
 static struct io_callback_s io_callback_stash[MAX_FD];
-static fd_set fds_sigio;
-static fd_set fds_masked;
+/* protected by fds_mtx */
+static unsigned char fd_active[MAX_FD];
+static unsigned char fd_masked[MAX_FD];
+static unsigned fd_flags[MAX_FD];
+static struct io_stats_s io_stats[MAX_FD];
 
 #if defined(SIG)
 static inline int process_interrupt(SillyG_t *sg)
@@ -114,14 +127,272 @@ void irq_select(void)
 /*  */
 /* io_select @@@  24576 MOVED_CODE_BEGIN @@@ 01/23/96, ./src/base/misc/dosio.c --> src/base/misc/ioctl.c  */
 
-static int max_fd;
-static int syncpipe[2];
+/*
+ * All fds are watched by the io thread. An fd that wakes up is masked
+ * until ioselect_complete() if its callback is deferred to the main
+ * thread or asks for it (IOFLG_MASKED), so the backends arm such fds
+ * for one event only. The backend is epoll where available, select()
+ * otherwise.
+ */
+enum { ARM_OFF, ARM_LEVEL, ARM_ONESHOT };
+#define IO_BATCH 16
+
 static pthread_t io_thr;
 static pthread_mutex_t fun_mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t blk_mtx = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t fds_mtx = PTHREAD_MUTEX_INITIALIZER;
 static int num_cbks;
 
+#ifdef HAVE_SYS_EPOLL_H
+static int epfd;
+static int syncpipe[2];
+/* fds epoll refuses, such as regular files: always ready while armed,
+ * as select() reports them */
+static unsigned char fd_nopoll[MAX_FD];
+static unsigned char nopoll_arm[MAX_FD];
+static int nopoll_max;
+
+static uint32_t be_events(int arm)
+{
+  switch (arm) {
+  case ARM_LEVEL:
+    return EPOLLIN;
+  case ARM_ONESHOT:
+    return EPOLLIN | EPOLLONESHOT;
+  }
+  /* hangups are reported even without events, but only once like that */
+  return EPOLLONESHOT;
+}
+
+static void be_init(void)
+{
+  struct epoll_event ev = { .events = EPOLLIN };
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1 || pipe2(syncpipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    error("epoll_create1(): %s\n", strerror(errno));
+    leavedos(76);
+  }
+  ev.data.fd = syncpipe[0];
+  epoll_ctl(epfd, EPOLL_CTL_ADD, syncpipe[0], &ev);
+}
+
+static void be_done(void)
+{
+  close(syncpipe[0]);
+  close(syncpipe[1]);
+  close(epfd);
+}
+
+/* be_add(), be_mod() and be_del() are called with fds_mtx held */
+static void nopoll_set(int fd, int arm)
+{
+  nopoll_arm[fd] = arm;
+  if (arm != ARM_OFF)
+    write(syncpipe[1], "=", 1);
+}
+
+static void be_add(int fd, int arm)
+{
+  struct epoll_event ev = { .events = be_events(arm), .data.fd = fd };
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0)
+    return;
+  if (errno != EPERM) {
+    error("GEN: can't watch fd %d: %s\n", fd, strerror(errno));
+    return;
+  }
+  g_printf("GEN: fd %d can't be polled, always ready\n", fd);
+  fd_nopoll[fd] = 1;
+  if (fd >= nopoll_max)
+    nopoll_max = fd + 1;
+  nopoll_set(fd, arm);
+}
+
+static void be_mod(int fd, int arm)
+{
+  struct epoll_event ev = { .events = be_events(arm), .data.fd = fd };
+
+  if (fd_nopoll[fd]) {
+    nopoll_set(fd, arm);
+    return;
+  }
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+    return;
+  /* closed and reused, so no longer in the epoll set */
+  if (errno == ENOENT)
+    be_add(fd, arm);
+  else
+    error("GEN: can't rearm fd %d: %s\n", fd, strerror(errno));
+}
+
+static void be_del(int fd)
+{
+  if (fd_nopoll[fd]) {
+    fd_nopoll[fd] = 0;
+    nopoll_arm[fd] = ARM_OFF;
+    return;
+  }
+  /* fails if fd is already closed, which removes it anyway */
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int be_wait(int *ready)
+{
+  struct epoll_event ev[IO_BATCH];
+  char buf[256];
+  int i, n, cnt, timeout = -1;
+
+  pthread_mutex_lock(&fds_mtx);
+  for (i = 0; i < nopoll_max; i++) {
+    if (nopoll_arm[i] != ARM_OFF) {
+      timeout = 0;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fds_mtx);
+
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  cnt = RPT_SYSCALL(epoll_wait(epfd, ev, IO_BATCH, timeout));
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  if (cnt == -1) {
+    error("bad io_select: %s\n", strerror(errno));
+    return 0;
+  }
+  for (i = n = 0; i < cnt; i++) {
+    if (ev[i].data.fd == syncpipe[0]) {
+      while (read(syncpipe[0], buf, sizeof(buf)) > 0);
+      continue;
+    }
+    ready[n++] = ev[i].data.fd;
+  }
+
+  pthread_mutex_lock(&fds_mtx);
+  for (i = 0; i < nopoll_max && n < IO_BATCH; i++) {
+    if (nopoll_arm[i] == ARM_OFF)
+      continue;
+    if (nopoll_arm[i] == ARM_ONESHOT)
+      nopoll_arm[i] = ARM_OFF;
+    ready[n++] = i;
+  }
+  pthread_mutex_unlock(&fds_mtx);
+  return n;
+}
+#else
+static int max_fd;
+static int syncpipe[2];
+static fd_set fds_armed;
+static fd_set fds_oneshot;
+
+static void be_init(void)
+{
+  FD_ZERO(&fds_armed);
+  FD_ZERO(&fds_oneshot);
+  pipe(syncpipe);
+  assert(syncpipe[0] < MAX_FD);
+  max_fd = syncpipe[0];
+}
+
+static void be_done(void)
+{
+  close(syncpipe[1]);
+}
+
+/* be_add(), be_mod() and be_del() are called with fds_mtx held */
+static void be_mod(int fd, int arm)
+{
+  if (arm == ARM_OFF)
+    FD_CLR(fd, &fds_armed);
+  else
+    FD_SET(fd, &fds_armed);
+  if (arm == ARM_ONESHOT)
+    FD_SET(fd, &fds_oneshot);
+  else
+    FD_CLR(fd, &fds_oneshot);
+  write(syncpipe[1], "=", 1);
+}
+
+static void be_add(int fd, int arm)
+{
+  if (fd > max_fd)
+    max_fd = fd;
+  be_mod(fd, arm);
+}
+
+static void be_del(int fd)
+{
+  be_mod(fd, ARM_OFF);
+}
+
+static int be_wait(int *ready)
+{
+  char buf[4096];
+  fd_set fds;
+  int i, n, nfds, selrtn;
+
+  pthread_mutex_lock(&fds_mtx);
+  fds = fds_armed;
+  nfds = max_fd + 1;
+  pthread_mutex_unlock(&fds_mtx);
+  FD_SET(syncpipe[0], &fds);
+
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  selrtn = RPT_SYSCALL(select(nfds, &fds, NULL, NULL, NULL));
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  if (selrtn == -1) {
+    error("bad io_select: %s\n", strerror(errno));
+    return 0;
+  }
+  if (FD_ISSET(syncpipe[0], &fds))
+    read(syncpipe[0], buf, sizeof(buf));
+
+  n = 0;
+  pthread_mutex_lock(&fds_mtx);
+  for (i = 0; i < nfds && n < IO_BATCH; i++) {
+    if (i == syncpipe[0] || !FD_ISSET(i, &fds) || !FD_ISSET(i, &fds_armed))
+      continue;
+    if (FD_ISSET(i, &fds_oneshot))
+      FD_CLR(i, &fds_armed);
+    ready[n++] = i;
+  }
+  pthread_mutex_unlock(&fds_mtx);
+  return n;
+}
+#endif
+
+static uint64_t io_time_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int needs_mask(unsigned flags)
+{
+  return !(flags & IOFLG_IMMED) || (flags & IOFLG_MASKED);
+}
+
+/* called with fds_mtx held */
+static int fd_arm(int fd)
+{
+  if (fd_masked[fd])
+    return ARM_OFF;
+  return needs_mask(fd_flags[fd]) ? ARM_ONESHOT : ARM_LEVEL;
+}
+
+/* called with fds_mtx held */
+static void print_stats(int fd)
+{
+  struct io_stats_s *st = &io_stats[fd];
+
+  if (st->wakeups)
+    g_printf("GEN: fd %i (%s): %u wakeups, %u completed, "
+        "latency avg %llu max %llu us\n", fd, io_callback_func[fd].name,
+        st->wakeups, st->completes,
+        (unsigned long long)(st->completes ? st->lat_total / st->completes : 0),
+        (unsigned long long)st->lat_max);
+  memset(st, 0, sizeof(*st));
+}
+
 static void ioselect_demux(void *arg)
 {
     struct io_callback_s *p = arg;
@@ -132,7 +403,7 @@ static void ioselect_demux(void *arg)
     free(p);
     num = __atomic_sub_fetch(&num_cbks, 1, __ATOMIC_RELAXED);
     pthread_mutex_lock(&fds_mtx);
-    isset = FD_ISSET(f.fd, &fds_sigio);
+    isset = fd_active[f.fd];
     pthread_mutex_unlock(&fds_mtx);
     if (!isset) {
         /* already removed, complete event and exit */
@@ -145,58 +416,45 @@ static void ioselect_demux(void *arg)
     reset_idle(0);
 }
 
-static void io_select(void)
+static void io_dispatch(int fd)
 {
-  int selrtn, i;
-  fd_set fds;
-  int nfds;
+  struct io_callback_s f;
+
+  pthread_mutex_lock(&fun_mtx);
+  f = io_callback_func[fd];
+  pthread_mutex_unlock(&fun_mtx);
 
   pthread_mutex_lock(&fds_mtx);
-  fds = fds_sigio;
-  nfds = max_fd + 1;
+  if (!fd_active[fd] || fd_masked[fd] || !f.func) {
+    pthread_mutex_unlock(&fds_mtx);
+    return;
+  }
+  io_stats[fd].wakeups++;
+  if (needs_mask(fd_flags[fd])) {
+    /* the backend has disarmed it already */
+    fd_masked[fd] = 1;
+    io_stats[fd].woken = io_time_us();
+  }
   pthread_mutex_unlock(&fds_mtx);
 
-  pthread_mutex_lock(&blk_mtx);
-  for (i = 0; i < nfds; i++) {
-    if (FD_ISSET(i, &fds_masked))
-      FD_CLR(i, &fds);
+  if (f.flags & IOFLG_IMMED) {
+    f.func(fd, f.arg);
+  } else {
+    struct io_callback_s *p = malloc(sizeof(*p));
+    *p = f;
+    __atomic_fetch_add(&num_cbks, 1, __ATOMIC_RELAXED);
+    add_thread_callback(ioselect_demux, p, "ioselect");
   }
-  pthread_mutex_unlock(&blk_mtx);
-
-  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-  selrtn = RPT_SYSCALL(select(nfds, &fds, NULL, NULL, NULL));
-  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-
-  switch (selrtn) {
-    case 0:			/* none ready, nothing to do :-) */
-      return;
+}
 
-    case -1:			/* error (not EINTR) */
-      error("bad io_select: %s\n", strerror(errno));
-      break;
+static void io_select(void)
+{
+  int ready[IO_BATCH];
+  int i, n;
 
-    default:			/* has at least 1 descriptor ready */
-      pthread_mutex_lock(&blk_mtx);
-      for (i = 0; i < nfds; i++) {
-        if (FD_ISSET(i, &fds_masked))
-          continue;
-        if (FD_ISSET(i, &fds)) {
-          if (io_callback_func[i].flags & IOFLG_IMMED) {
-            if (io_callback_func[i].flags & IOFLG_MASKED)
-              FD_SET(i, &fds_masked);
-            io_callback_func[i].func(i, io_callback_func[i].arg);
-          } else {
-            struct io_callback_s *f = malloc(sizeof(*f));
-            *f = io_callback_func[i];
-            __atomic_fetch_add(&num_cbks, 1, __ATOMIC_RELAXED);
-            FD_SET(i, &fds_masked);
-            add_thread_callback(ioselect_demux, f, "ioselect");
-          }
-        }
-      }
-      pthread_mutex_unlock(&blk_mtx);
-      break;
-  }
+  n = be_wait(ready);
+  for (i = 0; i < n; i++)
+    io_dispatch(ready[i]);
 }
 
 /*
@@ -235,13 +493,14 @@ add_to_io_select_new(int new_fd, void (*func)(int, void *), void *arg,
     pthread_mutex_unlock(&fun_mtx);
 
     pthread_mutex_lock(&fds_mtx);
-    if (new_fd > max_fd)
-        max_fd = new_fd;
-    FD_SET(new_fd, &fds_sigio);
+    fd_flags[new_fd] = flags;
+    if (!fd_active[new_fd]) {
+	fd_active[new_fd] = 1;
+	be_add(new_fd, fd_arm(new_fd));
+    } else {
+	be_mod(new_fd, fd_arm(new_fd));
+    }
     pthread_mutex_unlock(&fds_mtx);
-
-    if (!io_callback_stash[new_fd].func)
-	write(syncpipe[1], "+", 1);
 }
 
 /*
@@ -264,26 +523,47 @@ void remove_from_io_select(int fd)
 	return;
     }
 
+    pthread_mutex_lock(&fds_mtx);
+    if (!io_callback_stash[fd].func)
+	print_stats(fd);
+    pthread_mutex_unlock(&fds_mtx);
+
     pthread_mutex_lock(&fun_mtx);
     io_callback_func[fd] = io_callback_stash[fd];
     pthread_mutex_unlock(&fun_mtx);
     io_callback_stash[fd].func = NULL;
 
+    pthread_mutex_lock(&fds_mtx);
     if (!io_callback_func[fd].func) {
-	pthread_mutex_lock(&fds_mtx);
-	FD_CLR(fd, &fds_sigio);
-	pthread_mutex_unlock(&fds_mtx);
-	write(syncpipe[1], "-", 1);
+	fd_active[fd] = 0;
+	be_del(fd);
 	g_printf("GEN: fd=%d removed from select SIGIO\n", fd);
+    } else {
+	fd_flags[fd] = io_callback_func[fd].flags;
+	be_mod(fd, fd_arm(fd));
     }
+    pthread_mutex_unlock(&fds_mtx);
 }
 
 static void do_unmask(int fd)
 {
-    pthread_mutex_lock(&blk_mtx);
-    FD_CLR(fd, &fds_masked);
-    pthread_mutex_unlock(&blk_mtx);
-    write(syncpipe[1], "=", 1);
+    struct io_stats_s *st = &io_stats[fd];
+
+    pthread_mutex_lock(&fds_mtx);
+    if (fd_masked[fd]) {
+	if (st->woken) {
+	    uint64_t lat = io_time_us() - st->woken;
+	    st->completes++;
+	    st->lat_total += lat;
+	    if (lat > st->lat_max)
+		st->lat_max = lat;
+	    st->woken = 0;
+	}
+	fd_masked[fd] = 0;
+	if (fd_active[fd])
+	    be_mod(fd, fd_arm(fd));
+    }
+    pthread_mutex_unlock(&fds_mtx);
 }
 
 void ioselect_complete(int fd)
@@ -296,9 +576,12 @@ void ioselect_complete(int fd)
 void ioselect_block(int fd)
 {
     assert(io_callback_func[fd].flags & IOFLG_IMMED);
-    pthread_mutex_lock(&blk_mtx);
-    FD_SET(fd, &fds_masked);
-    pthread_mutex_unlock(&blk_mtx);
+    pthread_mutex_lock(&fds_mtx);
+    fd_masked[fd] = 1;
+    io_stats[fd].woken = 0;
+    if (fd_active[fd])
+	be_mod(fd, ARM_OFF);
+    pthread_mutex_unlock(&fds_mtx);
 }
 
 void ioselect_unblock(int fd)
@@ -318,29 +601,11 @@ static void *ioselect_thread(void *arg)
     return NULL;
 }
 
-static void do_syncpipe(int fd, void *arg)
-{
-    char buf[4096];
-    read(fd, buf, sizeof(buf));
-}
-
 void ioselect_init(void)
 {
-    struct io_callback_s *f;
     struct sched_param parm = { .sched_priority = 1 };
 
-    FD_ZERO(&fds_sigio);
-    FD_ZERO(&fds_masked);
-    pipe(syncpipe);
-    assert(syncpipe[0] < MAX_FD);
-    f = &io_callback_func[syncpipe[0]];
-    f->func = do_syncpipe;
-    f->arg = NULL;
-    f->name = "syncpipe";
-    f->fd = syncpipe[0];
-    f->flags = IOFLG_IMMED;
-    max_fd = syncpipe[0];
-    FD_SET(syncpipe[0], &fds_sigio);
+    be_init();
     pthread_create(&io_thr, NULL, ioselect_thread, NULL);
     pthread_setschedparam(io_thr, SCHED_FIFO, &parm);
 #if defined(HAVE_PTHREAD_SETNAME_NP) && defined(__GLIBC__)
@@ -350,7 +615,15 @@ void ioselect_init(void)
 
 void ioselect_done(void)
 {
+    int fd;
+
     pthread_cancel(io_thr);
     pthread_join(io_thr, NULL);
-    close(syncpipe[1]);
+    pthread_mutex_lock(&fds_mtx);
+    for (fd = 0; fd < MAX_FD; fd++) {
+	if (fd_active[fd])
+	    print_stats(fd);
+    }
+    pthread_mutex_unlock(&fds_mtx);
+    be_done();
 }
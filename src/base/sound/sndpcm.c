@@ -46,6 +46,7 @@
     if (debug_level('S') >= 9) S_printf(__VA_ARGS__); \
 } while (0)
 #define SND_BUFFER_SIZE 100000	/* enough to hold 1.1s of 44100/stereo */
+#define SND_CHUNKS_SIZE (SND_BUFFER_SIZE / 32)
 #define BUFFER_DELAY 40000.0
 
 #define MIN_BUFFER_DELAY (BUFFER_DELAY)
@@ -57,6 +58,7 @@
 #define MAX_BUFFER_DELAY (READ_AREA_START + READ_AREA_SIZE)
 #define MIN_GUARD_SIZE 1024
 #define MIN_READ_GUARD_PERIOD (1000000 * MIN_GUARD_SIZE / (2 * 44100))
+#define PCM_MIX_FRAMES 256
 #define WR_BUFFER_LW (WRITE_AREA_SIZE / 3)
 #define MIN_READ_DELAY (MIN_BUFFER_DELAY + MIN_READ_GUARD_PERIOD)
 #define WRITE_INIT_POS (WRITE_AREA_SIZE / 2)
@@ -91,15 +93,21 @@ enum {
     SNDBUF_STATE_STALLED,
 };
 
-struct sample {
-    int format;
+/* Samples are kept in the stream buffer as plain S16. Timestamps are
+ * kept per chunk: a run of frames written back to back at the same
+ * rate shares one header, and frame N of a chunk is at
+ * tstamp + (skip + N) * frame_per. */
+struct pcm_chunk {
     double tstamp;
-    unsigned char data[2];
+    double frame_per;
+    int skip;		/* frames already removed from the head */
+    int frames;		/* frames still in the buffer */
 };
 
 struct stream {
     int channels;
     struct rng_s buffer;
+    struct rng_s chunks;
     /* buf_cnt is a flat counter, never decrements. We have to use
      * something really "long" for it, because "int" can overflow in
      * about 6.7 hours of playing stereo sound at rate 44100.
@@ -275,6 +283,7 @@ static void pcm_clear_stream(int strm_idx)
 {
     pcm.stream[strm_idx].buf_cnt += rng_count(&pcm.stream[strm_idx].buffer);
     rng_clear(&pcm.stream[strm_idx].buffer);
+    rng_clear(&pcm.stream[strm_idx].chunks);
 }
 
 static void pcm_reset_stream(int strm_idx)
@@ -296,10 +305,12 @@ int pcm_allocate_stream(int channels, const char *name, void *vol_arg)
 	return -1;
     }
     index = pcm.num_streams;
-    rng_init(&pcm.stream[index].buffer, SND_BUFFER_SIZE,
-	     sizeof(struct sample));
+    rng_init(&pcm.stream[index].buffer, SND_BUFFER_SIZE, sizeof(sndbuf_t));
+    rng_init(&pcm.stream[index].chunks, SND_CHUNKS_SIZE,
+	     sizeof(struct pcm_chunk));
     /* to keep timestamps contiguous, we disable overwrites */
     rng_allow_ovw(&pcm.stream[index].buffer, 0);
+    rng_allow_ovw(&pcm.stream[index].chunks, 0);
     pcm.stream[index].channels = channels;
     pcm.stream[index].name = name;
     pcm.stream[index].buf_cnt = 0;
@@ -463,12 +474,81 @@ int pcm_frag_size(double period, struct player_params *params)
     return nsamps * pcm_format_size(params->format);
 }
 
-static int peek_last_sample(int strm_idx, struct sample *samp)
+static double chunk_tstamp(const struct pcm_chunk *c, int frame)
+{
+    return c->tstamp + (c->skip + frame) * c->frame_per;
+}
+
+/* timestamp of the frame the sample idx belongs to */
+static double pcm_sample_tstamp(int strm_idx, int idx)
+{
+    struct stream *strm = &pcm.stream[strm_idx];
+    struct pcm_chunk c;
+    int i, frame = idx / strm->channels;
+
+    for (i = 0; rng_peek(&strm->chunks, i, &c); i++) {
+	if (frame < c.frames)
+	    return chunk_tstamp(&c, frame);
+	frame -= c.frames;
+    }
+    assert(0);
+    return 0;
+}
+
+static int peek_last_tstamp(int strm_idx, double *tstamp)
 {
-    int idx = rng_count(&pcm.stream[strm_idx].buffer);
+    struct pcm_chunk c;
+    int idx = rng_count(&pcm.stream[strm_idx].chunks);
     if (!idx)
 	return 0;
-    return rng_peek(&pcm.stream[strm_idx].buffer, idx - 1, samp);
+    rng_peek(&pcm.stream[strm_idx].chunks, idx - 1, &c);
+    *tstamp = chunk_tstamp(&c, c.frames - 1);
+    return 1;
+}
+
+/* Account a new frame in the chunk list. If it continues the last
+ * chunk, it is merged and gets the timestamp the chunk dictates. */
+static int pcm_chunk_add(int strm_idx, double *tstamp, double frame_per)
+{
+    struct stream *strm = &pcm.stream[strm_idx];
+    struct pcm_chunk c;
+    int idx = rng_count(&strm->chunks);
+
+    if (idx) {
+	rng_peek(&strm->chunks, idx - 1, &c);
+	if (c.frame_per == frame_per &&
+		fabs(chunk_tstamp(&c, c.frames) - *tstamp) < frame_per / 1000) {
+	    *tstamp = chunk_tstamp(&c, c.frames);
+	    c.frames++;
+	    rng_poke(&strm->chunks, idx - 1, &c);
+	    return 1;
+	}
+    }
+    c.tstamp = *tstamp;
+    c.frame_per = frame_per;
+    c.skip = 0;
+    c.frames = 1;
+    return rng_put(&strm->chunks, &c);
+}
+
+static void pcm_drop_frames(int strm_idx, int frames)
+{
+    struct stream *strm = &pcm.stream[strm_idx];
+    struct pcm_chunk c;
+
+    strm->buf_cnt += frames * strm->channels;
+    rng_remove(&strm->buffer, frames * strm->channels, NULL);
+    while (frames && rng_peek(&strm->chunks, 0, &c)) {
+	if (c.frames <= frames) {
+	    frames -= c.frames;
+	    rng_remove(&strm->chunks, 1, NULL);
+	} else {
+	    c.skip += frames;
+	    c.frames -= frames;
+	    rng_poke(&strm->chunks, 0, &c);
+	    frames = 0;
+	}
+    }
 }
 
 void pcm_prepare_stream(int strm_idx)
@@ -822,7 +902,7 @@ void pcm_write_interleaved(sndbuf_t ptr[][SNDBUF_CHANS], int frames,
 	int rate, int format, int nchans, int strm_idx)
 {
     int i, j;
-    struct sample samp;
+    double tstamp = 0;
     double frame_per;
     struct stream *strm;
 
@@ -831,37 +911,36 @@ void pcm_write_interleaved(sndbuf_t ptr[][SNDBUF_CHANS], int frames,
     if (strm->flags & PCM_FLAG_RAW)
 	rate /= strm->raw_speed_adj;
 
-    samp.format = format;
-    samp.tstamp = 0;
     frame_per = pcm_frame_period_us(rate);
     pthread_mutex_lock(&pcm.strm_mtx);
     for (i = 0; i < frames; i++) {
 	int l;
-	struct sample s2;
+	double last;
 retry:
-	samp.tstamp = pcm_calc_tstamp(strm_idx);
-	l = peek_last_sample(strm_idx, &s2);
-	assert(!(l && samp.tstamp < s2.tstamp));
-	for (j = 0; j < strm->channels; j++) {
-	    int ch = j % nchans;
-	    memcpy(samp.data, &ptr[i][ch], pcm_format_size(format));
-	    l = rng_put(&strm->buffer, &samp);
-	    if (!l) {
-		if (!(strm->flags & PCM_FLAG_RAW)) {
-		    error("Sound buffer %i overflowed (%s)\n", strm_idx,
-			    strm->name);
-		    pcm_reset_stream(strm_idx);
-		    goto retry;
-		} else {
-		    pcm_printf("Sound buffer %i overflowed (%s)\n", strm_idx,
-			    strm->name);
-		    strm->adj_time_delay = 0;
-		    goto cont;
-		}
+	tstamp = pcm_calc_tstamp(strm_idx);
+	l = peek_last_tstamp(strm_idx, &last);
+	assert(!(l && tstamp < last));
+	if (rng_get_free_space(&strm->buffer) <
+		strm->channels * sizeof(sndbuf_t) ||
+		!pcm_chunk_add(strm_idx, &tstamp, frame_per)) {
+	    if (!(strm->flags & PCM_FLAG_RAW)) {
+		error("Sound buffer %i overflowed (%s)\n", strm_idx,
+			strm->name);
+		pcm_reset_stream(strm_idx);
+		goto retry;
+	    } else {
+		pcm_printf("Sound buffer %i overflowed (%s)\n", strm_idx,
+			strm->name);
+		strm->adj_time_delay = 0;
+		goto cont;
 	    }
 	}
-	pcm_handle_write(strm_idx, samp.tstamp);
-	strm->stop_time = samp.tstamp + frame_per;
+	for (j = 0; j < strm->channels; j++) {
+	    sndbuf_t val = sample_to_S16(&ptr[i][j % nchans], format);
+	    rng_put(&strm->buffer, &val);
+	}
+	pcm_handle_write(strm_idx, tstamp);
+	strm->stop_time = tstamp + frame_per;
     }
 
 cont:
@@ -879,102 +958,126 @@ static void pcm_remove_samples(double time)
 {
     #define GUARD_SAMPS 1
     int i;
-    struct sample s;
     for (i = 0; i < pcm.num_streams; i++) {
+	int frames = 0;
+	int avail;
 	if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE)
 	    continue;
-	while (rng_count(&pcm.stream[i].buffer) >= pcm.stream[i].channels *
-		(GUARD_SAMPS + 1)) {
-	    /* we leave GUARD_SAMPS samples below the timestamp untouched */
-	    rng_peek(&pcm.stream[i].buffer, pcm.stream[i].channels *
-		    GUARD_SAMPS, &s);
-	    if (s.tstamp > time)
-		break;
-	    pcm.stream[i].buf_cnt += pcm.stream[i].channels;
-	    rng_remove(&pcm.stream[i].buffer, pcm.stream[i].channels, NULL);
-	}
+	avail = rng_count(&pcm.stream[i].buffer) / pcm.stream[i].channels;
+	/* we leave GUARD_SAMPS samples below the timestamp untouched */
+	while (avail - frames >= GUARD_SAMPS + 1 &&
+		pcm_sample_tstamp(i, (frames + GUARD_SAMPS) *
+		pcm.stream[i].channels) <= time)
+	    frames++;
+	if (frames)
+	    pcm_drop_frames(i, frames);
     }
 }
 
-static sndbuf_t pcm_interpolate(struct sample s1, struct sample s2,
-		double time)
-{
-    sndbuf_t v1 = sample_to_S16(s1.data, s1.format);
-    sndbuf_t v2 = sample_to_S16(s2.data, s2.format);
-    if (s2.tstamp <= s1.tstamp)
-	return v1;
-    /* simple linear interpolation for now */
-    return (v1 + (time - s1.tstamp) * (v2 - v1) / (s2.tstamp - s1.tstamp));
-}
+/* a source frame with its timestamp, so that it is looked up only
+ * once per fragment no matter how many output frames it spans */
+struct pcm_frame {
+    double tstamp;
+    float v[SNDBUF_CHANS];
+};
 
-static void pcm_get_samples(double time,
-		sndbuf_t samp[MAX_STREAMS][SNDBUF_CHANS], int *idxs,
-		int out_channels, int id)
+static void pcm_peek_frame(int strm_idx, int idx, int out_channels,
+		struct pcm_frame *f)
 {
-    int i, j;
-    int started;
-    int have_prev;
-    struct sample s[SNDBUF_CHANS], prev_s[SNDBUF_CHANS];
+    struct stream *strm = &pcm.stream[strm_idx];
+    sndbuf_t v;
+    int j;
 
-    for (i = 0; i < pcm.num_streams; i++) {
-	for (j = 0; j < SNDBUF_CHANS; j++)
-	    samp[i][j] = 0;
-	if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE ||
-		!pcm.is_connected(id, pcm.stream[i].vol_arg))
-	    continue;
+    for (j = 0; j < SNDBUF_CHANS; j++)
+	f->v[j] = 0;
+    for (j = 0; j < out_channels && j < strm->channels; j++) {
+	rng_peek(&strm->buffer, idx + j, &v);
+	f->v[j] = v;
+    }
+    if (out_channels == 2 && strm->channels == 1)
+	f->v[1] = f->v[0];
+    f->tstamp = pcm_sample_tstamp(strm_idx, idx);
+}
+
+/* Resample the whole fragment of one stream to the output rate.
+ * idx is the stream position in samples, as calc_idxs() gives it.
+ * Frames for which there is no data yet are filled with silence. */
+static void pcm_get_block(int strm_idx, double time, double frame_period,
+		int nframes, int *idx, int out_channels,
+		float blk[][SNDBUF_CHANS])
+{
+    struct stream *strm = &pcm.stream[strm_idx];
+    int channels = strm->channels;
+    int count = rng_count(&strm->buffer);
+    int have_prev = 0, have_next = 0;
+    struct pcm_frame prev, next;
+    int i, j;
 
-	have_prev = 0;
-	started = 0;
-	if (idxs[i] >= pcm.stream[i].channels) {
-	    idxs[i] -= pcm.stream[i].channels;
-	    have_prev = 1;
-	}
-	while (rng_count(&pcm.stream[i].buffer) - idxs[i] >=
-	       pcm.stream[i].channels) {
-	    for (j = 0; j < pcm.stream[i].channels; j++)
-		rng_peek(&pcm.stream[i].buffer, idxs[i] + j, &s[j]);
-	    if (out_channels == 2 && pcm.stream[i].channels == 1)
-		s[1] = s[0];
-	    if (s[0].tstamp > time) {
-		if (!started) {
-		    /* assert on idxs in sync with time */
-		    assert(!have_prev);
+    if (*idx >= channels) {
+	pcm_peek_frame(strm_idx, *idx - channels, out_channels, &prev);
+	have_prev = 1;
+    }
+    for (i = 0; i < nframes; i++, time += frame_period) {
+	while (1) {
+	    if (!have_next) {
+		if (count - *idx < channels)
 		    break;
-		}
-		for (j = 0; j < out_channels; j++)
-		    samp[i][j] = pcm_interpolate(prev_s[j], s[j], time);
-		break;
+		pcm_peek_frame(strm_idx, *idx, out_channels, &next);
+		have_next = 1;
 	    }
-	    memcpy(prev_s, s, sizeof(struct sample) * out_channels);
-	    idxs[i] += pcm.stream[i].channels;
-	    started = 1;
+	    if (next.tstamp > time)
+		break;
+	    prev = next;
+	    have_prev = 1;
+	    have_next = 0;
+	    *idx += channels;
+	}
+	if (!have_prev || !have_next) {
+	    for (j = 0; j < SNDBUF_CHANS; j++)
+		blk[i][j] = 0;
+	} else if (next.tstamp <= prev.tstamp) {
+	    for (j = 0; j < SNDBUF_CHANS; j++)
+		blk[i][j] = prev.v[j];
+	} else {
+	    /* simple linear interpolation for now */
+	    float f = (time - prev.tstamp) / (next.tstamp - prev.tstamp);
+	    for (j = 0; j < SNDBUF_CHANS; j++)
+		blk[i][j] = prev.v[j] + f * (next.v[j] - prev.v[j]);
 	}
     }
 }
 
-static void pcm_mix_samples(sndbuf_t in[][SNDBUF_CHANS],
-	sndbuf_t out[SNDBUF_CHANS], int channels, int format,
-	double volume[][SNDBUF_CHANS][SNDBUF_CHANS])
+/* out = a * in + b * swap(in), where a holds the direct volumes and
+ * b the cross-channel ones; plain enough for the compiler to vectorize */
+static void pcm_mix_block(float mix[][SNDBUF_CHANS],
+	float blk[][SNDBUF_CHANS], int nframes,
+	double volume[SNDBUF_CHANS][SNDBUF_CHANS])
 {
-    int i, j, k;
-    int value[SNDBUF_CHANS] = { 0 };
+    const float a0 = volume[0][0], a1 = volume[1][1];
+    const float b0 = volume[0][1], b1 = volume[1][0];
+    int i;
 
-    for (j = 0; j < SNDBUF_CHANS; j++) {
-	for (i = 0; i < pcm.num_streams; i++) {
-	    if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE)
-		continue;
-	    for (k = 0; k < SNDBUF_CHANS; k++) {
-		if (volume[i][j][k] == 0)
-		    continue;
-		value[j] += in[i][k] * volume[i][j][k];
-	    }
-	}
+    for (i = 0; i < nframes; i++) {
+	float l = blk[i][0], r = blk[i][1];
+	mix[i][0] += a0 * l + b0 * r;
+	mix[i][1] += a1 * r + b1 * l;
     }
-    for (i = channels; i < SNDBUF_CHANS; i++)
-	value[0] += value[i];
-    for (i = 0; i < channels; i++) {
-	S16_to_sample(pcm_samp_cutoff(value[i], PCM_FORMAT_S16_LE),
-		&out[i], format);
+}
+
+static void pcm_mix_finish(float mix[][SNDBUF_CHANS],
+	sndbuf_t buf[][SNDBUF_CHANS], int nframes, int channels, int format)
+{
+    int i, j;
+
+    for (i = 0; i < nframes; i++) {
+	int value[SNDBUF_CHANS];
+	for (j = 0; j < SNDBUF_CHANS; j++)
+	    value[j] = mix[i][j];
+	for (j = channels; j < SNDBUF_CHANS; j++)
+	    value[0] += value[j];
+	for (j = 0; j < channels; j++)
+	    S16_to_sample(pcm_samp_cutoff(value[j], PCM_FORMAT_S16_LE),
+		    &buf[i][j], format);
     }
 }
 
@@ -986,12 +1089,10 @@ static void calc_idxs(struct pcm_player_wr *pl, int idxs[MAX_STREAMS])
 	    continue;
 	assert(pcm.stream[i].buf_cnt >= pl->last_cnt[i]);
 	if (pl->last_idx[i] > pcm.stream[i].buf_cnt - pl->last_cnt[i]) {
-	    struct sample s;
 	    idxs[i] = pl->last_idx[i] - (pcm.stream[i].buf_cnt -
 		    pl->last_cnt[i]);
 	    assert(idxs[i] <= rng_count(&pcm.stream[i].buffer));
-	    rng_peek(&pcm.stream[i].buffer, idxs[i] - 1, &s);
-	    assert(pl->last_tstamp[i] == s.tstamp);
+	    assert(pl->last_tstamp[i] == pcm_sample_tstamp(i, idxs[i] - 1));
 	} else {
 	    idxs[i] = 0;
 	}
@@ -1005,11 +1106,8 @@ static void save_idxs(struct pcm_player_wr *pl, int idxs[MAX_STREAMS])
 	if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE)
 	    continue;
 	assert(idxs[i] <= rng_count(&pcm.stream[i].buffer));
-	if (idxs[i] > 0) {
-	    struct sample s;
-	    rng_peek(&pcm.stream[i].buffer, idxs[i] - 1, &s);
-	    pl->last_tstamp[i] = s.tstamp;
-	}
+	if (idxs[i] > 0)
+	    pl->last_tstamp[i] = pcm_sample_tstamp(i, idxs[i] - 1);
 	pl->last_cnt[i] = pcm.stream[i].buf_cnt;
 	pl->last_idx[i] = idxs[i];
     }
@@ -1031,10 +1129,9 @@ static void get_volumes(int id, double volume[][SNDBUF_CHANS][SNDBUF_CHANS])
 int pcm_data_get_interleaved(sndbuf_t buf[][SNDBUF_CHANS], int nframes,
 			   struct player_params *params)
 {
-    int idxs[MAX_STREAMS], out_idx, handle, i;
+    int idxs[MAX_STREAMS], handle, i, done, n;
     long long now;
     double start_time, stop_time, frame_period, frag_period, time;
-    sndbuf_t samp[MAX_STREAMS][SNDBUF_CHANS];
     double volume[MAX_STREAMS][SNDBUF_CHANS][SNDBUF_CHANS];
     struct pcm_holder *p;
 
@@ -1082,15 +1179,33 @@ int pcm_data_get_interleaved(sndbuf_t buf[][SNDBUF_CHANS], int nframes,
 	return 0;
     }
     frame_period = pcm_frame_period_us(params->rate);
-    time = start_time;
     calc_idxs(PL_PRIV(p), idxs);
     get_volumes(PLAYER(p)->id, volume);
-    for (out_idx = 0; out_idx < nframes; out_idx++) {
-	pcm_get_samples(time, samp, idxs, params->channels, PLAYER(p)->id);
-	pcm_mix_samples(samp, buf[out_idx], params->channels, params->format,
-		volume);
-	time += frame_period;
+    for (done = 0; done < nframes; done += n) {
+	/* the buffers live on the stack, so go in passes */
+	float mix[PCM_MIX_FRAMES][SNDBUF_CHANS];
+	float blk[PCM_MIX_FRAMES][SNDBUF_CHANS];
+
+	n = _min(nframes - done, PCM_MIX_FRAMES);
+	memset(mix, 0, sizeof(mix));
+	for (i = 0; i < pcm.num_streams; i++) {
+	    int j, k, muted = 1;
+	    if (pcm.stream[i].state == SNDBUF_STATE_INACTIVE ||
+		    !pcm.is_connected(PLAYER(p)->id, pcm.stream[i].vol_arg))
+		continue;
+	    /* the stream position advances even if it is muted */
+	    pcm_get_block(i, start_time + done * frame_period, frame_period,
+		    n, &idxs[i], params->channels, blk);
+	    for (j = 0; j < SNDBUF_CHANS; j++)
+		for (k = 0; k < SNDBUF_CHANS; k++)
+		    if (volume[i][j][k] != 0)
+			muted = 0;
+	    if (!muted)
+		pcm_mix_block(mix, blk, n, volume[i]);
+	}
+	pcm_mix_finish(mix, buf + done, n, params->channels, params->format);
     }
+    time = start_time + nframes * frame_period;
     if (fabs(time - stop_time) > frame_period)
 	error("PCM: time=%f stop_time=%f p=%f\n",
 		    time, stop_time, frame_period);
@@ -1104,10 +1219,7 @@ int pcm_data_get_interleaved(sndbuf_t buf[][SNDBUF_CHANS], int nframes,
 		params->channels, params->format, params->rate);
     }
 
-    if (out_idx != nframes)
-	error("PCM: requested=%i prepared=%i\n", nframes, out_idx);
-
-    return out_idx;
+    return nframes;
 }
 
 size_t pcm_data_get(void *data, size_t size,
@@ -1242,8 +1354,10 @@ void pcm_done(void)
     pcm_deinit_plugins(pcm.players, pcm.num_players);
     pcm_deinit_plugins(pcm.efps, pcm.num_efps);
 
-    for (i = 0; i < pcm.num_streams; i++)
+    for (i = 0; i < pcm.num_streams; i++) {
 	rng_destroy(&pcm.stream[i].buffer);
+	rng_destroy(&pcm.stream[i].chunks);
+    }
     pthread_mutex_destroy(&pcm.strm_mtx);
     pthread_mutex_destroy(&pcm.time_mtx);
 
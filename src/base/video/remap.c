@@ -35,7 +35,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
 #include <sys/mman.h>	/* mprotect() */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "vgaemu.h"
 #include "mapping.h"
@@ -52,9 +56,15 @@
 #ifdef REMAP_TEST
 RemapFuncDesc *remap_test(void);
 #endif
+#if defined(__x86_64__) || defined(__i386__)
+RemapFuncDesc *remap_simd(void);
+#endif
 RemapFuncDesc *remap_gen(void);
 
 RemapFuncDesc *(*remap_list_funcs[])(void) = {
+#if defined(__x86_64__) || defined(__i386__)
+  remap_simd,
+#endif
   remap_gen,
 #if 0
 #if defined(__i386__) && !defined(__clang__)
@@ -175,6 +185,9 @@ static RemapObject *_remap_init(int src_mode, int dst_mode, int features,
   ro->true_color_lut = NULL;
   ro->color_lut_size = 0;
   ro->bit_lut = NULL;
+  ro->col_x = NULL;
+  ro->line_buf = NULL;
+  ro->hicolor_lut = NULL;
   ro->gamma_lut = malloc(256 * (sizeof *ro->gamma_lut));
   for(u = 0; u < 256; u++)
     ro->gamma_lut[u] = gamma_fix(u, gamma);
@@ -315,6 +328,9 @@ static void _remap_done(RemapObject *ro)
   FreeIt(ro->true_color_lut)
   FreeIt(ro->bit_lut);
   FreeIt(ro->src_tmp_line);
+  FreeIt(ro->col_x);
+  FreeIt(ro->line_buf);
+  FreeIt(ro->hicolor_lut);
 #if 0
   if(ro->co != NULL) {
     code_done(ro->co);
@@ -3516,6 +3532,597 @@ void remapper_register(void)
   register_remapper(&rmcalls, REMAP_DOSEMU);
 }
 
+/*
+ * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ *
+ *                       AVX2 remap functions
+ *
+ * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+void simd_8to32_init(RemapObject *);
+void simd_bilin_init(RemapObject *);
+void simd_16to32_init(RemapObject *);
+
+void avx2_8to32_all(RemapObject *);
+void avx2_8to32_1(RemapObject *);
+void avx2_8to32_bilin(RemapObject *);
+void avx2_16to32_all(RemapObject *);
+void avx2_16to32_1(RemapObject *);
+
+/*
+ * The scaling functions expand each source line through the color
+ * lut once and then fetch the dst pixels by precomputed source
+ * column, both with gathers.  SSE2 has no gathers, so without AVX2
+ * the generic functions are used.  All are flagged RFF_OPT_PENTIUM
+ * so that find_best_remap_func() prefers them.
+ */
+static RemapFuncDesc remap_avx2_list[] = {
+
+  REMAP_DESC(
+    RFF_SCALE_ALL | RFF_REMAP_LINES | RFF_OPT_PENTIUM,
+    MODE_PSEUDO_8,
+    MODE_TRUE_32,
+    avx2_8to32_all,
+    simd_8to32_init
+  ),
+
+  REMAP_DESC(
+    RFF_SCALE_1 | RFF_REMAP_RECT | RFF_OPT_PENTIUM,
+    MODE_PSEUDO_8,
+    MODE_TRUE_32,
+    avx2_8to32_1,
+    NULL
+  ),
+
+  REMAP_DESC(
+    RFF_SCALE_ALL | RFF_REMAP_LINES | RFF_BILIN_FILT | RFF_OPT_PENTIUM,
+    MODE_PSEUDO_8,
+    MODE_TRUE_32,
+    avx2_8to32_bilin,
+    simd_bilin_init
+  ),
+
+  REMAP_DESC(
+    RFF_SCALE_ALL | RFF_REMAP_LINES | RFF_OPT_PENTIUM,
+    MODE_TRUE_15 | MODE_TRUE_16,
+    MODE_TRUE_32,
+    avx2_16to32_all,
+    simd_16to32_init
+  ),
+
+  REMAP_DESC(
+    RFF_SCALE_1 | RFF_REMAP_LINES | RFF_OPT_PENTIUM,
+    MODE_TRUE_15 | MODE_TRUE_16,
+    MODE_TRUE_32,
+    avx2_16to32_1,
+    simd_16to32_init
+  ),
+
+};
+
+#ifdef REMAP_BENCH
+static void remap_simd_bench(RemapFuncDesc *, int);
+#endif
+
+/*
+ * returns chained list of modes, or NULL if the cpu has no AVX2
+ */
+RemapFuncDesc *remap_simd(void)
+{
+  RemapFuncDesc *list;
+  int i, n;
+
+  __builtin_cpu_init();
+  if(!__builtin_cpu_supports("avx2"))
+    return NULL;
+  list = remap_avx2_list;
+  n = sizeof(remap_avx2_list) / sizeof(*remap_avx2_list);
+
+#ifdef REMAP_BENCH
+  /* runs before do_base_init() links remap_gen's list behind ours */
+  remap_simd_bench(list, n);
+#endif
+
+  for(i = 0; i < n - 1; i++) {
+    list[i].next = list + i + 1;
+  }
+
+  return list;
+}
+
+/*
+ * Size the column index table and the buffer for the lut-expanded
+ * source line(s).
+ */
+static int simd_buf_init(RemapObject *ro, int cols, int line_len)
+{
+  int *col;
+  unsigned *buf;
+
+  col = realloc(ro->col_x, (cols ? cols : 1) * sizeof(*col));
+  if(col == NULL) {
+    ro->state |= ROS_MALLOC_FAIL;
+    return 0;
+  }
+  ro->col_x = col;
+
+  buf = realloc(ro->line_buf, line_len * sizeof(*buf));
+  if(buf == NULL) {
+    ro->state |= ROS_MALLOC_FAIL;
+    return 0;
+  }
+  ro->line_buf = buf;
+
+  return 1;
+}
+
+/*
+ * Turn the bre_x steps into absolute source columns, so that the
+ * dst pixels of a line no longer depend on each other.
+ */
+static void simd_col_init(RemapObject *ro, int *col)
+{
+  int i, s_x;
+
+  for(s_x = i = 0; i < ro->dst_width; i++) {
+    col[i] = s_x;
+    s_x += ro->bre_x[i];
+  }
+}
+
+void simd_8to32_init(RemapObject *ro)
+{
+  if(simd_buf_init(ro, ro->dst_width, ro->src_width))
+    simd_col_init(ro, ro->col_x);
+}
+
+/*
+ * 15/16 bit pixels go through a 64k entry lut; the lut only depends
+ * on the dst color space, so it is kept for the life of the object
+ */
+void simd_16to32_init(RemapObject *ro)
+{
+  int gbits = ro->src_mode == MODE_TRUE_15 ? 5 : 6;
+  unsigned u;
+
+  if(simd_buf_init(ro, ro->dst_width, ro->src_width))
+    simd_col_init(ro, ro->col_x);
+
+  if(ro->hicolor_lut == NULL) {
+    ro->hicolor_lut = malloc(0x10000 * sizeof(*ro->hicolor_lut));
+    if(ro->hicolor_lut == NULL) {
+      ro->state |= ROS_MALLOC_FAIL;
+      return;
+    }
+    for(u = 0; u < 0x10000; u++)
+      ro->hicolor_lut[u] = bgr_2int(ro->dst_color_space, 5, gbits, 5, u);
+  }
+}
+
+/*
+ * gather one line of dst pixels from a lut-expanded source line
+ */
+__attribute__((target("avx2")))
+static inline void avx2_line_gather(unsigned *dst, const unsigned *line,
+    const int *col, int d_x_len)
+{
+  int d_x;
+
+  for(d_x = 0; d_x + 8 <= d_x_len; d_x += 8) {
+    _mm256_storeu_si256((__m256i *) (dst + d_x), _mm256_i32gather_epi32(
+      (const int *) line, _mm256_loadu_si256((const __m256i *) (col + d_x)), 4
+    ));
+  }
+  for(; d_x < d_x_len; d_x++) {
+    dst[d_x] = line[col[d_x]];
+  }
+}
+
+/*
+ * 8 bit pseudo color --> 32 bit true color
+ * supports arbitrary scaling
+ */
+__attribute__((target("avx2")))
+void avx2_8to32_all(RemapObject *ro)
+{
+  int s_x, d_y;
+  int s_x_len = ro->src_width, d_x_len = ro->dst_width;
+  int d_scan_len = ro->dst_scan_len >> 2;
+  const int *lut = (const int *) ro->true_color_lut;
+  unsigned *line = ro->line_buf;
+  __m256i px;
+
+  const unsigned char *src, *src0, *src_last;
+  unsigned *dst;
+
+  src0 = ro->src_image + ro->src_start;
+  dst = (unsigned *) (ro->dst_image + ro->dst_start + ro->dst_offset);
+  src_last = NULL;
+
+  for(d_y = ro->dst_y0; d_y < ro->dst_y1; dst += d_scan_len) {
+    src = src0 + ro->bre_y[d_y++];
+    if(src != src_last) {
+      src_last = src;
+      for(s_x = 0; s_x + 8 <= s_x_len; s_x += 8) {
+        px = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + s_x)));
+        _mm256_storeu_si256((__m256i *) (line + s_x), _mm256_i32gather_epi32(lut, px, 4));
+      }
+      for(; s_x < s_x_len; s_x++) line[s_x] = ro->true_color_lut[src[s_x]];
+    }
+    avx2_line_gather(dst, line, ro->col_x, d_x_len);
+  }
+}
+
+/*
+ * 8 bit pseudo color --> 32 bit true color
+ */
+__attribute__((target("avx2")))
+void avx2_8to32_1(RemapObject *ro)
+{
+  int i, j, l;
+  const unsigned char *src;
+  const int *lut = (const int *) ro->true_color_lut;
+  unsigned *dst;
+  __m256i px;
+
+  src = ro->src_image + ro->src_start + ro->src_offset;
+  dst = (unsigned *) (ro->dst_image + ro->dst_start + ro->dst_offset);
+  l = (ro->src_x1 - ro->src_x0);
+
+  for(j = ro->src_y0; j < ro->src_y1; j++) {
+    for(i = 0; i + 8 <= l; i += 8) {
+      px = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + i)));
+      _mm256_storeu_si256((__m256i *) (dst + i), _mm256_i32gather_epi32(lut, px, 4));
+    }
+    for(; i < l; i++) {
+      dst[i] = ro->true_color_lut[src[i]];
+    }
+    dst += ro->dst_scan_len >> 2;
+    src += ro->src_scan_len;
+  }
+}
+
+/*
+ * The bilinear filter adds up to four lut entries per dst pixel
+ * (cf. gen_8to32_bilin).  Each source line is expanded through the
+ * six filter luts, followed by a zero entry for unused taps.  This
+ * table gives, per [row phase][tap][column phase], which expanded
+ * line each of the taps src[s_x], src[s_x + 1], src[s_x + s_scan_len]
+ * and src[s_x + s_scan_len + 1] comes from; -1 marks an unused tap.
+ * simd_bilin_init() turns it into one index table per row phase and
+ * tap, so the remap functions need neither branches nor masks.
+ */
+static const int simd_bilin_lut_ofs[6] = {
+  0, LUT_OFS_33, LUT_OFS_67, LUT_OFS_11, LUT_OFS_22, LUT_OFS_45
+};
+
+static const signed char simd_bilin_tap[3][4][3] = {
+  { { 0, 2, 1 }, { -1, 1, 2 }, { -1, -1, -1 }, { -1, -1, -1 } },
+  { { 2, 5, 4 }, { -1, 4, 5 }, {  1, 4,  3 }, { -1,  3,  4 } },
+  { { 1, 4, 3 }, { -1, 3, 4 }, {  2, 5,  4 }, { -1,  4,  5 } }
+};
+
+#define SIMD_BILIN_LINE(w)	(6 * ((w) + 1) + 1)
+
+/*
+ * col_x holds the 12 index tables, followed by the mask of luts
+ * each row phase refers to
+ */
+#define SIMD_BILIN_MASK(ro, r)	((ro)->col_x[12 * (ro)->dst_width + (r)])
+
+void simd_bilin_init(RemapObject *ro)
+{
+  int d_x, s_x, r, k, p, l = ro->dst_width, stride = ro->src_width + 1;
+  int *ix;
+
+  if(!simd_buf_init(ro, 12 * l + 3, 2 * SIMD_BILIN_LINE(ro->src_width)))
+    return;
+
+  for(r = 0; r < 3; r++) {
+    SIMD_BILIN_MASK(ro, r) = 0;
+    for(k = 0; k < 4; k++) {
+      ix = ro->col_x + (r * 4 + k) * l;
+      for(s_x = d_x = 0; d_x < l; s_x += ro->bre_x[d_x++]) {
+        p = simd_bilin_tap[r][k][ro->bre_x[l + d_x]];
+        if(p < 0) {
+          ix[d_x] = 6 * stride;
+        }
+        else {
+          ix[d_x] = p * stride + s_x + (k & 1);
+          SIMD_BILIN_MASK(ro, r) |= 1 << p;
+        }
+      }
+    }
+  }
+}
+
+/*
+ * expand the luts in mask (bit k: simd_bilin_lut_ofs[k]) of one line
+ */
+static void simd_bilin_expand(const unsigned *lut, const unsigned char *src,
+    unsigned *line, int s_x_len, int mask)
+{
+  int k, s_x;
+
+  for(k = 0; k < 6; k++, line += s_x_len + 1) {
+    if(!(mask & (1 << k))) continue;
+    for(s_x = 0; s_x < s_x_len; s_x++)
+      line[s_x] = lut[src[s_x] + simd_bilin_lut_ofs[k]];
+    /* right neighbour of the last pixel, never used with weight > 0 */
+    line[s_x_len] = line[s_x_len - 1];
+  }
+  *line = 0;
+}
+
+struct simd_bilin_line {
+  unsigned *buf;
+  const unsigned char *src;
+  int mask;
+};
+
+/*
+ * Expand the source lines of dst line d_y into l[0] (and l[1] if it
+ * has a vertical phase), reusing what the previous dst line had;
+ * returns the row phase.
+ */
+static int simd_bilin_lines(RemapObject *ro, int d_y, struct simd_bilin_line *l)
+{
+  const unsigned char *src = ro->src_image + ro->src_start + ro->bre_y[d_y];
+  struct simd_bilin_line t;
+  int r = ro->bre_y[d_y + ro->dst_height];
+  int need = SIMD_BILIN_MASK(ro, r);
+
+  if(src != l[0].src && src == l[1].src) {
+    t = l[0]; l[0] = l[1]; l[1] = t;
+  }
+  if(src != l[0].src) {
+    l[0].src = src;
+    l[0].mask = 0;
+  }
+  if(need & ~l[0].mask) {
+    simd_bilin_expand(ro->true_color_lut, src, l[0].buf, ro->src_width, need & ~l[0].mask);
+    l[0].mask |= need;
+  }
+
+  if(r) {
+    src += ro->src_scan_len;
+    if(src != l[1].src) {
+      l[1].src = src;
+      l[1].mask = 0;
+    }
+    if(need & ~l[1].mask) {
+      simd_bilin_expand(ro->true_color_lut, src, l[1].buf, ro->src_width, need & ~l[1].mask);
+      l[1].mask |= need;
+    }
+  }
+
+  return r;
+}
+
+/*
+ * 8 bit pseudo color --> 32 bit true color
+ * supports arbitrary scaling
+ */
+__attribute__((target("avx2")))
+void avx2_8to32_bilin(RemapObject *ro)
+{
+  int d_x, d_y, r;
+  int d_x_len = ro->dst_width;
+  int d_scan_len = ro->dst_scan_len >> 2;
+  const int *i0, *i1, *i2, *i3;
+  struct simd_bilin_line l[2] = {
+    { ro->line_buf, NULL, 0 },
+    { ro->line_buf + SIMD_BILIN_LINE(ro->src_width), NULL, 0 }
+  };
+  __m256i c;
+  unsigned *dst;
+
+#define GATHER(L, I) _mm256_i32gather_epi32((const int *) (L), \
+  _mm256_loadu_si256((const __m256i *) ((I) + d_x)), 4)
+
+  dst = (unsigned *) (ro->dst_image + ro->dst_start + ro->dst_offset);
+
+  for(d_y = ro->dst_y0; d_y < ro->dst_y1; d_y++, dst += d_scan_len) {
+    r = simd_bilin_lines(ro, d_y, l);
+    i0 = ro->col_x + r * 4 * d_x_len;
+    i1 = i0 + d_x_len;
+    i2 = i1 + d_x_len;
+    i3 = i2 + d_x_len;
+    if(r) {
+      for(d_x = 0; d_x + 8 <= d_x_len; d_x += 8) {
+        c = _mm256_add_epi32(GATHER(l[0].buf, i0), GATHER(l[0].buf, i1));
+        c = _mm256_add_epi32(c, _mm256_add_epi32(GATHER(l[1].buf, i2), GATHER(l[1].buf, i3)));
+        _mm256_storeu_si256((__m256i *) (dst + d_x), c);
+      }
+      for(; d_x < d_x_len; d_x++)
+        dst[d_x] = l[0].buf[i0[d_x]] + l[0].buf[i1[d_x]] + l[1].buf[i2[d_x]] + l[1].buf[i3[d_x]];
+    }
+    else if(SIMD_BILIN_MASK(ro, 0) == 1) {
+      /* no horizontal phases either: plain lut lookup */
+      for(d_x = 0; d_x + 8 <= d_x_len; d_x += 8)
+        _mm256_storeu_si256((__m256i *) (dst + d_x), GATHER(l[0].buf, i0));
+      for(; d_x < d_x_len; d_x++)
+        dst[d_x] = l[0].buf[i0[d_x]];
+    }
+    else {
+      for(d_x = 0; d_x + 8 <= d_x_len; d_x += 8) {
+        c = _mm256_add_epi32(GATHER(l[0].buf, i0), GATHER(l[0].buf, i1));
+        _mm256_storeu_si256((__m256i *) (dst + d_x), c);
+      }
+      for(; d_x < d_x_len; d_x++)
+        dst[d_x] = l[0].buf[i0[d_x]] + l[0].buf[i1[d_x]];
+    }
+  }
+
+#undef GATHER
+}
+
+/*
+ * 15/16 bit true color --> 32 bit true color
+ * supports arbitrary scaling
+ */
+__attribute__((target("avx2")))
+void avx2_16to32_all(RemapObject *ro)
+{
+  int s_x, d_y;
+  int s_x_len = ro->src_width, d_x_len = ro->dst_width;
+  int d_scan_len = ro->dst_scan_len >> 2;
+  const int *lut = (const int *) ro->hicolor_lut;
+  unsigned *line = ro->line_buf;
+  __m256i px;
+
+  const unsigned char *src0;
+  const unsigned short *src, *src_last;
+  unsigned *dst;
+
+  src0 = ro->src_image + ro->src_start;
+  dst = (unsigned *) (ro->dst_image + ro->dst_start + ro->dst_offset);
+  src_last = NULL;
+
+  for(d_y = ro->dst_y0; d_y < ro->dst_y1; dst += d_scan_len) {
+    src = (const unsigned short *) (src0 + ro->bre_y[d_y++]);
+    if(src != src_last) {
+      src_last = src;
+      for(s_x = 0; s_x + 8 <= s_x_len; s_x += 8) {
+        px = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (src + s_x)));
+        _mm256_storeu_si256((__m256i *) (line + s_x), _mm256_i32gather_epi32(lut, px, 4));
+      }
+      for(; s_x < s_x_len; s_x++) line[s_x] = ro->hicolor_lut[src[s_x]];
+    }
+    avx2_line_gather(dst, line, ro->col_x, d_x_len);
+  }
+}
+
+/*
+ * 15/16 bit true color --> 32 bit true color
+ */
+__attribute__((target("avx2")))
+void avx2_16to32_1(RemapObject *ro)
+{
+  int i, j, l = ro->dst_width;
+  const unsigned char *src;
+  unsigned char *dst;
+  const unsigned short *src_2;
+  const int *lut = (const int *) ro->hicolor_lut;
+  unsigned *dst_4;
+  __m256i px;
+
+  src = ro->src_image + ro->src_start + ro->src_offset;
+  dst = ro->dst_image + ro->dst_start + ro->dst_offset;
+
+  for(j = ro->src_y0; j < ro->src_y1; j++) {
+    src_2 = (const unsigned short *) src;
+    dst_4 = (unsigned *) dst;
+    for(i = 0; i + 8 <= l; i += 8) {
+      px = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) (src_2 + i)));
+      _mm256_storeu_si256((__m256i *) (dst_4 + i), _mm256_i32gather_epi32(lut, px, 4));
+    }
+    for(; i < l; i++) {
+      dst_4[i] = ro->hicolor_lut[src_2[i]];
+    }
+    src += ro->src_scan_len;
+    dst += ro->dst_scan_len;
+  }
+}
+
+#ifdef REMAP_BENCH
+/*
+ * Time each SIMD function against its generic counterpart on a
+ * 640x480 source, 1:1 and scaled to 1920x1080, and check that
+ * both produce the same image.
+ */
+static double remap_bench_run(RemapObject *ro, void (*func)(RemapObject *))
+{
+  struct timespec t0, t1;
+  int i, n = 20;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(i = 0; i < n; i++) func(ro);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  return (double) n * ro->dst_width * ro->dst_height /
+    ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+}
+
+static void remap_simd_bench(RemapFuncDesc *list, int n)
+{
+  static const ColorSpaceDesc csd = {
+    32, 0xff0000, 0xff00, 0xff, 16, 8, 0, 8, 8, 8, NULL
+  };
+  RemapFuncDesc *ref;
+  RemapObject ro;
+  unsigned char *src, *dst1, *dst2;
+  int i, j, dw, dh, size;
+  double mp0, mp1;
+
+  memset(&ro, 0, sizeof(ro));
+  ro.dst_color_space = &csd;
+  ro.src_width = 640;
+  ro.src_height = 480;
+  ro.src_x1 = ro.src_width;
+  ro.src_y1 = ro.src_height;
+  ro.true_color_lut = malloc(8 * 256 * sizeof(*ro.true_color_lut));
+  src = malloc(ro.src_width * ro.src_height * 2 + 4);
+  dst1 = malloc(1920 * 1080 * 4);
+  dst2 = malloc(1920 * 1080 * 4);
+  for(i = 0; i < 8 * 256; i++) ro.true_color_lut[i] = i * 0x010203;
+  for(i = 0; i < ro.src_width * ro.src_height * 2 + 4; i++) src[i] = rand();
+  ro.src_image = src;
+
+  for(i = 0; i < n; i++) {
+    ro.src_mode = list[i].src_mode & -list[i].src_mode;
+    ro.src_scan_len = ro.src_width * (ro.src_mode == MODE_PSEUDO_8 ? 1 : 2);
+    ref = find_remap_func(list[i].flags & ~RFF_OPT_PENTIUM, ro.src_mode,
+      MODE_TRUE_32, remap_gen());
+    if(ref == NULL) continue;
+
+    for(j = 0; j < 2; j++) {
+      dw = j && (list[i].flags & RFF_SCALE_ALL) ? 1920 : ro.src_width;
+      dh = j && (list[i].flags & RFF_SCALE_ALL) ? 1080 : ro.src_height;
+      if(j && dw == ro.src_width) break;
+      ro.dst_width = dw;
+      ro.dst_height = dh;
+      ro.dst_scan_len = dw * 4;
+      ro.dst_y1 = dh;
+      size = dw * dh * 4;
+      if(list[i].flags & RFF_BILIN_FILT)
+        bre_bilin_filt_update(&ro);
+      else
+        bre_update(&ro);
+      if(list[i].func_init) list[i].func_init(&ro);
+
+      memset(dst1, 0, size);
+      memset(dst2, 0, size);
+      ro.dst_image = dst1;
+      mp0 = remap_bench_run(&ro, ref->func);
+      ro.dst_image = dst2;
+      mp1 = remap_bench_run(&ro, list[i].func);
+      fprintf(stderr, "remap bench: %-18s %4dx%-4d %8.1f Mpixels/s, %-16s %8.1f Mpixels/s%s\n",
+        ref->func_name, dw, dh, mp0, list[i].func_name, mp1,
+        memcmp(dst1, dst2, size) ? " MISMATCH" : ""
+      );
+    }
+  }
+
+  free(ro.bre_x);
+  free(ro.bre_y);
+  free(ro.col_x);
+  free(ro.line_buf);
+  free(ro.hicolor_lut);
+  free(ro.true_color_lut);
+  free(src);
+  free(dst1);
+  free(dst2);
+}
+#endif
+
+#endif
+
 /*
  * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
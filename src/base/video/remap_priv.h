@@ -16,6 +16,7 @@
 #undef	REMAP_RESIZE_DEBUG
 #undef	REMAP_AREA_DEBUG
 #undef	REMAP_TEST		/* Do not define! -- sw */
+#undef	REMAP_BENCH		/* time the AVX2 remap functions at startup */
 
 /*
  * define to use a 'real' 2x2 dither when using a shared color map
@@ -86,6 +87,9 @@ typedef struct RemapObjectStruct {
   RemapFuncDesc *func_all;
   RemapFuncDesc *func_1;
   RemapFuncDesc *func_2;
+  int *col_x;			/* source column of each dst pixel (SIMD funcs) */
+  unsigned *line_buf;		/* lut-expanded source lines (SIMD funcs) */
+  unsigned *hicolor_lut;	/* 15/16 bit --> dst color (SIMD funcs) */
 } RemapObject;
 
 /*
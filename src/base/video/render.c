@@ -44,6 +44,46 @@ static void do_rend_text(void);
 static int remap_mode(void);
 static void bitmap_refresh_pal(void *opaque, DAC_entry *col, int index);
 
+#if RENDER_THREADED
+/*
+ * Large gfx updates are split into horizontal bands that are remapped
+ * in parallel.  Band 0 runs in the render thread, the others in
+ * helper threads.  Every band has its own remap object, as those keep
+ * per-call scratch state (scaling tables, tmp lines, ...).
+ */
+#define MAX_BANDS 4
+#define BAND_MIN_LINES 64	/* don't split updates smaller than this */
+
+struct band_rect {
+  int rend_idx;
+  RectArea rect;
+};
+
+struct render_band {
+  pthread_t thr;
+  sem_t go;
+  struct remap_object *remap;
+  int first, last;		/* range of dirty lines, see band_remap() */
+  struct band_rect *rects;
+  int num_rects, max_rects;
+};
+
+struct band_lines {
+  int first, last;
+};
+
+static struct render_band bands[MAX_BANDS];
+static int num_bands = 1;
+static sem_t bands_finished;
+static struct band_lines *band_lines;
+static int num_band_lines, max_band_lines, band_lines_total;
+static struct {
+  struct bitmap_desc src_img;
+  int src_mode;
+  int src_start;
+} band_job;
+#endif
+
 struct rs_wrp {
     struct render_system *render;
     int locked;
@@ -236,6 +276,13 @@ int remapper_init(int have_true_color, int have_shmap, int features,
 
   remap_src_modes = find_supported_modes(ximage_mode);
   Render.gfx_remap = remap_init(ximage_mode, features, csd);
+#if RENDER_THREADED
+  if (num_bands > 1) {
+    int i;
+    for (i = 0; i < num_bands; i++)
+      bands[i].remap = remap_init(ximage_mode, features, csd);
+  }
+#endif
   /* linear 1 byte per pixel */
   Render.text_remap = remap_init(ximage_mode, features, csd);
   register_text_system(&Text_bitmap);
@@ -264,6 +311,66 @@ static void *render_thread(void *arg)
   }
   return NULL;
 }
+
+static void band_remap(struct render_band *b);
+
+static void *band_thread(void *arg)
+{
+  struct render_band *b = arg;
+
+  while (1) {
+    sem_wait(&b->go);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    band_remap(b);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    sem_post(&bands_finished);
+  }
+  return NULL;
+}
+
+static void bands_init(void)
+{
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int i, err;
+
+  num_bands = ncpu > MAX_BANDS ? MAX_BANDS : (ncpu > 1 ? ncpu : 1);
+  if (num_bands == 1)
+    return;
+  err = sem_init(&bands_finished, 0, 0);
+  assert(!err);
+  for (i = 1; i < num_bands; i++) {
+    err = sem_init(&bands[i].go, 0, 0);
+    assert(!err);
+    err = pthread_create(&bands[i].thr, NULL, band_thread, &bands[i]);
+    assert(!err);
+#if defined(HAVE_PTHREAD_SETNAME_NP) && defined(__GLIBC__)
+    pthread_setname_np(bands[i].thr, "dosemu: rband");
+#endif
+  }
+  v_printf("render: using %i threads for gfx updates\n", num_bands);
+}
+
+static void bands_done(void)
+{
+  int i;
+
+  for (i = 1; i < num_bands; i++) {
+    pthread_cancel(bands[i].thr);
+    pthread_join(bands[i].thr, NULL);
+    sem_destroy(&bands[i].go);
+  }
+  if (num_bands > 1)
+    sem_destroy(&bands_finished);
+  for (i = 0; i < num_bands; i++) {
+    free(bands[i].rects);
+    bands[i].rects = NULL;
+    bands[i].num_rects = bands[i].max_rects = 0;
+  }
+  free(band_lines);
+  band_lines = NULL;
+  max_band_lines = 0;
+  num_bands = 1;
+}
 #endif
 
 int render_init(void)
@@ -277,6 +384,7 @@ int render_init(void)
   pthread_setname_np(render_thr, "dosemu: render");
 #endif
   assert(!err);
+  bands_init();
 #endif
   initialized++;
   return err;
@@ -294,6 +402,7 @@ void render_done(void)
   pthread_cancel(render_thr);
   pthread_join(render_thr, NULL);
   sem_destroy(&render_sem);
+  bands_done();
 #endif
 }
 
@@ -304,6 +413,16 @@ void remapper_done(void)
     remap_done(Render.text_remap);
   if (Render.gfx_remap)
     remap_done(Render.gfx_remap);
+#if RENDER_THREADED
+  {
+    int i;
+    for (i = 0; i < MAX_BANDS; i++) {
+      if (bands[i].remap)
+        remap_done(bands[i].remap);
+      bands[i].remap = NULL;
+    }
+  }
+#endif
 }
 
 /*
@@ -320,6 +439,16 @@ static void refresh_truecolor(DAC_entry *col, int index, void *udata)
 {
   struct remap_object *ro = udata;
   remap_palette_update(ro, index, vga.dac.bits, col->r, col->g, col->b);
+#if RENDER_THREADED
+  if (ro == Render.gfx_remap) {
+    int i;
+    for (i = 0; i < num_bands; i++) {
+      if (bands[i].remap)
+        remap_palette_update(bands[i].remap, index, vga.dac.bits,
+            col->r, col->g, col->b);
+    }
+  }
+#endif
 }
 
 /* returns True if the screen needs to be redrawn */
@@ -452,12 +581,147 @@ static void modify_mode(void)
 }
 
 
+#if RENDER_THREADED
+/*
+ * Record a dirty range as whole scan lines.  vga_emu_update() returns
+ * the ranges in ascending order, so overlapping ones are merged here
+ * and no line ends up in two bands.
+ */
+static void band_add(int offset, int len)
+{
+  struct band_lines *bl;
+  int first, last;
+
+  if (offset < 0) {
+    len += offset;
+    offset = 0;
+  }
+  if (len <= 0)
+    return;
+  first = offset / vga.scan_len;
+  last = (offset + len + vga.scan_len - 1) / vga.scan_len;
+  if (last > vga.height)
+    last = vga.height;
+  if (first >= last)
+    return;
+
+  bl = num_band_lines ? &band_lines[num_band_lines - 1] : NULL;
+  if (bl && first <= bl->last) {
+    if (last > bl->last) {
+      band_lines_total += last - bl->last;
+      bl->last = last;
+    }
+    return;
+  }
+  if (num_band_lines == max_band_lines) {
+    max_band_lines = max_band_lines ? max_band_lines * 2 : 64;
+    band_lines = realloc(band_lines, max_band_lines * sizeof(*band_lines));
+    assert(band_lines);
+  }
+  band_lines[num_band_lines].first = first;
+  band_lines[num_band_lines].last = last;
+  num_band_lines++;
+  band_lines_total += last - first;
+}
+
+/*
+ * Remap dirty lines b->first to b->last, counted over all recorded
+ * ranges, with the band's own remap object.  The dst rects are kept
+ * and handed to the renders after all bands are done.
+ */
+static void band_remap(struct render_band *b)
+{
+  int i, j, pos, y0, y1;
+  RectArea ra;
+
+  b->num_rects = 0;
+  for (i = pos = 0; i < num_band_lines && pos < b->last; i++) {
+    struct band_lines *bl = &band_lines[i];
+    y0 = _max(bl->first, bl->first + b->first - pos);
+    y1 = _min(bl->last, bl->first + b->last - pos);
+    pos += bl->last - bl->first;
+    if (y0 >= y1)
+      continue;
+    for (j = 0; j < Render.num_renders; j++) {
+      if (!Render.wrp[j].locked)
+        continue;
+      ra = b->remap->calls->remap_mem(b->remap->priv, band_job.src_img,
+          band_job.src_mode, band_job.src_start, y0 * vga.scan_len,
+          (y1 - y0) * vga.scan_len, Render.dst_image[j]);
+      if (!ra.width)
+        continue;
+      if (b->num_rects == b->max_rects) {
+        b->max_rects = b->max_rects ? b->max_rects * 2 : 16;
+        b->rects = realloc(b->rects, b->max_rects * sizeof(*b->rects));
+        assert(b->rects);
+      }
+      b->rects[b->num_rects].rend_idx = j;
+      b->rects[b->num_rects].rect = ra;
+      b->num_rects++;
+    }
+  }
+}
+
+static void remap_bands(struct bitmap_desc src_img, int src_mode,
+    int src_start)
+{
+  int i, j, per;
+
+  check_locked();
+  band_job.src_img = src_img;
+  band_job.src_mode = src_mode;
+  band_job.src_start = src_start;
+  per = (band_lines_total + num_bands - 1) / num_bands;
+  for (i = 0; i < num_bands; i++) {
+    bands[i].first = _min(i * per, band_lines_total);
+    bands[i].last = _min((i + 1) * per, band_lines_total);
+  }
+  for (i = 1; i < num_bands; i++)
+    sem_post(&bands[i].go);
+  band_remap(&bands[0]);
+  for (i = 1; i < num_bands; i++)
+    sem_wait(&bands_finished);
+
+  pthread_mutex_lock(&render_mtx);
+  for (i = 0; i < num_bands; i++) {
+    for (j = 0; j < bands[i].num_rects; j++)
+      render_rect_add(bands[i].rects[j].rend_idx, bands[i].rects[j].rect);
+  }
+  pthread_mutex_unlock(&render_mtx);
+}
+#endif
+
 static void update_graphics_loop(unsigned display_start,
 	unsigned display_end, int src_offset,
 	int update_offset, vga_emu_update_type *veut)
 {
   int i = -1;
 
+#if RENDER_THREADED
+  /* CGA and hercules memory is interleaved, keep them serial */
+  if (num_bands > 1 && bands[0].remap &&
+      !(remap_mode() & (MODE_CGA_1 | MODE_CGA_2 | MODE_HERC))) {
+    num_band_lines = band_lines_total = 0;
+    while ((i = vga_emu_update(veut, display_start + src_offset + update_offset,
+        display_end, i)) != -1)
+      band_add(update_offset + veut->update_start - display_start,
+          veut->update_len);
+    if (band_lines_total >= BAND_MIN_LINES) {
+      remap_bands(BMP(vga.mem.base + display_start,
+          vga.width, vga.height, vga.scan_len), remap_mode(), src_offset);
+      return;
+    }
+    for (i = 0; i < num_band_lines; i++) {
+      remap_remap_mem(Render.gfx_remap, BMP(vga.mem.base + display_start,
+                             vga.width, vga.height, vga.scan_len),
+                             remap_mode(), src_offset,
+                             band_lines[i].first * vga.scan_len,
+                             (band_lines[i].last - band_lines[i].first) *
+                             vga.scan_len);
+    }
+    return;
+  }
+#endif
   while ((i = vga_emu_update(veut, display_start + src_offset + update_offset,
       display_end, i)) != -1) {
     remap_remap_mem(Render.gfx_remap, BMP(vga.mem.base + display_start,
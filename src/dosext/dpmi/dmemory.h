@@ -9,6 +9,14 @@
 
 typedef struct dpmi_pm_block_stuct {
   struct   dpmi_pm_block_stuct *next;
+  struct   dpmi_pm_block_stuct *prev;
+  /* handle hash chain */
+  struct   dpmi_pm_block_stuct *hnext;
+  /* address tree: AVL by base, with the highest last address below */
+  struct   dpmi_pm_block_stuct *left;
+  struct   dpmi_pm_block_stuct *right;
+  int height;
+  dosaddr_t max_last;
   unsigned int handle;
   unsigned int size;
   dosaddr_t base;
@@ -16,6 +24,7 @@ typedef struct dpmi_pm_block_stuct {
   unsigned int linear:1;
   unsigned int hwram:1;
   unsigned int shm:1;
+  unsigned int indexed:1;
   char *shmname;
   char *rshmname;
   char *shm_dir;
@@ -31,6 +40,10 @@ typedef struct dpmi_pm_block_stuct {
 
 typedef struct dpmi_pm_block_root_struc {
   dpmi_pm_block *first_pm_block;
+  dpmi_pm_block **hash;
+  unsigned int hash_size;
+  unsigned int count;
+  dpmi_pm_block *tree;		/* mapped blocks only */
 } dpmi_pm_block_root;
 
 dpmi_pm_block *lookup_pm_block(dpmi_pm_block_root *root, unsigned long h);
@@ -106,7 +106,25 @@ static struct {
 #define segment_get(x, f) seg_meta[x].f
 #define segment_set(x, y, f) (seg_meta[x].f = (y))
 #define segment_user(x) segment_get(x, user)
-#define segment_set_user(x, y) segment_set(x, y, user)
+/* bit set for every entry with a user, and for those of every client */
+static uint32_t seg_used_map[MAX_SELECTORS / 32];
+static uint32_t seg_client_map[DPMI_MAX_CLIENTS][MAX_SELECTORS / 32];
+
+static void segment_set_user(int x, int user)
+{
+  int old = segment_user(x);
+  uint32_t bit = 1U << (x & 0x1f);
+
+  if (old && old <= DPMI_MAX_CLIENTS)
+    seg_client_map[old - 1][x >> 5] &= ~bit;
+  if (user && user <= DPMI_MAX_CLIENTS)
+    seg_client_map[user - 1][x >> 5] |= bit;
+  if (user)
+    seg_used_map[x >> 5] |= bit;
+  else
+    seg_used_map[x >> 5] &= ~bit;
+  segment_set(x, user, user);
+}
 static int in_dpmi;/* Set to 1 when running under DPMI */
 static int dpmi_pm;
 static int in_dpmi_irq;
@@ -846,25 +864,48 @@ static unsigned short AllocateDescriptorsAt(unsigned short selector,
   return selector;
 }
 
+/* first-fit search for a run of num free entries, a word at a time */
+static int find_free_descriptors(int first, int num)
+{
+  int i = first, start;
+  uint32_t w;
+
+  while (i <= MAX_SELECTORS - num) {
+    w = seg_used_map[i >> 5] >> (i & 0x1f);
+    if (w & 1) {
+      /* skip the used ones */
+      i += ~w ? find_bit(~w) : 32;
+      continue;
+    }
+    start = i;
+    while (i < start + num) {
+      w = seg_used_map[i >> 5] >> (i & 0x1f);
+      if (!w) {
+        i += 32 - (i & 0x1f);
+        continue;
+      }
+      i += find_bit(w);
+      break;
+    }
+    if (i >= start + num)
+      return start;
+  }
+  return -1;
+}
+
 static unsigned short allocate_descriptors_from(int first_ldt, int number_of_descriptors)
 {
-  int next_ldt=first_ldt, i;
+  int next_ldt;
   unsigned short selector;
-  unsigned char used = 1;
 #if 0
   if (number_of_descriptors > MAX_SELECTORS - 0x100)
     number_of_descriptors = MAX_SELECTORS - 0x100;
 #endif
-  while (used) {
-    next_ldt++;
-    if (next_ldt > MAX_SELECTORS-number_of_descriptors) {
-      D_printf("DPMI: Insufficient descriptors, requested %i\n",
-        number_of_descriptors);
-      return 0;
-    }
-    used = 0;
-    for (i = 0; i < number_of_descriptors; i++)
-      used |= segment_user(next_ldt+i) || SystemSelector(((next_ldt+i)<<3)|7);
+  next_ldt = find_free_descriptors(first_ldt + 1, number_of_descriptors);
+  if (next_ldt == -1) {
+    D_printf("DPMI: Insufficient descriptors, requested %i\n",
+      number_of_descriptors);
+    return 0;
   }
   selector = (next_ldt<<3) | 0x0007;
   if (allocate_descriptors_at(selector, number_of_descriptors) !=
@@ -929,10 +970,16 @@ int FreeDescriptor(unsigned short selector)
 
 static void FreeAllDescriptors(void)
 {
-    int i;
-    for (i=0;i<MAX_SELECTORS;i++) {
-      if (segment_user(i) == current_client + 1)
-        FreeDescriptor((i << 3) | 7);
+    int i, j;
+    uint32_t w;
+
+    for (i = 0; i < MAX_SELECTORS / 32; i++) {
+      w = seg_client_map[current_client][i];
+      while (w) {
+        j = find_bit(w);
+        w &= ~(1U << j);
+        FreeDescriptor((((i << 5) + j) << 3) | 7);
+      }
     }
 }
 
@@ -940,14 +987,20 @@ int ConvertSegmentToDescriptor(unsigned short segment)
 {
   dosaddr_t baseaddr = segment << 4;
   unsigned short selector;
-  int i, ldt_entry;
+  int i, j, ldt_entry;
   D_printf("DPMI: convert seg %#x to desc\n", segment);
-  for (i=1;i<MAX_SELECTORS;i++)
-    if ((Segments(i).base_addr == baseaddr) && segment_get(i, cstd) &&
-	(segment_user(i) == current_client + 1)) {
-      D_printf("DPMI: found descriptor at %#x\n", (i<<3) | 0x0007);
-      return (i<<3) | 0x0007;
+  for (j = 0; in_dpmi && j < MAX_SELECTORS / 32; j++) {
+    uint32_t w = seg_client_map[current_client][j];
+    while (w) {
+      int k = find_bit(w);
+      w &= ~(1U << k);
+      i = (j << 5) + k;
+      if (i && (Segments(i).base_addr == baseaddr) && segment_get(i, cstd)) {
+        D_printf("DPMI: found descriptor at %#x\n", (i<<3) | 0x0007);
+        return (i<<3) | 0x0007;
+      }
     }
+  }
   D_printf("DPMI: SEG at base=%#x not found, allocate a new one\n", baseaddr);
   if (!(selector = AllocateDescriptors(1))) return 0;
   if (SetSelector(selector, baseaddr, 0xffff, 0,
@@ -4126,6 +4179,8 @@ void dpmi_setup(void)
 
     get_ldt(ldt_buffer, LDT_ENTRIES * LDT_ENTRY_SIZE);
     memset(seg_meta, 0, sizeof(seg_meta));
+    memset(seg_used_map, 0, sizeof(seg_used_map));
+    memset(seg_client_map, 0, sizeof(seg_client_map));
     for (i = 0; i < MAX_SELECTORS; i++) {
       lp = (unsigned int *)&ldt_buffer[i * LDT_ENTRY_SIZE];
       base_addr = (*lp >> 16) & 0x0000FFFF;
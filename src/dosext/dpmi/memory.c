@@ -56,12 +56,182 @@ static const int dpmi_reserved_space = 4 * 1024 * 1024; // reserve 4Mb
 
 /* utility routines */
 
-/* I don\'t think these function will ever become bottleneck, so just */
-/* keep it simple, --dong */
+/*
+ * Blocks are kept on a list per root, in a hash by handle and, while
+ * mapped, in an interval tree by address, as some clients allocate
+ * thousands of small blocks. Blocks of one root do not normally
+ * overlap, but the same hardware ram can be mapped twice.
+ */
+#define PM_HASH_MIN 64
+
+static void hash_resize(dpmi_pm_block_root *root, unsigned int size)
+{
+    dpmi_pm_block **hash = calloc(size, sizeof(*hash));
+    dpmi_pm_block *p, *next;
+    unsigned int i;
+
+    if (!hash)
+	return;
+    for (i = 0; i < root->hash_size; i++) {
+	for (p = root->hash[i]; p; p = next) {
+	    next = p->hnext;
+	    p->hnext = hash[p->handle & (size - 1)];
+	    hash[p->handle & (size - 1)] = p;
+	}
+    }
+    free(root->hash);
+    root->hash = hash;
+    root->hash_size = size;
+}
+
+static void hash_insert(dpmi_pm_block_root *root, dpmi_pm_block *p)
+{
+    dpmi_pm_block **b = &root->hash[p->handle & (root->hash_size - 1)];
+
+    p->hnext = *b;
+    *b = p;
+}
+
+static void hash_remove(dpmi_pm_block_root *root, dpmi_pm_block *p)
+{
+    dpmi_pm_block **b = &root->hash[p->handle & (root->hash_size - 1)];
+
+    for (; *b; b = &(*b)->hnext) {
+	if (*b == p) {
+	    *b = p->hnext;
+	    break;
+	}
+    }
+}
+
+static int tree_height(const dpmi_pm_block *t)
+{
+    return t ? t->height : 0;
+}
+
+static void tree_update(dpmi_pm_block *t)
+{
+    int hl = tree_height(t->left), hr = tree_height(t->right);
+
+    t->height = (hl > hr ? hl : hr) + 1;
+    t->max_last = t->base + t->size - 1;
+    if (t->left && t->left->max_last > t->max_last)
+	t->max_last = t->left->max_last;
+    if (t->right && t->right->max_last > t->max_last)
+	t->max_last = t->right->max_last;
+}
+
+static dpmi_pm_block *tree_rotate_right(dpmi_pm_block *t)
+{
+    dpmi_pm_block *l = t->left;
+
+    t->left = l->right;
+    l->right = t;
+    tree_update(t);
+    tree_update(l);
+    return l;
+}
+
+static dpmi_pm_block *tree_rotate_left(dpmi_pm_block *t)
+{
+    dpmi_pm_block *r = t->right;
+
+    t->right = r->left;
+    r->left = t;
+    tree_update(t);
+    tree_update(r);
+    return r;
+}
+
+static dpmi_pm_block *tree_balance(dpmi_pm_block *t)
+{
+    int bf;
+
+    tree_update(t);
+    bf = tree_height(t->left) - tree_height(t->right);
+    if (bf > 1) {
+	if (tree_height(t->left->left) < tree_height(t->left->right))
+	    t->left = tree_rotate_left(t->left);
+	return tree_rotate_right(t);
+    }
+    if (bf < -1) {
+	if (tree_height(t->right->right) < tree_height(t->right->left))
+	    t->right = tree_rotate_right(t->right);
+	return tree_rotate_left(t);
+    }
+    return t;
+}
+
+/* order by base, handles are unique */
+static int tree_less(const dpmi_pm_block *a, const dpmi_pm_block *b)
+{
+    return a->base < b->base || (a->base == b->base && a->handle < b->handle);
+}
+
+static dpmi_pm_block *tree_insert(dpmi_pm_block *t, dpmi_pm_block *p)
+{
+    if (!t) {
+	p->left = p->right = NULL;
+	tree_update(p);
+	return p;
+    }
+    if (tree_less(p, t))
+	t->left = tree_insert(t->left, p);
+    else
+	t->right = tree_insert(t->right, p);
+    return tree_balance(t);
+}
+
+static dpmi_pm_block *tree_remove_min(dpmi_pm_block *t, dpmi_pm_block **min)
+{
+    if (!t->left) {
+	*min = t;
+	return t->right;
+    }
+    t->left = tree_remove_min(t->left, min);
+    return tree_balance(t);
+}
+
+static dpmi_pm_block *tree_remove(dpmi_pm_block *t, dpmi_pm_block *p)
+{
+    dpmi_pm_block *m;
+
+    if (!t)
+	return NULL;
+    if (t != p) {
+	if (tree_less(p, t))
+	    t->left = tree_remove(t->left, p);
+	else
+	    t->right = tree_remove(t->right, p);
+	return tree_balance(t);
+    }
+    if (!t->right)
+	return t->left;
+    m = NULL;
+    t->right = tree_remove_min(t->right, &m);
+    m->left = t->left;
+    m->right = t->right;
+    return tree_balance(m);
+}
+
+/* index a block once its handle, base and size are set */
+static void index_pm_block(dpmi_pm_block_root *root, dpmi_pm_block *p)
+{
+    hash_insert(root, p);
+    root->tree = tree_insert(root->tree, p);
+    p->indexed = 1;
+}
+
 /* alloc_pm_block: allocate a dpmi_pm_block struct and add it to the list */
 static dpmi_pm_block * alloc_pm_block(dpmi_pm_block_root *root, unsigned long size)
 {
-    dpmi_pm_block *p = malloc(sizeof(dpmi_pm_block));
+    dpmi_pm_block *p;
+
+    if (root->count >= root->hash_size * 2)
+	hash_resize(root, root->hash_size ? root->hash_size * 2 : PM_HASH_MIN);
+    if (!root->hash_size)
+	return NULL;
+    p = malloc(sizeof(dpmi_pm_block));
     if(!p)
 	return NULL;
     memset(p, 0, sizeof(*p));
@@ -71,7 +241,10 @@ static dpmi_pm_block * alloc_pm_block(dpmi_pm_block_root *root, unsigned long si
 	return NULL;
     }
     p->next = root->first_pm_block;	/* add it to list */
+    if (p->next)
+	p->next->prev = p;
     root->first_pm_block = p;
+    root->count++;
     p->mapped = 1;
     return p;
 }
@@ -85,28 +258,41 @@ static void * realloc_pm_block(dpmi_pm_block *block, unsigned long newsize)
     return new_addr;
 }
 
+/* move a block in the address tree */
+static void move_pm_block(dpmi_pm_block_root *root, dpmi_pm_block *block,
+	dosaddr_t base, unsigned int size)
+{
+    root->tree = tree_remove(root->tree, block);
+    block->base = base;
+    block->size = size;
+    root->tree = tree_insert(root->tree, block);
+}
+
 /* free_pm_block free a dpmi_pm_block struct and delete it from list */
 static int free_pm_block(dpmi_pm_block_root *root, dpmi_pm_block *p)
 {
-    dpmi_pm_block *tmp = NULL;
-    dpmi_pm_block *next;
     if (!p) return -1;
-    if (p != root->first_pm_block) {
-	for(tmp = root->first_pm_block; tmp; tmp = tmp->next)
-	    if (tmp -> next == p)
-		break;
-	if (!tmp) return -1;
+    if (p->indexed) {
+	hash_remove(root, p);
+	if (p->mapped)
+	    root->tree = tree_remove(root->tree, p);
     }
-    next = p->next;
+    if (p->prev)
+	p->prev->next = p->next;
+    else
+	root->first_pm_block = p->next;
+    if (p->next)
+	p->next->prev = p->prev;
     free(p->attrs);
     free(p->shmname);
     free(p->rshmname);
     free(p->shm_dir);
     free(p);
-    if (tmp)
-	tmp->next = next;
-    else
-	root->first_pm_block = next;
+    if (!--root->count) {
+	free(root->hash);
+	root->hash = NULL;
+	root->hash_size = 0;
+    }
     return 0;
 }
 
@@ -114,7 +300,10 @@ static int free_pm_block(dpmi_pm_block_root *root, dpmi_pm_block *p)
 dpmi_pm_block *lookup_pm_block(dpmi_pm_block_root *root, unsigned long h)
 {
     dpmi_pm_block *tmp;
-    for(tmp = root->first_pm_block; tmp; tmp = tmp->next) {
+
+    if (!root->hash_size)
+	return NULL;
+    for (tmp = root->hash[h & (root->hash_size - 1)]; tmp; tmp = tmp->hnext) {
 	if (tmp -> handle == h)
 	    return tmp;
     }
@@ -124,10 +313,17 @@ dpmi_pm_block *lookup_pm_block(dpmi_pm_block_root *root, unsigned long h)
 dpmi_pm_block *lookup_pm_block_by_addr(dpmi_pm_block_root *root,
 	dosaddr_t addr)
 {
-    dpmi_pm_block *tmp;
-    for(tmp = root->first_pm_block; tmp; tmp = tmp->next) {
-	if (tmp->mapped && addr >= tmp->base && addr < tmp->base + tmp->size)
+    dpmi_pm_block *tmp = root->tree;
+
+    /* if the left subtree reaches addr but has no match, nothing
+     * on the right starts low enough either */
+    while (tmp) {
+	if (addr >= tmp->base && addr < tmp->base + tmp->size)
 	    return tmp;
+	if (tmp->left && tmp->left->max_last >= addr)
+	    tmp = tmp->left;
+	else
+	    tmp = tmp->right;
     }
     return NULL;
 }
@@ -416,6 +612,7 @@ dpmi_pm_block * DPMI_malloc(dpmi_pm_block_root *root, unsigned int size)
     mem_allocd += size;
     block->handle = pm_block_handle_used++;
     block->size = size;
+    index_pm_block(root, block);
     return block;
 }
 
@@ -471,6 +668,7 @@ dpmi_pm_block * DPMI_mallocLinear(dpmi_pm_block_root *root,
 	mem_allocd += size;
     block->handle = pm_block_handle_used++;
     block->size = size;
+    index_pm_block(root, block);
     return block;
 }
 
@@ -493,6 +691,7 @@ dpmi_pm_block * DPMI_mapHWRam(dpmi_pm_block_root *root,
 	block->attrs[i] = 9;
     block->handle = pm_block_handle_used++;
     block->size = size;
+    index_pm_block(root, block);
     return block;
 }
 
@@ -502,12 +701,13 @@ static void do_unmap_hwram(dpmi_pm_block_root *root, dpmi_pm_block *block)
     free_pm_block(root, block);
 }
 
-static void do_unmap_shm(dpmi_pm_block *block)
+static void do_unmap_shm(dpmi_pm_block_root *root, dpmi_pm_block *block)
 {
     int err = restore_mapping(MAPPING_DPMI, block->base, block->size);
     if (err)
         error("restore_mapping() failed\n");
     smfree(&mem_pool, MEM_BASE32(block->base));
+    root->tree = tree_remove(root->tree, block);
     block->mapped = 0;
 }
 
@@ -520,7 +720,7 @@ int DPMI_unmapHWRam(dpmi_pm_block_root *root, dosaddr_t vbase)
         do_unmap_hwram(root, block);
     } else if (block->shm) {
         /* extension: allow unmap shared block as hwram */
-        do_unmap_shm(block);
+        do_unmap_shm(root, block);
         if (!block->shmname)
             free_pm_block(root, block);
     } else {
@@ -548,7 +748,7 @@ int DPMI_free(dpmi_pm_block_root *root, unsigned int handle)
     e_invalidate_full(block->base, block->size);
     if (block->shm) {
 	if (block->mapped)
-	    do_unmap_shm(block);
+	    do_unmap_shm(root, block);
     } else if (block->linear) {
 	for (i = 0; i < block->size >> PAGE_SHIFT; i++) {
 	    if ((block->attrs[i] & 3) == 2)   // mapped
@@ -668,6 +868,7 @@ dpmi_pm_block *DPMI_mallocShared(dpmi_pm_block_root *root,
     ptr->shmname = strdup(name);
     ptr->rshmname = shmname;
     ptr->shlock = shlock;
+    index_pm_block(root, ptr);
     D_printf("DPMI: map shm %s\n", ptr->shmname);
     return ptr;
 
@@ -752,6 +953,7 @@ static dpmi_pm_block *DPMI_mallocSharedNS_common(dpmi_pm_block_root *root,
     ptr->shm_dir = strdup(dname);
     ptr->shlock = shlock;
     ptr->dlock = dlock;
+    index_pm_block(root, ptr);
     D_printf("DPMI: map shm %s\n", ptr->shmname);
     return ptr;
 
@@ -846,7 +1048,7 @@ int DPMI_freeShared(dpmi_pm_block_root *root, uint32_t handle)
     if (!ptr || !ptr->shmname)
         return -1;
     if (ptr->mapped)
-        do_unmap_shm(ptr);
+        do_unmap_shm(root, ptr);
 
     exlock = shlock_open(EXLOCK_DIR, ptr->shmname, 1, 1);
     assert(exlock);
@@ -872,7 +1074,7 @@ int DPMI_freeSharedNS(dpmi_pm_block_root *root, uint32_t handle)
     if (!ptr || !ptr->shmname)
         return -1;
     if (ptr->mapped)
-        do_unmap_shm(ptr);
+        do_unmap_shm(root, ptr);
 
     rc = shlock_close(ptr->shlock);
     ptr->shlock = NULL;
@@ -987,8 +1189,7 @@ dpmi_pm_block * DPMI_realloc(dpmi_pm_block_root *root,
 	return NULL;
 
     finish_realloc(block, newsize, 1);
-    block->base = DOSADDR_REL(ptr);
-    block->size = newsize;
+    move_pm_block(root, block, DOSADDR_REL(ptr), newsize);
     restore_page_protection(block);
     return block;
 }
@@ -1033,8 +1234,7 @@ dpmi_pm_block * DPMI_reallocLinear(dpmi_pm_block_root *root,
     }
 
     finish_realloc(block, newsize, committed);
-    block->base = DOSADDR_REL(ptr);
-    block->size = newsize;
+    move_pm_block(root, block, DOSADDR_REL(ptr), newsize);
     /* restore_page_protection() will set proper prots */
     mprotect_mapping(MAPPING_DPMI, block->base, block->size,
 		PROT_READ | PROT_WRITE | PROT_EXEC);
@@ -20,6 +20,7 @@
  * Author: Stas Sergeev
  */
 #ifdef DOSEMU
+#include "emu.h"
 #include "sig.h"
 #include "utilities.h"
 #endif
@@ -110,6 +111,33 @@ static void do_int_call(cpuctx_t *scp, int is_32, int num,
     _dpmi_simulate_real_mode_interrupt(scp, is_32, num, rmreg);
 }
 
+#ifdef DOSEMU
+/* Files on redirected drives are read or written by mfs at once,
+ * directly from/to the client's buffer. */
+static int lio_direct(cpuctx_t *scp, int (*rw)(int, dosaddr_t, int, int *),
+	dosaddr_t buf, int len)
+{
+    int done = 0;
+    int err;
+
+    if (!len || !dpmi_is_valid_range(buf, len))
+        return 0;
+    err = rw(_LWORD(ebx), buf, len, &done);
+    if (err == -1)
+        return 0;
+    if (err) {
+        D_printf("MSDOS: direct i/o error %x\n", err);
+        _eflags |= CF;
+        _eax = err;
+    } else {
+        D_printf("MSDOS: direct i/o done %i\n", done);
+        _eflags &= ~CF;
+        _eax = done;
+    }
+    return 1;
+}
+#endif
+
 static void lrhlp_thr(void *arg)
 {
     cpuctx_t *scp = arg;
@@ -124,6 +152,13 @@ static void lrhlp_thr(void *arg)
     int len = D_16_32(_ecx);
     int done = 0;
 
+#ifdef DOSEMU
+    if (lio_direct(scp, mfs_lio_read, buf, len)) {
+        if (lio_priv[DOSHLP_LR].post)
+            lio_priv[DOSHLP_LR].post(scp);
+        return;
+    }
+#endif
     if (rm_seg == (unsigned short)-1) {
 	error("RM seg not set\n");
 	doshlp_quit_dpmi(scp);
@@ -188,6 +223,13 @@ static void lwhlp_thr(void *arg)
     int len = D_16_32(_ecx);
     int done = 0;
 
+#ifdef DOSEMU
+    if (lio_direct(scp, mfs_lio_write, buf, len)) {
+        if (lio_priv[DOSHLP_LW].post)
+            lio_priv[DOSHLP_LW].post(scp);
+        return;
+    }
+#endif
     if (rm_seg == (unsigned short)-1) {
 	error("RM seg not set\n");
 	doshlp_quit_dpmi(scp);
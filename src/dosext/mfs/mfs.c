@@ -3300,6 +3300,255 @@ static void update_seek_from_dos(uint32_t seek_from_dos, uint64_t* p_seek) {
   }
 }
 
+/*
+ * Read cnt bytes at the SFT position of an open file to dta and advance
+ * the position. Returns the number of bytes read, or -1 with *err set
+ * to the DOS error code (0 if there is none to report).
+ */
+static int file_read(struct file_fd *f, sft_t sft, dosaddr_t dta, int cnt,
+    int *err)
+{
+  off_t s_pos;
+  int ret;
+  int locked = 0;
+
+  update_seek_from_dos(sft_position(sft), &f->seek);
+  if (cnt) {
+    int cnt1 = cnt;
+    if (!region_is_fully_owned(f->fd, f->seek, cnt, 0, f->mlemu_fds[1]) &&
+        f->seek <= 0xFFFFffff && f->seek + cnt <= 0xFFFFffff) {
+#if 1
+      /* Since we know the region is not fully locked by us (owned),
+       * we pretend to be a writer, even if we are a reader.
+       * This makes sure other's read locks inhibit our unlocked reads.
+       * Quite silly but is needed to pass some DOS compat tests. */
+      int am_i_writer = 1;
+#else
+      int am_i_writer = 0;
+#endif
+      cnt1 = region_lock_offs(f->fd, f->seek, cnt, am_i_writer);
+      if (cnt1 > 0)
+        locked = 1;
+    }
+    assert(cnt1 <= cnt);
+#if 1
+    if (cnt1 == 0) {  // allow partial reads even though DOS does not
+#else
+    if (cnt1 != -1 && cnt1 < cnt) {  // partial reads not allowed
+      if (locked) {
+        region_unlock_offs(f->fd);
+        locked = 0;
+      }
+#endif
+      assert(!locked);
+      Debug0(("error, region already locked\n"));
+      *err = ACCESS_DENIED;
+      return -1;
+    }
+    if (cnt1 != -1)
+      cnt = cnt1;
+  }
+  Debug0(("Read file fd=%d, dta=%#x, cnt=%d\n", f->fd, dta, cnt));
+  Debug0(("Read file pos = %"PRIu64"\n", f->seek));
+  Debug0(("Handle cnt %d\n", sft_handle_cnt(sft)));
+  s_pos = lseek(f->fd, f->seek, SEEK_SET);
+  if (s_pos < 0 && errno != ESPIPE) {
+    if (locked)
+      region_unlock_offs(f->fd);
+    return 0;
+  }
+  Debug0(("Actual pos %"PRIu64"\n", (uint64_t)s_pos));
+
+  ret = dos_read(f->fd, dta, cnt);
+  if (locked)
+    region_unlock_offs(f->fd);
+
+  Debug0(("Read returned : %d\n", ret));
+  if (ret < 0) {
+    Debug0(("ERROR IS: %s\n", strerror(errno)));
+    *err = 0;
+    return -1;
+  }
+  f->seek += ret;
+  set_32bit_size_or_position(&_sft_position(sft), f->seek);
+  if (ret + s_pos > sft_size(sft)) {
+    /* someone else enlarged the file! refresh. */
+    int r2;
+    r2 = fstat(f->fd, &f->st);
+    assert(r2 == 0);
+    f->size = f->st.st_size;
+    set_32bit_size_or_position(&_sft_size(sft), f->size);
+  }
+
+  Debug0(("Read file pos (fseek) after = %"PRIu64"\n", f->seek));
+  return ret;
+}
+
+/*
+ * Write cnt (non-zero) bytes from dta at the SFT position of an open
+ * disk file and advance the position. Returns the number of bytes
+ * written, or -1 with *err set to the DOS error code.
+ */
+static int file_write(struct file_fd *f, sft_t sft, dosaddr_t dta, int cnt,
+    int *err)
+{
+  off_t s_pos;
+  int ret;
+  int locked = 0;
+  int cnt1 = cnt;
+
+  if (!region_is_fully_owned(f->fd, f->seek, cnt, 1, f->mlemu_fds[1]) &&
+      f->seek <= 0xFFFFffff && f->seek + cnt <= 0xFFFFffff) {
+    cnt1 = region_lock_offs(f->fd, f->seek, cnt, 1);
+    if (cnt1 > 0)
+      locked = 1;
+  }
+  assert(cnt1 <= cnt);
+#if 1
+  if (cnt1 == 0) {  // allow partial writes even though DOS does not
+#else
+  if (cnt1 != -1 && cnt1 < cnt) {  // partial writes not allowed
+    if (locked) {
+      region_unlock_offs(f->fd);
+      locked = 0;
+    }
+#endif
+    assert(!locked);
+    Debug0(("error, region already locked\n"));
+    *err = ACCESS_DENIED;
+    return -1;
+  }
+  if (cnt1 != -1)
+    cnt = cnt1;
+
+  s_pos = lseek(f->fd, f->seek, SEEK_SET);
+  if (s_pos < 0 && errno != ESPIPE) {
+    if (locked)
+      region_unlock_offs(f->fd);
+    return 0;
+  }
+  Debug0(("Handle cnt %d\n", sft_handle_cnt(sft)));
+  Debug0(("fsize = %"PRIx64", fseek = %"PRIx64", dta = %#x, cnt = %x\n",
+                f->size, f->seek, dta, (int)cnt));
+  ret = dos_write(f->fd, dta, cnt);
+  if (locked)
+    region_unlock_offs(f->fd);
+
+  if (ret < 0) {
+    Debug0(("Write Failed : %s\n", strerror(errno)));
+    *err = ACCESS_DENIED;
+    return -1;
+  }
+  f->seek += ret;
+  set_32bit_size_or_position(&_sft_position(sft), f->seek);
+  if ((ret + s_pos) > f->size) {
+    f->size = ret + s_pos;
+    set_32bit_size_or_position(&_sft_size(sft), f->size);
+  }
+  Debug0(("write operation done,ret=%x\n", ret));
+  Debug0(("fseek=%"PRIu64", fsize=%"PRIu64"\n", f->seek, f->size));
+  return ret;
+}
+
+/*
+ * Find the open redirected disk file behind a DOS handle of the
+ * current process: PSP -> JFT -> SFT chain of the List of Lists.
+ */
+static struct file_fd *lio_handle_file(int handle, sft_t *p_sft)
+{
+  dosaddr_t psp, tbl;
+  far_t fp;
+  sft_t sft;
+  int idx, drive, fd;
+  unsigned char sfn;
+  struct file_fd *f;
+
+  if (!mfs_enabled || !lol || !sda)
+    return NULL;
+  psp = SEGOFF2LINEAR(sda_cur_psp(sda), 0);
+  if (handle < 0 || handle >= READ_WORD(psp + 0x32))
+    return NULL;
+  fp = rFAR_FARt(READ_DWORD(psp + 0x34));
+  sfn = READ_BYTE(FAR2ADDR(fp) + handle);
+  if (sfn == 0xff)
+    return NULL;
+
+  idx = sfn;
+  fp = rFAR_FARt(READ_DWORD(lol + 4));
+  while (fp.offset != 0xffff) {
+    tbl = FAR2ADDR(fp);
+    if (idx < READ_WORD(tbl + 4))
+      break;
+    idx -= READ_WORD(tbl + 4);
+    fp = rFAR_FARt(READ_DWORD(tbl));
+  }
+  if (fp.offset == 0xffff)
+    return NULL;
+  sft = LINEAR2UNIX(tbl + 6 + idx * sft_record_size);
+
+  drive = SFT_DRIVE(sft);
+  if (drive >= MAX_DRIVE || !drives[drive].root)
+    return NULL;
+  fd = sft_fd(sft);
+  if (fd >= MAX_OPENED_FILES)
+    return NULL;
+  f = &open_files[fd];
+  if (!f->name || f->type != TYPE_DISK)
+    return NULL;
+  *p_sft = sft;
+  return f;
+}
+
+/*
+ * Fast path for the DPMI long read/write helpers: transfer len bytes
+ * between the client's linear buffer and a file on a redirected drive
+ * at once, instead of 64K chunks through a real mode bounce buffer.
+ * Returns -1 if the handle is not ours and DOS has to do it, otherwise
+ * 0 with the byte count in *done, or the DOS error code.
+ */
+int mfs_lio_read(int handle, dosaddr_t buf, int len, int *done)
+{
+  struct file_fd *f;
+  sft_t sft;
+  int ret, err = ACCESS_DENIED;
+
+  if (len <= 0 || (buf < 0xc0000 && buf + len > 0xa0000))
+    return -1;
+  f = lio_handle_file(handle, &sft);
+  if (!f || (sft_open_mode(sft) & 3) == WRITE_ACC)
+    return -1;
+  Debug0(("lio read handle %d fd=%d cnt=%d\n", handle, f->fd, len));
+  ret = file_read(f, sft, buf, len, &err);
+  if (ret < 0)
+    return err ?: ACCESS_DENIED;
+  *done = ret;
+  return 0;
+}
+
+int mfs_lio_write(int handle, dosaddr_t buf, int len, int *done)
+{
+  struct file_fd *f;
+  sft_t sft;
+  int ret, err;
+
+  if (len <= 0 || (buf < 0xc0000 && buf + len > 0xa0000))
+    return -1;
+  f = lio_handle_file(handle, &sft);
+  if (!f || (sft_open_mode(sft) & 3) == READ_ACC ||
+      read_only(drives[SFT_DRIVE(sft)]))
+    return -1;
+  Debug0(("lio write handle %d fd=%d cnt=%d\n", handle, f->fd, len));
+  update_seek_from_dos(sft_position(sft), &f->seek);
+  ret = file_write(f, sft, buf, len, &err);
+  if (ret < 0)
+    return err;
+  /* update stat for atime/mtime */
+  if (fstat(f->fd, &f->st) == 0)
+    time_to_dos(f->st.st_mtime, &_sft_date(sft), &_sft_time(sft));
+  *done = ret;
+  return 0;
+}
+
 static struct file_fd *do_open_prn(const char *filename1, const char *fpath)
 {
     int fd;
@@ -3500,9 +3749,6 @@ static int dos_fs_redirect(struct vm86_regs *state, char *stk)
       return TRUE;
 
     case READ_FILE: { /* 0x08 */
-      int return_val;
-      int locked = 0;
-
       cnt = sft_fd(sft);
       if (cnt >= MAX_OPENED_FILES)
           return FALSE;
@@ -3513,88 +3759,17 @@ static int dos_fs_redirect(struct vm86_regs *state, char *stk)
         return FALSE;
       }
 
-      update_seek_from_dos(sft_position(sft), &f->seek);
-      cnt = WORD(state->ecx);
-      if (cnt) {
-        int cnt1 = cnt;
-        if (!region_is_fully_owned(f->fd, f->seek, cnt, 0, f->mlemu_fds[1]) &&
-            f->seek <= 0xFFFFffff && f->seek + cnt <= 0xFFFFffff) {
-#if 1
-          /* Since we know the region is not fully locked by us (owned),
-           * we pretend to be a writer, even if we are a reader.
-           * This makes sure other's read locks inhibit our unlocked reads.
-           * Quite silly but is needed to pass some DOS compat tests. */
-          int am_i_writer = 1;
-#else
-          int am_i_writer = 0;
-#endif
-          cnt1 = region_lock_offs(f->fd, f->seek, cnt, am_i_writer);
-          if (cnt1 > 0)
-            locked = 1;
-        }
-        assert(cnt1 <= cnt);
-#if 1
-        if (cnt1 == 0) {  // allow partial reads even though DOS does not
-#else
-        if (cnt1 != -1 && cnt1 < cnt) {  // partial reads not allowed
-          if (locked) {
-            region_unlock_offs(f->fd);
-            locked = 0;
-          }
-#endif
-          assert(!locked);
-          Debug0(("error, region already locked\n"));
-          SETWORD(&state->eax, ACCESS_DENIED);
-          return FALSE;
-        }
-        if (cnt1 != -1)
-          cnt = cnt1;
-      }
-      Debug0(("Read file fd=%d, dta=%#x, cnt=%d\n", f->fd, dta, cnt));
-      Debug0(("Read file pos = %"PRIu64"\n", f->seek));
-      Debug0(("Handle cnt %d\n", sft_handle_cnt(sft)));
-      s_pos = lseek(f->fd, f->seek, SEEK_SET);
-      if (s_pos < 0 && errno != ESPIPE) {
-        if (locked)
-          region_unlock_offs(f->fd);
-        SETWORD(&state->ecx, 0);
-        return TRUE;
-      }
-      Debug0(("Actual pos %"PRIu64"\n", (uint64_t)s_pos));
-
-      ret = dos_read(f->fd, dta, cnt);
-      if (locked)
-        region_unlock_offs(f->fd);
-
-      Debug0(("Read returned : %d\n", ret));
-      if (ret < 0) {
-        Debug0(("ERROR IS: %s\n", strerror(errno)));
+      cnt = file_read(f, sft, dta, WORD(state->ecx), &doserrno);
+      if (cnt < 0) {
+        if (doserrno)
+          SETWORD(&state->eax, doserrno);
         return FALSE;
-      } else if (ret < cnt) {
-        SETWORD(&state->ecx, ret);
-        return_val = TRUE;
-      } else {
-        SETWORD(&state->ecx, cnt);
-        return_val = TRUE;
-      }
-      f->seek += ret;
-      set_32bit_size_or_position(&_sft_position(sft), f->seek);
-      if (ret + s_pos > sft_size(sft)) {
-        /* someone else enlarged the file! refresh. */
-        int r2;
-        r2 = fstat(f->fd, &f->st);
-        assert(r2 == 0);
-        f->size = f->st.st_size;
-        set_32bit_size_or_position(&_sft_size(sft), f->size);
       }
-
-      Debug0(("Read file pos (fseek) after = %"PRIu64"\n", f->seek));
-      return (return_val);
+      SETWORD(&state->ecx, cnt);
+      return TRUE;
     }
 
     case WRITE_FILE: { /* 0x09 */
-      int locked = 0;
-
       cnt = sft_fd(sft);
       if (cnt >= MAX_OPENED_FILES)
           return FALSE;
@@ -3627,58 +3802,11 @@ static int dos_fs_redirect(struct vm86_regs *state, char *stk)
         set_32bit_size_or_position(&_sft_size(sft), f->size);
         SETWORD(&state->ecx, 0);
       } else {
-        int cnt1 = cnt;
-        if (!region_is_fully_owned(f->fd, f->seek, cnt, 1, f->mlemu_fds[1]) &&
-            f->seek <= 0xFFFFffff && f->seek + cnt <= 0xFFFFffff) {
-          cnt1 = region_lock_offs(f->fd, f->seek, cnt, 1);
-          if (cnt1 > 0)
-            locked = 1;
-        }
-        assert(cnt1 <= cnt);
-#if 1
-        if (cnt1 == 0) {  // allow partial writes even though DOS does not
-#else
-        if (cnt1 != -1 && cnt1 < cnt) {  // partial writes not allowed
-          if (locked) {
-            region_unlock_offs(f->fd);
-            locked = 0;
-          }
-#endif
-          assert(!locked);
-          Debug0(("error, region already locked\n"));
-          SETWORD(&state->eax, ACCESS_DENIED);
-          return FALSE;
-        }
-        if (cnt1 != -1)
-          cnt = cnt1;
-
-        s_pos = lseek(f->fd, f->seek, SEEK_SET);
-        if (s_pos < 0 && errno != ESPIPE) {
-          if (locked)
-            region_unlock_offs(f->fd);
-          SETWORD(&state->ecx, 0);
-          return TRUE;
-        }
-        Debug0(("Handle cnt %d\n", sft_handle_cnt(sft)));
-        Debug0(("fsize = %"PRIx64", fseek = %"PRIx64", dta = %#x, cnt = %x\n",
-                      f->size, f->seek, dta, (int)cnt));
-        ret = dos_write(f->fd, dta, cnt);
-        if (locked)
-          region_unlock_offs(f->fd);
-
+        ret = file_write(f, sft, dta, cnt, &doserrno);
         if (ret < 0) {
-          Debug0(("Write Failed : %s\n", strerror(errno)));
-          SETWORD(&state->eax, ACCESS_DENIED);
+          SETWORD(&state->eax, doserrno);
           return FALSE;
         }
-        f->seek += ret;
-        set_32bit_size_or_position(&_sft_position(sft), f->seek);
-        if ((ret + s_pos) > f->size) {
-          f->size = ret + s_pos;
-          set_32bit_size_or_position(&_sft_size(sft), f->size);
-        }
-        Debug0(("write operation done,ret=%x\n", ret));
-        Debug0(("fseek=%"PRIu64", fsize=%"PRIu64"\n", f->seek, f->size));
         SETWORD(&state->ecx, ret);
       }
       //    sft_abs_cluster(sft) = 0x174a;	/* XXX a test */
@@ -21,6 +21,7 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -54,6 +55,36 @@ static int early_fd;
 static int rcv_mode;
 static int open_cnt;
 
+/* Received frames are queued here by pkt_rxq_fill(), which is called
+ * from the io thread, and taken by the packet driver or ne2000 on the
+ * main thread. There is one producer and one consumer, so the indices
+ * are all that needs to be synchronized. */
+#define PKT_RXQ_LEN 64		/* power of 2 */
+#define PKT_RXQ_BATCH 16	/* frames read per wakeup at most */
+struct rxq_slot {
+	unsigned len;
+	unsigned char data[PKT_FRAME_SIZE];
+};
+static struct {
+	unsigned head;		/* written by producer */
+	unsigned tail;		/* written by consumer */
+	struct rxq_slot slot[PKT_RXQ_LEN];
+} rxq;
+
+/* Frames sent by DOS are collected here and go out together at the
+ * next hardware_run(), in one syscall where the backend can do that.
+ * Only the main thread touches it. */
+#define PKT_TXQ_LEN 32
+static struct {
+	int fd;
+	int cnt;
+	unsigned len[PKT_TXQ_LEN];
+	unsigned char data[PKT_TXQ_LEN][PKT_FRAME_SIZE];
+	unsigned frames;	/* statistics */
+	unsigned batches;
+	unsigned errors;	/* not yet picked up by pkt_txq_errors() */
+} txq;
+
 /* Should return a unique ID corresponding to this invocation of
    dosemu not clashing with other dosemus. We use a random value and
    hope for the best.
@@ -156,6 +187,8 @@ static int OpenNetworkLinkTap(const char *name, void (*cbk)(int, int))
 	pkt_fd = tun_alloc(devname);
 	if (pkt_fd < 0)
 		return pkt_fd;
+	/* frames are read until EAGAIN */
+	fcntl(pkt_fd, F_SETFL, O_NONBLOCK);
 	cbk(pkt_fd, 6);
 	pd_printf("PKT: Using device %s\n", devname);
 	return 0;
@@ -304,8 +337,12 @@ void CloseNetworkLink(int pkt_fd)
 {
 	if (!open_cnt)
 		return;
-	if (--open_cnt == 0)
+	if (--open_cnt == 0) {
+		pkt_txq_flush();
+		pd_printf("PKT: %u frames sent in %u batches\n",
+			txq.frames, txq.batches);
 		find_ops(config.vnet)->close(pkt_fd);
+	}
 }
 
 /*
@@ -457,49 +494,47 @@ int tun_alloc(char *dev)
       return fd;
 }
 
+/* the fd is non-blocking, so no need to select() first */
 static ssize_t pkt_read_eth(int pkt_fd, void *buf, size_t count)
 {
-    struct timeval tv;
-    fd_set readset;
-
-    tv.tv_sec = 0;				/* set a (small) timeout */
-    tv.tv_usec = 0;
-
-    /* anything ready? */
-    FD_ZERO(&readset);
-    FD_SET(pkt_fd, &readset);
-    /* anything ready? */
-    if (select(pkt_fd + 1, &readset, NULL, NULL, &tv) <= 0)
+    ssize_t ret = read(pkt_fd, buf, count);
+    if (ret < 0 && errno == EAGAIN)
         return 0;
+    return ret;
+}
 
-    if(!FD_ISSET(pkt_fd, &readset))
+#ifdef HAVE_NETPACKET_PACKET_H
+static int pkt_read_multi_eth(int pkt_fd, struct iovec *iov,
+	unsigned *len, int cnt)
+{
+    struct mmsghdr msgs[PKT_RXQ_BATCH];
+    int i, ret;
+
+    assert(cnt <= PKT_RXQ_BATCH);
+    memset(msgs, 0, sizeof(msgs[0]) * cnt);
+    for (i = 0; i < cnt; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    ret = recvmmsg(pkt_fd, msgs, cnt, MSG_DONTWAIT, NULL);
+    if (ret < 0) {
+        if (errno != EAGAIN)
+            pd_printf("PKT: recvmmsg(): %s\n", strerror(errno));
         return 0;
-
-    return read(pkt_fd, buf, count);
+    }
+    for (i = 0; i < ret; i++)
+        len[i] = msgs[i].msg_len;
+    return ret;
 }
+#endif
 
 static ssize_t pkt_read_sock(int pkt_fd, void *buf, size_t count)
 {
-    struct timeval tv;
-    fd_set readset;
     uint32_t tmpbuf;
     uint32_t len;
     int ret;
 
-    tv.tv_sec = 0;				/* set a (small) timeout */
-    tv.tv_usec = 0;
-
-    /* anything ready? */
-    FD_ZERO(&readset);
-    FD_SET(pkt_fd, &readset);
-    /* anything ready? */
-    if (select(pkt_fd + 1, &readset, NULL, NULL, &tv) <= 0)
-        return 0;
-
-    if(!FD_ISSET(pkt_fd, &readset))
-        return 0;
-
-    ret = read(pkt_fd, &tmpbuf, sizeof(tmpbuf));
+    ret = recv(pkt_fd, &tmpbuf, sizeof(tmpbuf), MSG_DONTWAIT);
     if (ret < 4)
         return 0;
     len = ntohl(tmpbuf);
@@ -513,9 +548,79 @@ static ssize_t pkt_read_sock(int pkt_fd, void *buf, size_t count)
     return ret;
 }
 
-ssize_t pkt_read(int fd, void *buf, size_t count)
+static int pkt_read_multi(struct pkt_ops *o, int fd, struct iovec *iov,
+	unsigned *len, int cnt)
 {
-    return find_ops(config.vnet)->pkt_read(fd, buf, count);
+    int i;
+
+    if (o->pkt_read_multi)
+        return o->pkt_read_multi(fd, iov, len, cnt);
+    for (i = 0; i < cnt; i++) {
+        ssize_t ret = o->pkt_read(fd, iov[i].iov_base, iov[i].iov_len);
+        if (ret <= 0)
+            break;
+        len[i] = ret;
+    }
+    return i;
+}
+
+/*
+ *	Read what is pending on fd into the receive queue, as far as it
+ *	has room. Called from the io thread while the fd is masked, so
+ *	this is the only producer. Frames filter() rejects are dropped.
+ *	Returns the number of queued frames.
+ */
+int pkt_rxq_fill(int fd, int (*filter)(const void *frame, size_t len))
+{
+    struct pkt_ops *o = find_ops(config.vnet);
+    struct iovec iov[PKT_RXQ_BATCH];
+    unsigned len[PKT_RXQ_BATCH];
+    unsigned head = rxq.head;
+    unsigned tail = __atomic_load_n(&rxq.tail, __ATOMIC_ACQUIRE);
+    int i, cnt, got, keep;
+
+    do {
+        cnt = _min(PKT_RXQ_LEN - (head - tail), (unsigned)PKT_RXQ_BATCH);
+        if (!cnt)
+            break;
+        for (i = 0; i < cnt; i++) {
+            struct rxq_slot *sl = &rxq.slot[(head + i) % PKT_RXQ_LEN];
+            iov[i].iov_base = sl->data;
+            iov[i].iov_len = sizeof(sl->data);
+        }
+        got = pkt_read_multi(o, fd, iov, len, cnt);
+        for (i = keep = 0; i < got; i++) {
+            struct rxq_slot *sl = &rxq.slot[(head + keep) % PKT_RXQ_LEN];
+            if (filter && !filter(iov[i].iov_base, len[i]))
+                continue;
+            if (keep != i)
+                memcpy(sl->data, iov[i].iov_base, len[i]);
+            sl->len = len[i];
+            keep++;
+        }
+        head += keep;
+        __atomic_store_n(&rxq.head, head, __ATOMIC_RELEASE);
+    } while (got == cnt);
+
+    return head - tail;
+}
+
+/* returns the length of the oldest queued frame, 0 if there is none */
+ssize_t pkt_rxq_peek(const void **frame)
+{
+    unsigned tail = rxq.tail;
+    struct rxq_slot *sl;
+
+    if (__atomic_load_n(&rxq.head, __ATOMIC_ACQUIRE) == tail)
+        return 0;
+    sl = &rxq.slot[tail % PKT_RXQ_LEN];
+    *frame = sl->data;
+    return sl->len;
+}
+
+void pkt_rxq_pop(void)
+{
+    __atomic_store_n(&rxq.tail, rxq.tail + 1, __ATOMIC_RELEASE);
 }
 
 static ssize_t pkt_write_eth(int pkt_fd, const void *buf, size_t count)
@@ -523,11 +628,62 @@ static ssize_t pkt_write_eth(int pkt_fd, const void *buf, size_t count)
     return write(pkt_fd, buf, count);
 }
 
+#ifdef HAVE_NETPACKET_PACKET_H
+static int pkt_write_multi_eth(int pkt_fd, struct iovec *iov, int cnt)
+{
+    struct mmsghdr msgs[PKT_TXQ_LEN];
+    int i, ret, done;
+
+    assert(cnt <= PKT_TXQ_LEN);
+    memset(msgs, 0, sizeof(msgs[0]) * cnt);
+    for (i = 0; i < cnt; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (done = 0; done < cnt; done += ret) {
+        ret = sendmmsg(pkt_fd, msgs + done, cnt - done, 0);
+        if (ret <= 0)
+            break;
+    }
+    return done;
+}
+#endif
+
 static ssize_t pkt_write_sock(int pkt_fd, const void *buf, size_t count)
 {
     uint32_t len = htonl(count);
-    write(pkt_fd, &len, sizeof(len));
-    return write(pkt_fd, buf, count);
+    struct iovec iov[2] = {
+        { .iov_base = &len, .iov_len = sizeof(len) },
+        { .iov_base = (void *)(uintptr_t)buf, .iov_len = count },
+    };
+    ssize_t ret = writev(pkt_fd, iov, 2);
+    if (ret < 0)
+        return ret;
+    return _max(ret - (ssize_t)sizeof(len), (ssize_t)0);
+}
+
+/* every frame gets its length prefix, all in one writev() */
+static int pkt_write_multi_sock(int pkt_fd, struct iovec *iov, int cnt)
+{
+    struct iovec v[PKT_TXQ_LEN * 2];
+    uint32_t len[PKT_TXQ_LEN];
+    ssize_t total = 0, ret;
+    int i;
+
+    assert(cnt <= PKT_TXQ_LEN);
+    for (i = 0; i < cnt; i++) {
+        len[i] = htonl(iov[i].iov_len);
+        v[i * 2].iov_base = &len[i];
+        v[i * 2].iov_len = sizeof(len[i]);
+        v[i * 2 + 1] = iov[i];
+        total += sizeof(len[i]) + iov[i].iov_len;
+    }
+    ret = writev(pkt_fd, v, cnt * 2);
+    if (ret < total) {
+        error("PKT: expected to send %zi bytes but sent %zi\n", total, ret);
+        return 0;
+    }
+    return cnt;
 }
 
 ssize_t pkt_write(int fd, const void *buf, size_t count)
@@ -535,6 +691,64 @@ ssize_t pkt_write(int fd, const void *buf, size_t count)
     return find_ops(config.vnet)->pkt_write(fd, buf, count);
 }
 
+/*
+ *	Queue a frame for sending at the next pkt_txq_flush(). Frames that
+ *	don't fit in a slot are sent right away, after what is queued.
+ */
+int pkt_txq_put(int fd, const void *buf, size_t count)
+{
+    if (count > PKT_FRAME_SIZE) {
+        pkt_txq_flush();
+        return pkt_write(fd, buf, count);
+    }
+    if (txq.cnt == PKT_TXQ_LEN)
+        pkt_txq_flush();
+    txq.fd = fd;
+    memcpy(txq.data[txq.cnt], buf, count);
+    txq.len[txq.cnt++] = count;
+    return count;
+}
+
+void pkt_txq_flush(void)
+{
+    struct pkt_ops *o;
+    struct iovec iov[PKT_TXQ_LEN];
+    int i, sent;
+
+    if (!txq.cnt)
+        return;
+    o = find_ops(config.vnet);
+    for (i = 0; i < txq.cnt; i++) {
+        iov[i].iov_base = txq.data[i];
+        iov[i].iov_len = txq.len[i];
+    }
+    if (o->pkt_write_multi) {
+        sent = o->pkt_write_multi(txq.fd, iov, txq.cnt);
+    } else {
+        sent = 0;
+        for (i = 0; i < txq.cnt; i++) {
+            if (o->pkt_write(txq.fd, iov[i].iov_base, iov[i].iov_len) >= 0)
+                sent++;
+        }
+    }
+    if (sent < txq.cnt) {
+        pd_printf("PKT: %i of %i frames not sent: %s\n", txq.cnt - sent,
+            txq.cnt, strerror(errno));
+        txq.errors += txq.cnt - sent;
+    }
+    txq.frames += txq.cnt;
+    txq.batches++;
+    txq.cnt = 0;
+}
+
+/* returns the number of failed sends since the last call */
+unsigned pkt_txq_errors(void)
+{
+    unsigned ret = txq.errors;
+    txq.errors = 0;
+    return ret;
+}
+
 int pkt_register_backend(struct pkt_ops *o)
 {
     int idx = num_backends++;
@@ -552,6 +766,8 @@ static struct pkt_ops eth_ops = {
 	.get_MTU = GetDeviceMTUEth,
 	.pkt_read = pkt_read_eth,
 	.pkt_write = pkt_write_eth,
+	.pkt_read_multi = pkt_read_multi_eth,
+	.pkt_write_multi = pkt_write_multi_eth,
 };
 #endif
 
@@ -563,6 +779,7 @@ static struct pkt_ops sock_ops = {
 	.get_MTU = GetDeviceMTUTap,
 	.pkt_read = pkt_read_sock,
 	.pkt_write = pkt_write_sock,
+	.pkt_write_multi = pkt_write_multi_sock,
 };
 
 static struct pkt_ops tap_ops = {
@@ -51,6 +51,7 @@
 #include "utilities.h"
 #include "emudpmi.h"
 #include "ioselect.h"
+#include "sig.h"
 
 #ifndef ETH_FRAME_LEN
 #define ETH_FRAME_LEN   1514
@@ -79,6 +80,9 @@ static enum VirqHwRet pkt_virq_receive(void *arg);
 static enum VirqSwRet pkt_receiver_callback(void *arg);
 static void pkt_receiver_callback_thr(void *arg);
 static void pkt_register_net_fd_and_mode(int fd, int mode);
+static int pkt_rx_filter(const void *frame, size_t len);
+static void pkt_rx_unmask(void *arg);
+static void build_type_hash(void);
 static Bit32u PKTRcvCall_TID;
 static Bit16u pkt_hlt_off;
 
@@ -96,6 +100,24 @@ struct pkt_type {
 } pkt_type_array[MAX_HANDLE];
 int max_pkt_type_array=0;
 
+/* Dispatch table for Find_Handle(): the bucket of a frame is picked by
+   the first two bytes of its type field. Each bucket lists, in
+   pkt_type_array order, the entries that may match such a frame, so
+   the first match is the same as with a scan of the whole array.
+   Rebuilt whenever pkt_type_array changes. */
+#define TYPE_HASH_SIZE 64
+static struct {
+    int cnt;
+    unsigned char idx[MAX_HANDLE];
+} type_hash[TYPE_HASH_SIZE];
+
+/* The same for the io thread, which drops frames nobody registered for
+   before they are queued: one bit per value of the first two type
+   bytes, or everything if there is a type shorter than that. Updated
+   word by word, a frame racing with a registration may be misjudged. */
+static uint32_t type_filter[0x10000 / 32];
+static int type_filter_all;
+
 #define PKT_BUF_SIZE (ETH_FRAME_LEN+32)
 
 /* flags from config file, for pkt_globs.flags */
@@ -190,6 +212,7 @@ pkt_reset(void)
     WRITE_WORD(SEGOFF2LINEAR(PKTDRV_SEG, PKTDRV_driver_entry_cs), BIOS_HLT_BLK_SEG);
 
     max_pkt_type_array = 0;
+    build_type_hash();
     for (handle = 0; handle < MAX_HANDLE; handle++)
         pg.handle[handle].in_use = 0;
 }
@@ -405,7 +428,7 @@ static int pkt_int(void)
 		    }
 	}
 
-	if (pkt_write(pkt_fd, SEG_ADR((char *), ds, si), LWORD(ecx)) >= 0) {
+	if (pkt_txq_put(pkt_fd, SEG_ADR((char *), ds, si), LWORD(ecx)) >= 0) {
 	    pd_printf("Write to net was ok\n");
 	    return 1;
 	}
@@ -471,6 +494,9 @@ static int pkt_int(void)
 	    HI(dx) = E_BAD_HANDLE;
 	    break;
 	}
+	/* sends are deferred, so are their errors */
+	pkt_txq_flush();
+	p_stats->errors_out += pkt_txq_errors();
 	SREG(ds) = PKTDRV_SEG;
 	REG(esi) = PKTDRV_stats;
 	return 1;
@@ -500,9 +526,13 @@ static void pkt_hlt(Bit16u idx, HLT_ARG(arg))
     pkt_int();
 }
 
+/* runs in the io thread, the fd stays masked until the queue is drained */
 static void pkt_receive_req_async(int fd, void *arg)
 {
-    virq_raise(VIRQ_PKT);
+    if (pkt_rxq_fill(fd, pkt_rx_filter))
+        virq_raise(VIRQ_PKT);
+    else	/* nothing for DOS, only unmask the fd */
+        add_thread_callback(pkt_rx_unmask, NULL, "pkt unmask");
 }
 
 static void pkt_register_net_fd_and_mode(int fd, int mode)
@@ -514,6 +544,69 @@ static void pkt_register_net_fd_and_mode(int fd, int mode)
     pd_printf("PKT: detected receive mode %i\n", mode);
 }
 
+static const u_char *frame_type(const u_char *buf)
+{
+    const struct ethhdr *eth = (const struct ethhdr *) buf;
+
+    /* find this packet's frame type, and hence position to compare the type */
+    if (ntohs(eth->h_proto) >= 1536)
+	return buf + 2 * ETH_ALEN;		/* Ethernet-II */
+    return buf + 2 * ETH_ALEN + 2;	/* All the rest frame types. */
+}
+
+static unsigned type_hash_fn(const u_char *p)
+{
+    return ((p[0] * 31) ^ p[1]) % TYPE_HASH_SIZE;
+}
+
+static void build_type_hash(void)
+{
+    uint32_t filter[ARRAY_SIZE(type_filter)] = {};
+    int i, j, all = 0;
+
+    for (j = 0; j < TYPE_HASH_SIZE; j++)
+	type_hash[j].cnt = 0;
+    for (i = 0; i < max_pkt_type_array; i++) {
+	const u_char *t = pkt_type_array[i].pkt_type;
+	if (pkt_type_array[i].pkt_type_len < 2) {
+	    all = 1;
+	    for (j = 0; j < TYPE_HASH_SIZE; j++)
+		type_hash[j].idx[type_hash[j].cnt++] = i;
+	} else {
+	    unsigned key = (t[0] << 8) | t[1];
+	    j = type_hash_fn(t);
+	    type_hash[j].idx[type_hash[j].cnt++] = i;
+	    filter[key / 32] |= 1U << (key % 32);
+	}
+    }
+
+    for (j = 0; j < ARRAY_SIZE(filter); j++)
+	__atomic_store_n(&type_filter[j], filter[j], __ATOMIC_RELAXED);
+    __atomic_store_n(&type_filter_all, all, __ATOMIC_RELEASE);
+}
+
+/* runs in the io thread, says if a frame may have a receiver */
+static int pkt_rx_filter(const void *frame, size_t len)
+{
+    const u_char *p;
+    unsigned key;
+
+    if (__atomic_load_n(&local_receive_mode, __ATOMIC_RELAXED) == 1)
+	return 0;
+    if (len < 2 * ETH_ALEN + 4 ||
+	    __atomic_load_n(&type_filter_all, __ATOMIC_ACQUIRE))
+	return 1;
+    p = frame_type(frame);
+    key = (p[0] << 8) | p[1];
+    return !!(__atomic_load_n(&type_filter[key / 32], __ATOMIC_RELAXED) &
+	    (1U << (key % 32)));
+}
+
+static void pkt_rx_unmask(void *arg)
+{
+    ioselect_complete(pkt_fd);
+}
+
 /* register a new packet type */
 static int
 Insert_Type(int handle, int pkt_type_len, Bit8u *pkt_type)
@@ -543,6 +636,7 @@ Insert_Type(int handle, int pkt_type_len, Bit8u *pkt_type)
     pd_printf("\n");
     pd_printf("Succeeded: inserted at %d\n", max_pkt_type_array);
     max_pkt_type_array++;
+    build_type_hash();
     return 0;
 }
 
@@ -557,8 +651,10 @@ Remove_Type(int handle)
 	else if (pkt_type_array[i].handle == handle)
 	    shift_up=1;
     }
-    if (shift_up)
+    if (shift_up) {
 	max_pkt_type_array--;
+	build_type_hash();
+    }
     return 0;
 }
 
@@ -596,26 +692,11 @@ out:
     REGS = rcv_saved_regs;
 }
 
-static int pkt_receive(void)
+static int pkt_deliver(int size)
 {
-    int size, handle;
+    int handle;
     struct per_handle *hdlp;
 
-    if (!config.pktdrv) {
-        pd_printf("Driver not initialized ...\n");
-	return 0;
-    }
-    if (local_receive_mode == 1)
-	return 0;
-
-    size = pkt_read(pkt_fd, pkt_buf, PKT_BUF_SIZE);
-    if (size < 0) {
-        p_stats->errors_in++;		/* select() somehow lied */
-        return 0;
-    }
-    if (size == 0)
-	return 0;
-
     pd_printf("========Processing New packet======\n");
     handle = Find_Handle(pkt_buf);
     if (handle == -1)
@@ -676,6 +757,33 @@ static int pkt_receive(void)
     return 0;
 }
 
+/* Takes queued frames until one goes to a DOS receiver. Frames nobody
+   wants are dropped on the way, so the queue doesn't stall on them. */
+static int pkt_receive(void)
+{
+    const void *frame;
+    ssize_t size;
+    int ret;
+
+    if (!config.pktdrv) {
+        pd_printf("Driver not initialized ...\n");
+	return 0;
+    }
+
+    while ((size = pkt_rxq_peek(&frame)) > 0) {
+	ret = 0;
+	if (local_receive_mode != 1) {
+	    size = _min(size, (ssize_t)PKT_BUF_SIZE);
+	    memcpy(pkt_buf, frame, size);
+	    ret = pkt_deliver(size);
+	}
+	pkt_rxq_pop();
+	if (ret)
+	    return 1;
+    }
+    return 0;
+}
+
 static enum VirqHwRet pkt_virq_receive(void *arg)
 {
     int rc = pkt_receive();
@@ -695,20 +803,17 @@ Find_Handle(u_char *buf)
 {
     int i, nchars;
     struct ethhdr *eth = (struct ethhdr *) buf;
-    u_char *p;
+    const u_char *p = frame_type(buf);
+    const typeof(type_hash[0]) *b = &type_hash[type_hash_fn(p)];
 
-    /* find this packet's frame type, and hence position to compare the type */
-    if (ntohs(eth->h_proto) >= 1536)
-	p = buf + 2 * ETH_ALEN;		/* Ethernet-II */
-    else
-	p = buf + 2 * ETH_ALEN + 2;     /* All the rest frame types. */
     pd_printf("Received packet type: 0x%x\n", ntohs(eth->h_proto));
 
-    for(i=0; i<max_pkt_type_array; i++) {
-	nchars = pkt_type_array[i].pkt_type_len;
+    for(i=0; i<b->cnt; i++) {
+	struct pkt_type *t = &pkt_type_array[b->idx[i]];
+	nchars = t->pkt_type_len;
 	if ( /* nchars < 2 || */
-	     !memcmp(&pkt_type_array[i].pkt_type, p, nchars) )
-	    return pkt_type_array[i].handle;
+	     !memcmp(&t->pkt_type, p, nchars) )
+	    return t->handle;
     }
     return -1;
 }
@@ -69,7 +69,7 @@ extern int IsDpmiEmu;
 
 void enter_cpu_emu(void);
 void leave_cpu_emu(void);
-void avltr_destroy(void);
+void blkdir_destroy(void);
 int e_vm86(void);
 
 /* called from dpmi.c */
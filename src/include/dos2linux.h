@@ -350,6 +350,7 @@ void memset_dos(dosaddr_t dest, char ch, size_t n);
 
 int unix_read(int fd, void *data, int cnt);
 int dos_read(int fd, unsigned data, int cnt);
+int dos_pread(int fd, unsigned data, int cnt, off_t offs);
 int unix_write(int fd, const void *data, int cnt);
 int dos_write(int fd, unsigned data, int cnt);
 int com_vsprintf(char *str, const char *format, va_list ap);
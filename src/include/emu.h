@@ -157,6 +157,7 @@ typedef struct config_info {
        #define EMU_FULL() (EMU_V86() && EMU_DPMI())
        #define IS_EMU() (EMU_V86() || EMU_DPMI())
        boolean cpusim;
+       char *cpuemu_tcache;
 #endif
        int cpu_vm;
        int cpu_vm_dpmi;
@@ -247,6 +248,7 @@ typedef struct config_info {
        boolean vbios_post;
 
        int  fastfloppy;
+       boolean fatfs_cache;	/* keep scanned fatfs dirs across runs */
        char *emusys;		/* map CONFIG.SYS to CONFIG.EMU */
 
        u_short speaker;		/* 0 off, 1 native, 2 emulated */
@@ -397,6 +399,8 @@ extern void real_run_int(int);
 extern void mfs_reset(void);
 extern void mfs_done(void);
 extern int mfs_redirector(struct vm86_regs *regs, char *stk, int revect);
+extern int mfs_lio_read(int handle, dosaddr_t buf, int len, int *done);
+extern int mfs_lio_write(int handle, dosaddr_t buf, int len, int *done);
 extern int mfs_fat32(void);
 extern int mfs_lfn(void);
 extern int int10(void);
@@ -11,5 +11,16 @@ int GetDeviceHardwareAddress(unsigned char *);
 int GetDeviceMTU(void);
 
 void pkt_io_select(void(*)(void *), void *);
-ssize_t pkt_read(int fd, void *buf, size_t count);
 ssize_t pkt_write(int fd, const void *buf, size_t count);
+
+#define PKT_FRAME_SIZE (1514 + 32)
+
+/* receive queue, filled from the io thread, drained by the consumer */
+int pkt_rxq_fill(int fd, int (*filter)(const void *frame, size_t len));
+ssize_t pkt_rxq_peek(const void **frame);
+void pkt_rxq_pop(void);
+
+/* transmit queue, flushed from hardware_run() */
+int pkt_txq_put(int fd, const void *buf, size_t count);
+void pkt_txq_flush(void);
+unsigned pkt_txq_errors(void);
@@ -90,6 +90,7 @@ extern void pkt_init (void);
 extern void pkt_reset (void);
 extern void pkt_term (void);
 
+struct iovec;
 struct pkt_ops {
     int id;
     int (*open)(const char *name, void (*cbk)(int, int));
@@ -98,6 +99,11 @@ struct pkt_ops {
     int (*get_MTU)(void);
     ssize_t (*pkt_read)(int fd, void *buf, size_t count);
     ssize_t (*pkt_write)(int fd, const void *buf, size_t count);
+    /* optional, reads up to cnt frames, returns the number of frames read */
+    int (*pkt_read_multi)(int fd, struct iovec *iov, unsigned *len,
+	    int cnt);
+    /* optional, sends cnt frames, returns the number of frames sent */
+    int (*pkt_write_multi)(int fd, struct iovec *iov, int cnt);
 #define PFLG_ASYNC 1
     unsigned flags;
 };
@@ -25,6 +25,11 @@ typedef struct {
   void          (* write_portw)(ioport_t port, Bit16u word, void *arg);
   Bit32u        (* read_portd)(ioport_t port, void *arg);
   void          (* write_portd)(ioport_t port, Bit32u word, void *arg);
+  /* optional block transfer for REP INSW/OUTSW, NULL means word by word */
+  void          (* read_portw_rep)(ioport_t port, Bit16u *dest, int df,
+				   Bit32u count, void *arg);
+  void          (* write_portw_rep)(ioport_t port, Bit16u *src, int df,
+				    Bit32u count, void *arg);
   const char   *handler_name;
   ioport_t      start_addr;
   ioport_t      end_addr;
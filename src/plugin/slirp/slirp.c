@@ -98,7 +98,8 @@ static ssize_t pkt_read_slirp(int pkt_fd, void *buf, size_t count)
     len = vdeslirp_recv(myslirp, buf, count);
     if (len == 0) {
 	error("slirp unexpectedly terminated\n");
-	leavedos(3);
+	/* called from the io thread by pkt_rxq_fill() */
+	leavedos_from_thread(3);
     }
     if (len < 0)
 	error("recv() returned %zi, %s\n", len, strerror(errno));
@@ -263,7 +263,8 @@ static ssize_t pkt_read_vde(int pkt_fd, void *buf, size_t count)
     len = vde_recv(vde, buf, count, MSG_DONTWAIT);
     if (len == 0) {
 	error("VDE unexpectedly terminated\n");
-	leavedos(3);
+	/* called from the io thread by pkt_rxq_fill() */
+	leavedos_from_thread(3);
     }
     if (len < 0)
 	error("recv() returned %zi, %s\n", len, strerror(errno));